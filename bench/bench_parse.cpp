@@ -0,0 +1,221 @@
+//
+//  bench_parse.cpp
+//
+//  Parser benchmarks over synthetic VHDL
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <new>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+using namespace std;
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "corpus.hpp"
+#include "parse.hpp"
+
+// Every allocation through operator new is counted, so that each benchmark
+// can say how many it made per byte of VHDL
+static atomic<size_t> allocations{0};
+
+void *operator new(size_t n) {
+  allocations.fetch_add(1, memory_order_relaxed);
+  if (auto p = malloc(n ? n : 1)) { return p; }
+  throw bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Every corpus is made once and then shared
+static const string &corpus(size_t kb, CorpusKind kind) {
+  static map<pair<size_t, CorpusKind>, string> made;
+  auto &text = made[{kb, kind}];
+  if (text.empty()) { text = make_vhdl_corpus(kb * 1024, kind); }
+  return text;
+}
+
+// The peak resident set size in MB. On Linux the peak is reset before each
+// benchmark, after handing freed memory back, so it's that benchmark's own;
+// elsewhere it's the process's.
+static void reset_peak_rss() {
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+  ofstream("/proc/self/clear_refs") << "5";
+}
+
+static double peak_rss_mb() {
+  ifstream status("/proc/self/status");
+  string line;
+  while (getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return stod(line.substr(6)) / 1024;
+    }
+  }
+#ifndef _WIN32
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_maxrss) / 1024;
+#else
+  return 0;
+#endif
+}
+
+// Throughput, tree size, allocations and memory, the same for every
+// benchmark. 'allocs' is the number made by all the iterations.
+static void report(benchmark::State &state, const string &text, size_t nodes,
+                   size_t allocs) {
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(text.size()));
+  state.SetComplexityN(static_cast<int64_t>(text.size()));
+  state.counters["nodes"] = static_cast<double>(nodes);
+  state.counters["nodes/s"] = benchmark::Counter(
+      static_cast<double>(nodes),
+      benchmark::Counter::kIsIterationInvariantRate);
+  state.counters["allocs/byte"] =
+      static_cast<double>(allocs) /
+      (static_cast<double>(state.iterations()) *
+       static_cast<double>(text.size()));
+  state.counters["peak_MB"] = peak_rss_mb();
+}
+
+static void parse(benchmark::State &state, Vhdl2008Options options,
+                  CorpusKind kind) {
+  auto &text = corpus(static_cast<size_t>(state.range(0)), kind);
+  auto &parser = Vhdl2008Parser::instance();
+
+  // The interpreter compiles the grammar the first time it's used
+  peg::CompactAst warm_up;
+  parser.parse("", 0, warm_up, nullptr, nullptr, options);
+
+  reset_peak_rss();
+  size_t nodes = 0;
+  auto allocs = allocations.load();
+  for (auto _ : state) {
+    peg::CompactAst ast;
+    if (!parser.parse(text.data(), text.size(), ast, "corpus.vhd", nullptr,
+                      options)) {
+      state.SkipWithError("the corpus has a syntax error");
+      return;
+    }
+    nodes = ast.size();
+    benchmark::DoNotOptimize(ast);
+  }
+  report(state, text, nodes, allocations.load() - allocs);
+}
+
+// Somewhere to print to that costs nothing
+class NullBuffer : public streambuf {
+protected:
+  int_type overflow(int_type c) override { return c; }
+  streamsize xsputn(const char *, streamsize n) override { return n; }
+};
+
+static void write_text(benchmark::State &state, bool indent) {
+  auto &text = corpus(static_cast<size_t>(state.range(0)), CorpusKind::Mixed);
+  peg::CompactAst ast;
+  if (!Vhdl2008Parser::instance().parse(text.data(), text.size(), ast)) {
+    state.SkipWithError("the corpus has a syntax error");
+    return;
+  }
+
+  NullBuffer null;
+  ostream os(&null);
+  reset_peak_rss();
+  auto allocs = allocations.load();
+  for (auto _ : state) {
+    peg::OutputBuffer out(os);
+    peg::write_text(ast, out, indent);
+  }
+  report(state, text, ast.size(), allocations.load() - allocs);
+}
+
+int main(int argc, char *argv[]) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) { return 1; }
+
+  Vhdl2008Options generated, split, interpreter;
+  split.threads = max(1u, thread::hardware_concurrency());
+  interpreter.engine = Vhdl2008Engine::Interpreter;
+
+  // Scaling with file size, for each engine
+  if (Vhdl2008Parser::has_generated()) {
+    benchmark::RegisterBenchmark("parse/generated", parse, generated,
+                                 CorpusKind::Mixed)
+        ->RangeMultiplier(4)
+        ->Range(64, 4096)
+        ->Complexity(benchmark::oN)
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("parse/generated_split", parse, split,
+                                 CorpusKind::Mixed)
+        ->Arg(4096)
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+  }
+  benchmark::RegisterBenchmark("parse/interpreter", parse, interpreter,
+                               CorpusKind::Mixed)
+      ->RangeMultiplier(4)
+      ->Range(64, 1024)
+      ->Complexity(benchmark::oN)
+      ->Unit(benchmark::kMillisecond);
+
+  // Each kind of code on its own, to see which part of the grammar moved
+  for (auto kind : {CorpusKind::Expressions, CorpusKind::PortMaps,
+                    CorpusKind::CaseStatements, CorpusKind::RegisterPackages,
+                    CorpusKind::Comments}) {
+    auto name = string("kind/") + corpus_kind_name(kind);
+    benchmark::RegisterBenchmark(name.c_str(), parse,
+                                 Vhdl2008Parser::has_generated() ? generated
+                                                                 : interpreter,
+                                 kind)
+        ->Arg(512)
+        ->Unit(benchmark::kMillisecond);
+  }
+
+  benchmark::RegisterBenchmark("output/text", write_text, true)
+      ->Arg(1024)
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("output/compact", write_text, false)
+      ->Arg(1024)
+      ->Unit(benchmark::kMillisecond);
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,342 @@
+//
+//  corpus.cpp
+//
+//  Synthetic VHDL for benchmarking the parser
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+
+#include <cstdio>
+#include <string>
+using namespace std;
+
+#include "corpus.hpp"
+
+namespace {
+
+static constexpr const char *kind_names[] = {
+    "mixed",    "expressions",       "port_maps",
+    "case",     "register_packages", "comments",
+};
+
+// Words for identifiers and comments
+static constexpr const char *words[] = {
+    "data",  "addr",   "valid", "ready", "count", "state", "fifo",  "burst",
+    "cfg",   "status", "irq",   "mask",  "level", "tx",    "rx",    "byte",
+    "word",  "enable", "clear", "error", "timer", "phase", "width", "depth",
+    "flag",  "sel",    "mode",  "acc",   "sum",   "carry", "shift", "pad",
+};
+static constexpr size_t word_count = sizeof(words) / sizeof(words[0]);
+
+class Generator {
+public:
+  Generator(uint64_t seed) : state_(seed) {}
+
+  void unit(CorpusKind kind, size_t n) {
+    switch (kind) {
+    case CorpusKind::Expressions: expressions(n); break;
+    case CorpusKind::PortMaps: port_maps(n); break;
+    case CorpusKind::CaseStatements: case_statement(n); break;
+    case CorpusKind::RegisterPackages: register_package(n); break;
+    case CorpusKind::Comments: comments(n); break;
+    case CorpusKind::Mixed: break;
+    }
+  }
+
+  string &text() { return out_; }
+
+private:
+  // splitmix64, so the text doesn't depend on the standard library
+  uint64_t next() {
+    uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+  size_t below(size_t n) { return static_cast<size_t>(next() % n); }
+  const char *word() { return words[below(word_count)]; }
+
+  void line(size_t indent, const string &s) {
+    out_.append(indent * 2, ' ');
+    out_ += s;
+    out_ += '\n';
+  }
+
+  string name(const char *prefix, size_t n) {
+    return string(prefix) + word() + "_" + to_string(n);
+  }
+
+  void context() {
+    line(0, "library ieee;");
+    line(0, "use ieee.std_logic_1164.all;");
+    line(0, "use ieee.numeric_std.all;");
+    line(0, "");
+  }
+
+  void comment_block(size_t lines) {
+    line(0, string(79, '-'));
+    for (size_t i = 0; i < lines; i++) {
+      string s = "--";
+      auto count = 4 + below(10);
+      for (size_t j = 0; j < count; j++) {
+        s += ' ';
+        s += word();
+      }
+      line(0, s);
+    }
+    line(0, string(79, '-'));
+  }
+
+  // An expression 'depth' levels deep over the signals s_0 to s_{n-1}
+  string expression(size_t depth, size_t n) {
+    if (depth == 0) {
+      switch (below(4)) {
+      case 0: return "s_" + to_string(below(n));
+      case 1: return to_string(below(1000));
+      case 2: return "resize(s_" + to_string(below(n)) + ", 32)";
+      default: return "s_" + to_string(below(n)) + "(7 downto 0)";
+      }
+    }
+    static constexpr const char *ops[] = {" + ", " - ", " * ", " and ",
+                                          " or ", " xor "};
+    auto left = expression(depth - 1, n);
+    auto right = expression(below(depth), n);
+    return "(" + left + ops[below(6)] + right + ")";
+  }
+
+  string condition(size_t depth, size_t n) {
+    static constexpr const char *relations[] = {" = ", " /= ", " < ",
+                                                " >= "};
+    auto s = "(" + expression(depth, n) + relations[below(4)] +
+             expression(depth / 2, n) + ")";
+    return below(2) ? s : s + " and s_" + to_string(below(n)) + " /= 0";
+  }
+
+  void expressions(size_t n) {
+    auto signals = 8 + below(16);
+    auto entity = name("calc_", n);
+    context();
+    line(0, "entity " + entity + " is");
+    line(1, "port (");
+    line(2, "clk : in std_logic;");
+    line(2, "o_result : out unsigned(31 downto 0)");
+    line(2, ");");
+    line(0, "end entity " + entity + ";");
+    line(0, "");
+    line(0, "architecture rtl of " + entity + " is");
+    for (size_t i = 0; i < signals; i++) {
+      line(1, "signal s_" + to_string(i) + " : unsigned(31 downto 0);");
+    }
+    line(0, "begin");
+    for (size_t i = 0; i < signals; i++) {
+      line(1, "s_" + to_string(i) + " <= " + expression(3 + below(4), signals) +
+                  ";");
+    }
+    line(1, "process (clk)");
+    line(1, "begin");
+    line(2, "if rising_edge(clk) then");
+    line(3, "if " + condition(3, signals) + " then");
+    line(4, "o_result <= " + expression(5, signals) + ";");
+    line(3, "elsif " + condition(2, signals) + " then");
+    line(4, "o_result <= " + expression(4, signals) + ";");
+    line(3, "else");
+    line(4, "o_result <= s_0;");
+    line(3, "end if;");
+    line(2, "end if;");
+    line(1, "end process;");
+    line(0, "end architecture rtl;");
+    line(0, "");
+  }
+
+  void port_maps(size_t n) {
+    auto ports = 16 + below(48);
+    auto block = name("blk_", n);
+    context();
+    line(0, "entity " + block + " is");
+    line(1, "generic (");
+    line(2, "G_WIDTH : natural := " + to_string(8 << below(3)) + ";");
+    line(2, "G_DEPTH : natural := " + to_string(16 << below(4)));
+    line(2, ");");
+    line(1, "port (");
+    line(2, "clk : in std_logic;");
+    line(2, "rst : in std_logic;");
+    for (size_t i = 0; i < ports; i++) {
+      auto dir = i % 2 ? "out" : "in";
+      auto sep = i + 1 < ports ? ";" : "";
+      line(2, string("p_") + to_string(i) + " : " + dir +
+                  " std_logic_vector(G_WIDTH - 1 downto 0)" + sep);
+    }
+    line(2, ");");
+    line(0, "end entity " + block + ";");
+    line(0, "");
+    line(0, "architecture structural of " + block + " is");
+    for (size_t i = 0; i < ports; i++) {
+      line(1, "signal w_" + to_string(i) +
+                  " : std_logic_vector(G_WIDTH - 1 downto 0);");
+    }
+    line(0, "begin");
+    auto instances = 2 + below(4);
+    for (size_t u = 0; u < instances; u++) {
+      line(1, "u_" + to_string(u) + " : entity work." + block);
+      line(2, "generic map (");
+      line(3, "G_WIDTH => G_WIDTH,");
+      line(3, "G_DEPTH => G_DEPTH / " + to_string(u + 1));
+      line(3, ")");
+      line(2, "port map (");
+      line(3, "clk => clk,");
+      line(3, "rst => rst,");
+      for (size_t i = 0; i < ports; i++) {
+        auto sep = i + 1 < ports ? "," : "";
+        line(3, "p_" + to_string(i) + " => w_" +
+                    to_string((i + u) % ports) + sep);
+      }
+      line(3, ");");
+    }
+    line(0, "end architecture structural;");
+    line(0, "");
+  }
+
+  void case_statement(size_t n) {
+    auto states = 16 + below(48);
+    auto entity = name("fsm_", n);
+    context();
+    line(0, "entity " + entity + " is");
+    line(1, "port (");
+    line(2, "clk : in std_logic;");
+    line(2, "i_event : in std_logic_vector(7 downto 0);");
+    line(2, "o_out : out std_logic_vector(7 downto 0)");
+    line(2, ");");
+    line(0, "end entity " + entity + ";");
+    line(0, "");
+    line(0, "architecture rtl of " + entity + " is");
+    string type = "type t_state is (";
+    for (size_t i = 0; i < states; i++) {
+      type += (i ? ", S_" : "S_") + to_string(i);
+    }
+    line(1, type + ");");
+    line(1, "signal state : t_state;");
+    line(0, "begin");
+    line(1, "process (clk)");
+    line(1, "begin");
+    line(2, "if rising_edge(clk) then");
+    line(3, "case state is");
+    for (size_t i = 0; i < states; i++) {
+      line(4, "when S_" + to_string(i) + " =>");
+      line(5, "o_out <= x\"" + string(1, "0123456789abcdef"[below(16)]) +
+                  string(1, "0123456789abcdef"[below(16)]) + "\";");
+      line(5, "if i_event(" + to_string(below(8)) + ") = '1' then");
+      line(6, "state <= S_" + to_string(below(states)) + ";");
+      line(5, "end if;");
+    }
+    line(4, "when others =>");
+    line(5, "state <= S_0;");
+    line(3, "end case;");
+    line(2, "end if;");
+    line(1, "end process;");
+    line(0, "end architecture rtl;");
+    line(0, "");
+  }
+
+  void register_package(size_t n) {
+    auto regs = 8 + below(24);
+    auto pkg = name("regs_", n);
+    context();
+    line(0, "package " + pkg + " is");
+    for (size_t r = 0; r < regs; r++) {
+      auto reg = to_string(r);
+      char addr[8];
+      snprintf(addr, sizeof(addr), "%04X", static_cast<unsigned>(r * 4));
+      line(1, "constant C_REG_" + reg + "_ADDR : unsigned(15 downto 0) := x\"" +
+                  addr + "\";");
+      line(1, "type t_reg_" + reg + " is record");
+      auto fields = 2 + below(6);
+      for (size_t f = 0; f < fields; f++) {
+        line(2, string(word()) + "_" + to_string(f) +
+                    " : std_logic_vector(" + to_string(below(16)) +
+                    " downto 0);");
+      }
+      line(1, "end record;");
+      line(1, "function read_reg_" + reg + " (r : t_reg_" + reg +
+                  ") return std_logic_vector;");
+    }
+    line(0, "end package " + pkg + ";");
+    line(0, "");
+    line(0, "package body " + pkg + " is");
+    for (size_t r = 0; r < regs; r++) {
+      auto reg = to_string(r);
+      line(1, "function read_reg_" + reg + " (r : t_reg_" + reg +
+                  ") return std_logic_vector is");
+      line(2, "variable v : std_logic_vector(31 downto 0) := (others => '0');");
+      line(1, "begin");
+      line(2, "v(15 downto 0) := std_logic_vector(C_REG_" + reg + "_ADDR);");
+      line(2, "return v;");
+      line(1, "end function;");
+    }
+    line(0, "end package body " + pkg + ";");
+    line(0, "");
+  }
+
+  void comments(size_t n) {
+    comment_block(20 + below(60));
+    auto entity = name("doc_", n);
+    line(0, "entity " + entity + " is");
+    comment_block(2 + below(10));
+    line(0, "end entity " + entity + ";");
+    line(0, "");
+  }
+
+  uint64_t state_;
+  string out_;
+};
+
+} // namespace
+
+bool corpus_kind(string_view name, CorpusKind &kind) {
+  for (size_t i = 0; i < sizeof(kind_names) / sizeof(kind_names[0]); i++) {
+    if (name == kind_names[i]) {
+      kind = static_cast<CorpusKind>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *corpus_kind_name(CorpusKind kind) {
+  return kind_names[static_cast<size_t>(kind)];
+}
+
+string make_vhdl_corpus(size_t bytes, CorpusKind kind, uint64_t seed) {
+  static constexpr CorpusKind mix[] = {
+      CorpusKind::RegisterPackages, CorpusKind::PortMaps,
+      CorpusKind::CaseStatements,   CorpusKind::Expressions,
+      CorpusKind::Comments,
+  };
+
+  Generator generator(seed);
+  auto &text = generator.text();
+  text.reserve(bytes + 16384);
+  for (size_t n = 0; text.size() < bytes; n++) {
+    generator.unit(kind == CorpusKind::Mixed ? mix[n % 5] : kind, n);
+  }
+  return move(text);
+}
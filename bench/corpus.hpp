@@ -0,0 +1,57 @@
+//
+//  corpus.hpp
+//
+//  Synthetic VHDL for benchmarking the parser
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// What a generated corpus is made of. Each kind stresses one part of the
+// grammar; Mixed rotates through all of them, which is closest to a real
+// design.
+enum class CorpusKind {
+  Mixed,
+  Expressions,      // Deeply nested arithmetic and boolean expressions
+  PortMaps,         // Wide entities, instantiated with named port maps
+  CaseStatements,   // State machines with many-armed case statements
+  RegisterPackages, // Constants, records and accessor functions
+  Comments,         // Long comment blocks around small units
+};
+
+// The kind called 'name' ("mixed", "expressions", ...); false if there's no
+// such kind
+bool corpus_kind(std::string_view name, CorpusKind &kind);
+const char *corpus_kind_name(CorpusKind kind);
+
+// At least 'bytes' of VHDL-2008 that parses without errors, made of whole
+// design units. The same arguments always give the same text, on any
+// platform.
+std::string make_vhdl_corpus(size_t bytes, CorpusKind kind = CorpusKind::Mixed,
+                             uint64_t seed = 1);
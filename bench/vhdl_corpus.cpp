@@ -0,0 +1,71 @@
+//
+//  vhdl_corpus.cpp
+//
+//  Write a synthetic VHDL file, for benchmarking or profiling the parser
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+using namespace std;
+
+#include "corpus.hpp"
+
+static int usage() {
+  cerr << "usage: vhdl_corpus [--kind KIND] [--seed N] SIZE_KB OUTPUT\n"
+       << "  KIND is mixed (the default), expressions, port_maps, case,\n"
+       << "  register_packages or comments\n";
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  auto kind = CorpusKind::Mixed;
+  uint64_t seed = 1;
+  int arg = 1;
+  for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+    string option = argv[arg];
+    if (option == "--kind") {
+      if (!corpus_kind(argv[arg + 1], kind)) { return usage(); }
+    } else if (option == "--seed") {
+      seed = strtoull(argv[arg + 1], nullptr, 0);
+    } else {
+      return usage();
+    }
+  }
+  if (argc - arg != 2) { return usage(); }
+
+  auto size = strtoull(argv[arg], nullptr, 0) * 1024;
+  auto text = make_vhdl_corpus(size, kind, seed);
+
+  ofstream out(argv[arg + 1], ios::out | ios::binary | ios::trunc);
+  out.write(text.data(), static_cast<streamsize>(text.size()));
+  out.close();
+  if (out.fail()) {
+    cerr << "can't write " << argv[arg + 1] << "\n";
+    return 1;
+  }
+  return 0;
+}
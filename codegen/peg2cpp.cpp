@@ -0,0 +1,869 @@
+//
+//  peg2cpp.cpp
+//
+//  Turns a PEG grammar into a C++ recursive-descent parser
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+// Usage: peg2cpp [--memo <rule list>] [--commit <rule>]... [--prematch <rule>]
+//                <grammar.peg> <start rule> <function name> <output.cpp>
+//
+// The grammar is loaded with peglib, so it gets exactly the same checks,
+// reference linking and automatic token boundaries as it would at run time.
+// The linked operator tree is then written out as one C++ function per rule,
+// with literals and character classes expanded in place. The result builds
+// the same tree as peglib does with packrat parsing and enable_ast(), as a
+// peg::CompactAst.
+//
+// Every rule is memoised unless a file listing the rules to memoise is given
+// (see peg::generated::read_rule_list()). Each '--commit' rule is marked as a
+// point the parse never backtracks over (see peg::Definition::commit).
+//
+// Reserved words written as "< 'word'i delimiter >", where 'delimiter' is a
+// negated set of word characters, are recognised as keywords. The word at a
+// position is scanned once and looked up in a perfect hash table built here,
+// instead of matching every keyword's literal in turn; a choice made only of
+// keyword rules becomes a switch on the result.
+//
+// The generated function also takes the token spans from a scan of the input
+// (peg::generated::TokenSpans), which may be empty. Where they say a token
+// ends, the %whitespace rule's match is looked up rather than run. It can
+// also be handed matches of one rule found ahead of time; '--prematch' adds
+// a second function, <function name>_prematch(), that finds them over part
+// of the input (see peg::generated::Prematched). Given a peg::AstSink, it
+// sends the tree there instead of building a CompactAst, a piece at a time
+// as commit rules match.
+//
+// Only the operators used by plain grammars are supported: no macros,
+// dictionaries, captures, back references, cuts, precedence climbing,
+// error recovery or %word.
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "peg_generated.hpp"
+
+static string quote(const string &s) {
+  // Octal escapes have a fixed length, so they can't swallow the next char
+  string out = "\"";
+  for (unsigned char ch : s) {
+    if (isalnum(ch) || ch == ' ' || ch == '_') {
+      out += static_cast<char>(ch);
+    } else {
+      char buff[8];
+      snprintf(buff, sizeof(buff), "\\%03o", ch);
+      out += buff;
+    }
+  }
+  return out + "\"";
+}
+
+class Generator : public peg::Ope::Visitor {
+public:
+  Generator(peg::Grammar &grammar, const string &start,
+            const string &prematch)
+      : grammar_(grammar) {
+    auto &start_rule = grammar_[start];
+    if (start_rule.wordOpe) { throw runtime_error("%word is not supported"); }
+    whitespace_ = start_rule.whitespaceOpe;
+    start_id_ = rule_id(start_rule);
+    if (!prematch.empty()) { prematch_id_ = rule_id(grammar_[prematch]); }
+  }
+
+  void generate(ostream &os, const string &function_name) {
+    // Rule bodies are generated first, which finds every reachable rule
+    ostringstream ws_body;
+    if (whitespace_) {
+      auto ws = dynamic_cast<peg::Whitespace *>(whitespace_.get());
+      if (!ws) { throw runtime_error("unexpected %whitespace operator"); }
+      emit(ws_body, *ws->ope_, "s", "n", "r", 1);
+    }
+
+    ostringstream bodies;
+    for (size_t id = 0; id < rules_.size(); id++) {
+      auto &rule = *rules_[id];
+      bodies << "// " << rule.name << "\n"
+             << "static size_t r" << id
+             << "(Context &c, const char *s, size_t n) {\n"
+             << "  return c.rule(rules[" << id
+             << "], s, n, [&c](const char *s, size_t n) {\n"
+             << "    size_t r;\n";
+      emit(bodies, *rule.get_core_operator(), "s", "n", "r", 2);
+      bodies << "    return r;\n"
+             << "  });\n"
+             << "}\n\n";
+    }
+
+    os << "// Generated by peg2cpp - do not edit\n\n"
+       << "#include \"peg_generated.hpp\"\n\n"
+       << "namespace {\n\n"
+       << "using namespace peg::generated;\n"
+       << "using peg::codepoint_length;\n"
+       << "using peg::fail;\n"
+       << "using peg::success;\n\n";
+
+    size_t memo_count = 0;
+    os << "const Rule rules[] = {\n";
+    for (auto rule : rules_) {
+      auto ope = rule->get_core_operator().get();
+      if (auto tok = dynamic_cast<peg::TokenBoundary *>(ope)) {
+        ope = tok->ope_.get();
+      }
+      auto keep_choice = dynamic_cast<peg::PrioritizedChoice *>(ope) != nullptr;
+      os << "    {" << quote(rule->name) << ", "
+         << (rule->is_token() ? "true" : "false") << ", "
+         << (rule->ignoreSemanticValue ? "true" : "false") << ", "
+         << (keep_choice ? "true" : "false") << ", ";
+      if (rule->memoize) {
+        os << memo_count++;
+      } else {
+        os << "NO_MEMO";
+      }
+      os << ", " << (rule->commit ? "true" : "false") << "},\n";
+    }
+    os << "};\n\n";
+
+    for (size_t id = 0; id < rules_.size(); id++) {
+      os << "static size_t r" << id << "(Context &c, const char *s, size_t n);\n";
+    }
+    os << "\n";
+
+    if (!keywords_.empty()) { generate_keywords(os); }
+
+    if (whitespace_) {
+      os << "static size_t whitespace(Context &c, const char *s, size_t n) {\n"
+         << "  if (c.in_whitespace) { return 0; }\n"
+         << "  if (c.spans.count) {\n"
+         << "    auto w = c.known_whitespace(s);\n"
+         << "    if (success(w)) { return w; }\n"
+         << "  }\n"
+         << "  c.in_whitespace = true;\n"
+         << "  size_t r;\n"
+         << ws_body.str()
+         << "  c.in_whitespace = false;\n"
+         << "  return r;\n"
+         << "}\n\n";
+    }
+
+    os << bodies.str();
+
+    os << "} // namespace\n\n"
+       << "bool " << function_name
+       << "(const char *s, size_t n, peg::CompactAst &ast,\n"
+       << "    const char *path, const TokenSpans &spans,\n"
+       << "    std::vector<Prematched> *prematched, peg::AstSink *sink) {\n"
+       << "  // Nodes hold 32-bit offsets\n"
+       << "  if (n > UINT32_MAX) { return false; }\n"
+       << "  Context c(s, n, path, rules, " << memo_count << ", spans);\n"
+       << "  if (prematched) { c.use_prematched(*prematched); }\n"
+       << "  if (sink) { c.stream_to(sink, sizeof(rules) / sizeof(rules[0])); }\n"
+       << "  size_t i = 0;\n";
+    if (whitespace_) {
+      os << "  i = whitespace(c, s, n);\n"
+         << "  if (fail(i)) { return false; }\n";
+    }
+    os << "  auto len = r" << start_id_ << "(c, s + i, n - i);\n"
+       << "  if (fail(len) || i + len < n) { return false; }\n"
+       << "  if (sink) { return c.finish(); }\n"
+       << "  c.finish(ast, sizeof(rules) / sizeof(rules[0]));\n"
+       << "  return true;\n"
+       << "}\n";
+
+    if (prematch_id_ != NO_RULE) {
+      os << "\n"
+         << "bool " << function_name << "_prematch"
+         << "(const char *s, size_t n, const char *path,\n"
+         << "    const TokenSpans &spans, size_t begin, size_t end,\n"
+         << "    Prematched &out) {\n"
+         << "  if (n > UINT32_MAX) { return false; }\n"
+         << "  Context c(s, n, path, rules, " << memo_count << ", spans);\n"
+         << "  c.prematch(rules[" << prematch_id_ << "], begin, end, out,\n"
+         << "             [&c](const char *s, size_t n) { return r"
+         << prematch_id_ << "(c, s, n); });\n"
+         << "  return !out.matches.empty();\n"
+         << "}\n";
+    }
+  }
+
+  using peg::Ope::Visitor::visit;
+
+  void visit(peg::Sequence &ope) override {
+    if (token_boundary_depth_ > 0) {
+      if (auto id = keyword(ope)) {
+        line() << r_ << " = keyword_at(c, " << p_ << ", " << n_ << ") == " << *id
+               << "u ? " << keywords_[*id].size() << " : FAIL;\n";
+        return;
+      }
+    }
+
+    auto r = r_;
+    line() << r << " = 0;\n";
+    line() << "do {\n";
+    indent_++;
+    for (auto &child : ope.opes_) {
+      auto v = var("a");
+      line() << "size_t " << v << ";\n";
+      emit_at(*child, p_ + " + " + r, n_ + " - " + r, v);
+      line() << "if (fail(" << v << ")) { " << r << " = FAIL; break; }\n";
+      line() << r << " += " << v << ";\n";
+    }
+    indent_--;
+    line() << "} while (0);\n";
+  }
+
+  void visit(peg::PrioritizedChoice &ope) override {
+    if (keyword_choice(ope)) { return; }
+
+    auto r = r_;
+    auto nm = var("nm");
+    auto tm = var("tm");
+    line() << r << " = FAIL;\n";
+    line() << "do {\n";
+    indent_++;
+    line() << "auto " << nm << " = c.nodes.size();\n";
+    line() << "auto " << tm << " = c.tokens.size();\n";
+    for (size_t id = 0; id < ope.opes_.size(); id++) {
+      auto v = var("a");
+      line() << "size_t " << v << ";\n";
+      emit_at(*ope.opes_[id], p_, n_, v);
+      line() << "if (success(" << v << ")) { " << r << " = " << v
+             << "; c.choice_count = " << ope.opes_.size()
+             << "; c.choice = " << id << "; break; }\n";
+      line() << "c.truncate(" << nm << ", " << tm << ");\n";
+    }
+    indent_--;
+    line() << "} while (0);\n";
+  }
+
+  void visit(peg::Repetition &ope) override {
+    auto r = r_;
+    auto count = var("count");
+    auto nm = var("nm");
+    auto tm = var("tm");
+    auto v = var("a");
+    line() << r << " = 0;\n";
+    line() << "for (size_t " << count << " = 0;; " << count << "++) {\n";
+    indent_++;
+    if (ope.max_ != numeric_limits<size_t>::max()) {
+      line() << "if (" << count << " == " << ope.max_ << "u) { break; }\n";
+    }
+    line() << "auto " << nm << " = c.nodes.size();\n";
+    line() << "auto " << tm << " = c.tokens.size();\n";
+    line() << "size_t " << v << ";\n";
+    emit_at(*ope.ope_, p_ + " + " + r, n_ + " - " + r, v);
+    line() << "if (fail(" << v << ")) {\n";
+    line() << "  c.truncate(" << nm << ", " << tm << ");\n";
+    if (ope.min_ > 0) {
+      line() << "  if (" << count << " < " << ope.min_ << "u) { " << r
+             << " = FAIL; }\n";
+    }
+    line() << "  break;\n";
+    line() << "}\n";
+    line() << r << " += " << v << ";\n";
+    indent_--;
+    line() << "}\n";
+  }
+
+  void visit(peg::AndPredicate &ope) override { predicate(*ope.ope_, true); }
+  void visit(peg::NotPredicate &ope) override { predicate(*ope.ope_, false); }
+
+  void visit(peg::LiteralString &ope) override {
+    auto lit = ope.lit_;
+    if (ope.ignore_case_) {
+      for (auto &ch : lit) {
+        ch = peg::generated::fold_case(ch);
+      }
+    }
+    line() << "if (" << (ope.ignore_case_ ? "match_literal_i" : "match_literal")
+           << "(" << p_ << ", " << n_ << ", " << quote(lit) << ", "
+           << lit.size() << ")) {\n";
+    indent_++;
+    line() << r_ << " = " << lit.size() << ";\n";
+    if (whitespace_) {
+      skip_whitespace(p_ + " + " + to_string(lit.size()),
+                      n_ + " - " + to_string(lit.size()), false);
+    }
+    indent_--;
+    line() << "} else {\n";
+    line() << "  " << r_ << " = FAIL;\n";
+    line() << "}\n";
+  }
+
+  void visit(peg::CharacterClass &ope) override {
+    if (ope.ignore_case_) {
+      throw runtime_error("case-insensitive character classes are not supported");
+    }
+    auto test = range_test(ope.ranges_);
+    auto match = ope.negated_ ? "FAIL" : "len";
+    auto no_match = ope.negated_ ? "len" : "FAIL";
+    line() << r_ << " = FAIL;\n";
+    line() << "if (" << n_ << " >= 1) {\n";
+    line() << "  char32_t cp;\n";
+    line() << "  auto len = next_codepoint(" << p_ << ", " << n_ << ", cp);\n";
+    line() << "  " << r_ << " = (" << test << ") ? " << match << " : "
+           << no_match << ";\n";
+    line() << "}\n";
+  }
+
+  void visit(peg::Character &ope) override {
+    line() << r_ << " = FAIL;\n";
+    line() << "if (" << n_ << " >= 1) {\n";
+    line() << "  char32_t cp;\n";
+    line() << "  auto len = next_codepoint(" << p_ << ", " << n_ << ", cp);\n";
+    line() << "  if (cp == " << static_cast<uint32_t>(ope.ch_) << "u) { " << r_
+           << " = len; }\n";
+    line() << "}\n";
+  }
+
+  void visit(peg::AnyCharacter &) override {
+    line() << "{\n";
+    line() << "  auto len = codepoint_length(" << p_ << ", " << n_ << ");\n";
+    line() << "  " << r_ << " = len < 1 ? FAIL : len;\n";
+    line() << "}\n";
+  }
+
+  void visit(peg::TokenBoundary &ope) override {
+    auto r = r_;
+    auto p = p_;
+    auto n = n_;
+    line() << "c.in_token_boundary_count++;\n";
+    token_boundary_depth_++;
+    emit_at(*ope.ope_, p, n, r);
+    token_boundary_depth_--;
+    line() << "c.in_token_boundary_count--;\n";
+    line() << "if (success(" << r << ")) {\n";
+    indent_++;
+    line() << "c.tokens.emplace_back(" << p << ", " << r << ");\n";
+    if (whitespace_) {
+      skip_whitespace(p + " + " + r, n + " - " + r, true);
+    }
+    indent_--;
+    line() << "}\n";
+  }
+
+  void visit(peg::Ignore &ope) override {
+    auto nm = var("nm");
+    auto tm = var("tm");
+    line() << "auto " << nm << " = c.nodes.size();\n";
+    line() << "auto " << tm << " = c.tokens.size();\n";
+    emit_at(*ope.ope_, p_, n_, r_);
+    line() << "c.truncate(" << nm << ", " << tm << ");\n";
+  }
+
+  void visit(peg::WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+
+  void visit(peg::Holder &ope) override { call_rule(*ope.outer_); }
+
+  void visit(peg::Reference &ope) override {
+    if (!ope.rule_) {
+      throw runtime_error("macro parameter '" + ope.name_ +
+                          "' is not supported");
+    }
+    call_rule(*ope.rule_);
+  }
+
+  void visit(peg::Dictionary &) override { unsupported("dictionaries"); }
+  void visit(peg::CaptureScope &) override { unsupported("capture scopes"); }
+  void visit(peg::Capture &) override { unsupported("captures"); }
+  void visit(peg::User &) override { unsupported("user operators"); }
+  void visit(peg::Whitespace &) override { unsupported("nested %whitespace"); }
+  void visit(peg::BackReference &) override { unsupported("back references"); }
+  void visit(peg::PrecedenceClimbing &) override { unsupported("precedence"); }
+  void visit(peg::Recovery &) override { unsupported("error recovery"); }
+  void visit(peg::Cut &) override { unsupported("cut operators"); }
+
+private:
+  // Write code that matches 'ope' at (p, n) and leaves its length in 'r'
+  void emit(ostream &os, peg::Ope &ope, const string &p, const string &n,
+            const string &r, int indent) {
+    auto save_os = os_;
+    auto save_indent = indent_;
+    os_ = &os;
+    indent_ = indent;
+    emit_at(ope, p, n, r);
+    os_ = save_os;
+    indent_ = save_indent;
+  }
+
+  void emit_at(peg::Ope &ope, const string &p, const string &n,
+               const string &r) {
+    auto save = make_tuple(p_, n_, r_);
+    // Keep the input expressions short by naming them
+    if (p.find(' ') != string::npos) {
+      auto pv = var("p");
+      auto nv = var("n");
+      line() << "{\n";
+      indent_++;
+      line() << "const char *" << pv << " = " << p << ";\n";
+      line() << "size_t " << nv << " = " << n << ";\n";
+      tie(p_, n_, r_) = make_tuple(pv, nv, r);
+      ope.accept(*this);
+      indent_--;
+      line() << "}\n";
+    } else {
+      tie(p_, n_, r_) = make_tuple(p, n, r);
+      ope.accept(*this);
+    }
+    tie(p_, n_, r_) = save;
+  }
+
+  void predicate(peg::Ope &ope, bool positive) {
+    auto r = r_;
+    auto nm = var("nm");
+    auto tm = var("tm");
+    line() << "{\n";
+    indent_++;
+    line() << "auto " << nm << " = c.nodes.size();\n";
+    line() << "auto " << tm << " = c.tokens.size();\n";
+    emit_at(ope, p_, n_, r);
+    line() << "c.truncate(" << nm << ", " << tm << ");\n";
+    if (positive) {
+      line() << r << " = success(" << r << ") ? 0 : FAIL;\n";
+    } else {
+      line() << r << " = success(" << r << ") ? FAIL : 0;\n";
+    }
+    indent_--;
+    line() << "}\n";
+  }
+
+  // Whitespace after a literal or token; r_ already holds the match length.
+  // A token boundary can end a rule whose body is a choice, so the choice it
+  // recorded must survive the rules that match the whitespace.
+  void skip_whitespace(const string &p, const string &n, bool keep_choice) {
+    auto w = var("w");
+    line() << "if (!c.in_token_boundary_count) {\n";
+    indent_++;
+    if (keep_choice) {
+      line() << "auto choice_count = c.choice_count;\n";
+      line() << "auto choice = c.choice;\n";
+    }
+    line() << "auto " << w << " = whitespace(c, " << p << ", " << n << ");\n";
+    if (keep_choice) {
+      line() << "c.choice_count = choice_count;\n";
+      line() << "c.choice = choice;\n";
+    }
+    line() << r_ << " = fail(" << w << ") ? " << w << " : " << r_ << " + " << w
+           << ";\n";
+    indent_--;
+    line() << "}\n";
+  }
+
+  static string range_test(vector<pair<char32_t, char32_t>> ranges) {
+    // Merge overlapping and adjacent ranges first
+    sort(ranges.begin(), ranges.end());
+    vector<pair<char32_t, char32_t>> merged;
+    for (auto [lo, hi] : ranges) {
+      if (!merged.empty() && lo <= merged.back().second + 1) {
+        merged.back().second = max(merged.back().second, hi);
+      } else {
+        merged.emplace_back(lo, hi);
+      }
+    }
+
+    string test;
+    for (auto [lo, hi] : merged) {
+      if (!test.empty()) { test += " || "; }
+      if (lo == hi) {
+        test += "cp == " + to_string(lo) + "u";
+      } else {
+        test += "(cp >= " + to_string(lo) + "u && cp <= " + to_string(hi) +
+                "u)";
+      }
+    }
+    return test;
+  }
+
+  // If 'ope' matches exactly one code point from a fixed set, with nothing
+  // else that a predicate could notice, add that set to 'ranges'
+  static bool char_set(peg::Ope &ope, vector<pair<char32_t, char32_t>> &ranges) {
+    if (auto cls = dynamic_cast<peg::CharacterClass *>(&ope)) {
+      if (cls->negated_ || cls->ignore_case_) { return false; }
+      ranges.insert(ranges.end(), cls->ranges_.begin(), cls->ranges_.end());
+      return true;
+    }
+    if (auto ch = dynamic_cast<peg::Character *>(&ope)) {
+      ranges.emplace_back(ch->ch_, ch->ch_);
+      return true;
+    }
+    if (auto lit = dynamic_cast<peg::LiteralString *>(&ope)) {
+      if (lit->ignore_case_ || lit->lit_.size() != 1 ||
+          static_cast<unsigned char>(lit->lit_[0]) >= 0x80) {
+        return false;
+      }
+      ranges.emplace_back(lit->lit_[0], lit->lit_[0]);
+      return true;
+    }
+    if (auto choice = dynamic_cast<peg::PrioritizedChoice *>(&ope)) {
+      for (auto &alt : choice->opes_) {
+        if (!char_set(*alt, ranges)) { return false; }
+      }
+      return true;
+    }
+    if (auto ref = dynamic_cast<peg::Reference *>(&ope)) {
+      if (!ref->rule_ || ref->rule_->is_macro || !ref->args_.empty()) {
+        return false;
+      }
+      return char_set(*ref->rule_->get_core_operator(), ranges);
+    }
+    if (auto holder = dynamic_cast<peg::Holder *>(&ope)) {
+      return char_set(*holder->outer_->get_core_operator(), ranges);
+    }
+    if (auto weak = dynamic_cast<peg::WeakHolder *>(&ope)) {
+      return char_set(*weak->weak_.lock(), ranges);
+    }
+    return false;
+  }
+
+  static bool in_ranges(const vector<pair<char32_t, char32_t>> &ranges,
+                        char32_t cp) {
+    for (auto [lo, hi] : ranges) {
+      if (cp >= lo && cp <= hi) { return true; }
+    }
+    return false;
+  }
+
+  // The keyword id for "'word'i delimiter", where 'delimiter' rejects the
+  // characters of 'word' in either case. Inside a token boundary (so that
+  // no whitespace is skipped after the word) that matches exactly when the
+  // run of characters that 'delimiter' rejects is 'word', whatever the case.
+  optional<size_t> keyword(peg::Sequence &ope) {
+    if (ope.opes_.size() != 2) { return nullopt; }
+    auto lit = dynamic_cast<peg::LiteralString *>(ope.opes_[0].get());
+    auto ref = dynamic_cast<peg::Reference *>(ope.opes_[1].get());
+    if (!lit || !lit->ignore_case_ || lit->lit_.empty() || !ref ||
+        !ref->rule_ || !ref->args_.empty()) {
+      return nullopt;
+    }
+
+    // All keywords share one word scan, so they must share one delimiter
+    auto &delimiter = *ref->rule_;
+    if (!delimiter_) {
+      auto pred = dynamic_cast<peg::NotPredicate *>(
+          delimiter.get_core_operator().get());
+      vector<pair<char32_t, char32_t>> ranges;
+      if (!pred || !char_set(*pred->ope_, ranges)) { return nullopt; }
+      delimiter_ = &delimiter;
+      word_chars_ = ranges;
+    } else if (delimiter_ != &delimiter) {
+      return nullopt;
+    }
+
+    string word;
+    for (auto ch : lit->lit_) {
+      auto lower = peg::generated::fold_case(ch);
+      auto upper = (lower >= 'a' && lower <= 'z')
+                       ? static_cast<char>(lower - 'a' + 'A')
+                       : lower;
+      if (static_cast<unsigned char>(ch) >= 0x80 ||
+          !in_ranges(word_chars_, static_cast<unsigned char>(lower)) ||
+          !in_ranges(word_chars_, static_cast<unsigned char>(upper))) {
+        return nullopt;
+      }
+      word += lower;
+    }
+
+    auto it = keyword_ids_.find(word);
+    if (it != keyword_ids_.end()) { return it->second; }
+    keywords_.push_back(word);
+    keyword_ids_.emplace(word, keywords_.size() - 1);
+    return keywords_.size() - 1;
+  }
+
+  // The keyword id of a rule that is nothing but "< 'word'i delimiter >"
+  optional<size_t> keyword_rule(peg::Definition &rule) {
+    auto tok = dynamic_cast<peg::TokenBoundary *>(
+        rule.get_core_operator().get());
+    if (!tok) { return nullopt; }
+    auto seq = dynamic_cast<peg::Sequence *>(tok->ope_.get());
+    if (!seq) { return nullopt; }
+    return keyword(*seq);
+  }
+
+  // A choice between keyword rules: at most one of them can match, and the
+  // word scan says which, so only that one is tried
+  bool keyword_choice(peg::PrioritizedChoice &ope) {
+    vector<size_t> ids;
+    for (auto &alt : ope.opes_) {
+      auto ref = dynamic_cast<peg::Reference *>(alt.get());
+      if (!ref || !ref->rule_ || !ref->args_.empty()) { return false; }
+      auto id = keyword_rule(*ref->rule_);
+      if (!id) { return false; }
+      ids.push_back(*id);
+    }
+
+    auto r = r_;
+    auto v = var("a");
+    line() << r << " = FAIL;\n";
+    line() << "switch (keyword_at(c, " << p_ << ", " << n_ << ")) {\n";
+    vector<bool> seen(keywords_.size());
+    for (size_t alt = 0; alt < ids.size(); alt++) {
+      // Only the first of several alternatives for one word can match
+      if (seen[ids[alt]]) { continue; }
+      seen[ids[alt]] = true;
+      line() << "case " << ids[alt] << "u: {\n";
+      indent_++;
+      line() << "size_t " << v << ";\n";
+      emit_at(*ope.opes_[alt], p_, n_, v);
+      line() << "if (success(" << v << ")) { " << r << " = " << v
+             << "; c.choice_count = " << ope.opes_.size()
+             << "; c.choice = " << alt << "; }\n";
+      line() << "break;\n";
+      indent_--;
+      line() << "}\n";
+    }
+    line() << "default:\n";
+    line() << "  break;\n";
+    line() << "}\n";
+    return true;
+  }
+
+  // The keyword table, with a seed that gives each keyword its own slot, and
+  // keyword_at(), which scans the word at a position and looks it up
+  void generate_keywords(ostream &os) {
+    size_t min_len = keywords_.front().size();
+    size_t max_len = 0;
+    for (auto &word : keywords_) {
+      min_len = min(min_len, word.size());
+      max_len = max(max_len, word.size());
+    }
+
+    size_t size = 1;
+    while (size < keywords_.size() * 2) {
+      size *= 2;
+    }
+    vector<size_t> slots;
+    uint32_t seed = 0;
+    for (;;) {
+      auto found = false;
+      for (seed = 0; seed < 100000 && !found; seed++) {
+        slots.assign(size, peg::generated::NO_KEYWORD);
+        found = true;
+        for (size_t id = 0; id < keywords_.size() && found; id++) {
+          auto &word = keywords_[id];
+          auto &slot = slots[peg::generated::hash_keyword(
+                                 word.data(), word.size(), seed) &
+                             (size - 1)];
+          if (slot != peg::generated::NO_KEYWORD) { found = false; }
+          slot = id;
+        }
+      }
+      if (found) {
+        seed--;
+        break;
+      }
+      size *= 2;
+    }
+
+    os << "struct Keyword {\n"
+       << "  const char *word;\n"
+       << "  size_t len;\n"
+       << "};\n\n"
+       << "const Keyword keywords[] = {\n";
+    for (auto &word : keywords_) {
+      os << "    {" << quote(word) << ", " << word.size() << "},\n";
+    }
+    os << "};\n\n"
+       << "const unsigned short keyword_slots[" << size << "] = {";
+    for (size_t i = 0; i < size; i++) {
+      os << (i % 16 == 0 ? "\n    " : " ");
+      os << (slots[i] == peg::generated::NO_KEYWORD ? string("0xffff")
+                                                     : to_string(slots[i]))
+         << ",";
+    }
+    os << "\n};\n\n";
+
+    os << "static size_t keyword_at(Context &c, const char *s, size_t n) {\n"
+       << "  if (c.keyword_pos == s) { return c.keyword; }\n"
+       << "\n"
+       << "  // Scan no further than the longest keyword\n"
+       << "  size_t len = 0;\n"
+       << "  while (len <= " << max_len << "u && len < n) {\n"
+       << "    char32_t cp;\n"
+       << "    auto cp_len = next_codepoint(s + len, n - len, cp);\n"
+       << "    if (cp_len == 0 || !(" << range_test(word_chars_)
+       << ")) { break; }\n"
+       << "    len += cp_len;\n"
+       << "  }\n"
+       << "\n"
+       << "  auto k = NO_KEYWORD;\n"
+       << "  if (len >= " << min_len << "u && len <= " << max_len << "u) {\n"
+       << "    size_t slot = keyword_slots[hash_keyword(s, len, " << seed
+       << "u) & " << size - 1 << "u];\n"
+       << "    if (slot != 0xffff && keywords[slot].len == len &&\n"
+       << "        match_literal_i(s, len, keywords[slot].word, len)) {\n"
+       << "      k = slot;\n"
+       << "    }\n"
+       << "  }\n"
+       << "  c.keyword_pos = s;\n"
+       << "  c.keyword = k;\n"
+       << "  return k;\n"
+       << "}\n\n";
+  }
+
+  void call_rule(peg::Definition &rule) {
+    if (rule.is_macro) {
+      throw runtime_error("macro '" + rule.name + "' is not supported");
+    }
+    line() << r_ << " = r" << rule_id(rule) << "(c, " << p_ << ", " << n_
+           << ");\n";
+  }
+
+  size_t rule_id(peg::Definition &rule) {
+    for (size_t id = 0; id < rules_.size(); id++) {
+      if (rules_[id] == &rule) { return id; }
+    }
+    rules_.push_back(&rule);
+    return rules_.size() - 1;
+  }
+
+  [[noreturn]] void unsupported(const string &what) {
+    throw runtime_error(what + " are not supported");
+  }
+
+  ostream &line() {
+    for (int i = 0; i < indent_; i++) {
+      *os_ << "  ";
+    }
+    return *os_;
+  }
+
+  string var(const string &prefix) { return prefix + to_string(next_var_++); }
+
+  peg::Grammar &grammar_;
+  shared_ptr<peg::Ope> whitespace_;
+  static constexpr size_t NO_RULE = static_cast<size_t>(-1);
+  size_t start_id_ = 0;
+  size_t prematch_id_ = NO_RULE;
+  vector<peg::Definition *> rules_;
+
+  // Keyword recognition
+  peg::Definition *delimiter_ = nullptr;
+  vector<pair<char32_t, char32_t>> word_chars_; // What the delimiter rejects
+  vector<string> keywords_;                      // Folded to lower case
+  map<string, size_t> keyword_ids_;
+  int token_boundary_depth_ = 0;
+
+  ostream *os_ = nullptr;
+  int indent_ = 0;
+  size_t next_var_ = 0;
+  string p_, n_, r_;
+};
+
+int main(int argc, char *argv[]) {
+  const char *memo_path = nullptr;
+  vector<string> commit;
+  string prematch;
+  vector<const char *> args;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--memo" && i + 1 < argc) {
+      memo_path = argv[++i];
+    } else if (arg == "--commit" && i + 1 < argc) {
+      commit.push_back(argv[++i]);
+    } else if (arg == "--prematch" && i + 1 < argc) {
+      prematch = argv[++i];
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+
+  if (args.size() != 4) {
+    cerr << "usage: peg2cpp [--memo <rule list>] [--commit <rule>]... "
+            "[--prematch <rule>] <grammar.peg> <start rule> <function name> "
+            "<output.cpp>\n";
+    return 1;
+  }
+
+  auto read = [](const char *path, string &text) {
+    ifstream ifs(path, ios::in | ios::binary);
+    if (ifs.fail()) {
+      cerr << "peg2cpp: can't open " << path << "\n";
+      return false;
+    }
+    stringstream ss;
+    ss << ifs.rdbuf();
+    text = ss.str();
+    return true;
+  };
+
+  string grammar_text;
+  if (!read(args[0], grammar_text)) { return 1; }
+
+  peg::parser parser;
+  parser.set_logger([&](size_t line, size_t col, const string &msg,
+                        const string & /*rule*/) {
+    cerr << args[0] << ":" << line << ":" << col << ": " << msg << "\n";
+  });
+  if (!parser.load_grammar(grammar_text, args[1])) { return 1; }
+  auto &grammar = const_cast<peg::Grammar &>(parser.get_grammar());
+
+  auto rule = [&](const string &name) -> peg::Definition & {
+    auto it = grammar.find(name);
+    if (it == grammar.end()) {
+      throw runtime_error("rule '" + name + "' doesn't exist");
+    }
+    return it->second;
+  };
+
+  try {
+    if (memo_path) {
+      string memo_text;
+      if (!read(memo_path, memo_text)) { return 1; }
+      auto memo = peg::generated::read_rule_list(memo_text);
+      for (auto &name : memo) {
+        rule(name);
+      }
+      for (auto &[name, def] : grammar) {
+        def.memoize = memo.count(name) > 0;
+      }
+    }
+    for (auto &name : commit) {
+      rule(name).commit = true;
+    }
+
+    // Write to a string first so a failure never leaves half a file behind
+    ostringstream code;
+    if (!prematch.empty()) { rule(prematch); }
+    Generator generator(grammar, args[1], prematch);
+    generator.generate(code, args[2]);
+
+    ofstream ofs(args[3], ios::out | ios::binary);
+    ofs << code.str();
+    if (ofs.fail()) {
+      cerr << "peg2cpp: can't write " << args[3] << "\n";
+      return 1;
+    }
+  } catch (const exception &e) {
+    cerr << "peg2cpp: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,276 @@
+//
+//  ast_cache.cpp
+//
+//  Parsed trees kept on disk, keyed by what they were parsed from
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "ast_cache.hpp"
+#include "ast_file.hpp"
+#include "source_file.hpp"
+
+static constexpr uint64_t P1 = 11400714785074694791ULL;
+static constexpr uint64_t P2 = 14029467366897019727ULL;
+static constexpr uint64_t P3 = 1609587929392839161ULL;
+static constexpr uint64_t P4 = 9650029242287828579ULL;
+static constexpr uint64_t P5 = 2870177450012600261ULL;
+
+static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+  return rotl(acc + input * P2, 31) * P1;
+}
+
+uint64_t hash_bytes(const void *data, size_t n, uint64_t seed) {
+  auto p = static_cast<const unsigned char *>(data);
+  auto end = p + n;
+  uint64_t h;
+
+  // Four independent lanes of 8 bytes each, so the multiplies overlap
+  if (n >= 32) {
+    uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+    for (; end - p >= 32; p += 32) {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p + 8));
+      v3 = round64(v3, read64(p + 16));
+      v4 = round64(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    for (auto v : {v1, v2, v3, v4}) {
+      h = (h ^ round64(0, v)) * P1 + P4;
+    }
+  } else {
+    h = seed + P5;
+  }
+  h += n;
+
+  for (; end - p >= 8; p += 8) {
+    h = rotl(h ^ round64(0, read64(p)), 27) * P1 + P4;
+  }
+  for (; p < end; p++) {
+    h = rotl(h ^ (*p * P5), 11) * P1;
+  }
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  return h ^ (h >> 32);
+}
+
+// What each file starts with; the tree follows as an AST file (see
+// ast_file.hpp) without the source text
+namespace {
+struct Header {
+  char magic[8];
+  uint32_t format;
+  uint32_t reserved;
+  uint64_t key[2];       // As in the file name
+  uint64_t source_size;
+  uint64_t tree_size;
+  uint64_t tree_hash;
+};
+} // namespace
+
+static_assert(sizeof(Header) % 8 == 0, "AST files must be 8-byte aligned");
+
+static constexpr char magic[8] = {'V', 'H', 'D', 'L', 'A', 'S', 'T', '\0'};
+
+// Bump this when the layout of the header or the tree changes
+static constexpr uint32_t format = 2;
+
+// The two halves of a key are hashed with different seeds
+static constexpr uint64_t key_seeds[2] = {0, P3};
+
+AstCache::AstCache(fs::path dir, uint64_t max_bytes, string_view version)
+    : dir_(move(dir)), max_bytes_(max_bytes),
+      version_(hash_bytes(version.data(), version.size(), format)) {
+  error_code ec;
+  fs::create_directories(dir_, ec);
+  ok_ = fs::is_directory(dir_, ec);
+}
+
+static void make_key(const char *s, size_t n, uint64_t version,
+                     uint64_t key[2]) {
+  for (int i = 0; i < 2; i++) {
+    key[i] = hash_bytes(s, n, key_seeds[i]) ^ version;
+  }
+}
+
+fs::path AstCache::file_name(const char *s, size_t n) const {
+  uint64_t key[2];
+  make_key(s, n, version_, key);
+
+  static constexpr char digits[] = "0123456789abcdef";
+  string name;
+  for (auto half : key) {
+    for (int shift = 60; shift >= 0; shift -= 4) {
+      name += digits[(half >> shift) & 0xf];
+    }
+  }
+  return dir_ / (name + ".ast");
+}
+
+AstCache::Lookup AstCache::load(const char *s, size_t n, const char *path,
+                                peg::CompactAst &ast) {
+  auto name = file_name(s, n);
+  SourceFile file;
+  if (!file.open(name)) {
+    misses_++;
+    return Lookup::Miss;
+  }
+
+  Header header{};
+  uint64_t key[2];
+  make_key(s, n, version_, key);
+  auto tree = file.data() + sizeof(header);
+  auto tree_size = file.size() - sizeof(header);
+  peg::AstFile tree_file;
+
+  auto ok = file.size() >= sizeof(header);
+  if (ok) { memcpy(&header, file.data(), sizeof(header)); }
+  ok = ok && memcmp(header.magic, magic, sizeof(magic)) == 0 &&
+       header.format == format && header.key[0] == key[0] &&
+       header.key[1] == key[1] && header.source_size == n &&
+       header.tree_size == tree_size &&
+       header.tree_hash == hash_bytes(tree, tree_size) &&
+       tree_file.view(tree, tree_size) && to_compact(tree_file, s, n, path, ast);
+  if (!ok) {
+    error_code ec;
+    fs::remove(name, ec);
+    corrupt_++;
+    return Lookup::Corrupt;
+  }
+
+  // Mark it as recently used, for trim()
+  error_code ec;
+  fs::last_write_time(name, fs::file_time_type::clock::now(), ec);
+  hits_++;
+  return Lookup::Hit;
+}
+
+bool AstCache::store(const char *s, size_t n, const peg::CompactAst &ast) {
+  string tree;
+  peg::write_ast_file(ast, tree, false);
+
+  Header header{};
+  memcpy(header.magic, magic, sizeof(magic));
+  header.format = format;
+  make_key(s, n, version_, header.key);
+  header.source_size = n;
+  header.tree_size = tree.size();
+  header.tree_hash = hash_bytes(tree.data(), tree.size());
+
+  // Readers only ever see a whole file: it's written under a name no other
+  // thread or process will pick, then renamed into place
+  auto name = file_name(s, n);
+  auto stamp = chrono::steady_clock::now().time_since_epoch().count();
+  auto temp = name;
+  temp += ".tmp" + to_string(hash<thread::id>()(this_thread::get_id()) ^
+                             static_cast<size_t>(stamp));
+
+  {
+    ofstream ofs(temp, ios::out | ios::binary | ios::trunc);
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    ofs.write(tree.data(), static_cast<streamsize>(tree.size()));
+    ofs.close();
+    if (!ofs.fail()) {
+      error_code ec;
+      fs::rename(temp, name, ec);
+      if (!ec) {
+        stored_++;
+        return true;
+      }
+    }
+  }
+
+  error_code ec;
+  fs::remove(temp, ec);
+  failed_++;
+  return false;
+}
+
+void AstCache::trim() {
+  struct Entry {
+    fs::file_time_type time;
+    uint64_t size;
+    fs::path path;
+  };
+  vector<Entry> entries;
+  uint64_t total = 0;
+
+  error_code ec;
+  for (auto it = fs::directory_iterator(dir_, ec);
+       !ec && it != fs::directory_iterator(); it.increment(ec)) {
+    error_code entry_ec;
+    if (it->path().extension() != ".ast" || !it->is_regular_file(entry_ec)) {
+      continue;
+    }
+    auto size = it->file_size(entry_ec);
+    auto time = it->last_write_time(entry_ec);
+    if (entry_ec) { continue; }
+    entries.push_back(Entry{time, size, it->path()});
+    total += size;
+  }
+  if (total <= max_bytes_) { return; }
+
+  sort(entries.begin(), entries.end(),
+       [](const Entry &a, const Entry &b) { return a.time < b.time; });
+  for (auto &entry : entries) {
+    if (total <= max_bytes_) { break; }
+    if (fs::remove(entry.path, ec)) {
+      total -= entry.size;
+      evicted_++;
+    }
+  }
+}
+
+AstCache::Stats AstCache::stats() const {
+  return Stats{hits_, misses_, corrupt_, stored_, failed_, evicted_};
+}
+
+void AstCache::report(ostream &os) const {
+  auto s = stats();
+  os << "cache: " << s.hits << " hits, " << s.misses << " misses, "
+     << s.corrupt << " corrupt, " << s.stored << " stored, " << s.failed
+     << " not stored, " << s.evicted << " evicted\n";
+}
@@ -0,0 +1,104 @@
+//
+//  ast_cache.hpp
+//
+//  Parsed trees kept on disk, keyed by what they were parsed from
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <string_view>
+
+#include "compact_ast.hpp"
+
+// A hash of 'n' bytes, in the style of xxHash: quick enough to run over
+// every input, but not meant to stand up to anyone forging collisions
+uint64_t hash_bytes(const void *data, size_t n, uint64_t seed = 0);
+
+// A directory of parsed trees. Each file is named after a 128-bit hash of
+// the source text and of a version string (the grammar, say), so a tree is
+// only found again for the same text parsed the same way, wherever the text
+// came from. Files are checksummed, written under a temporary name and then
+// renamed, so several processes can share a directory, and a damaged file
+// is deleted rather than used.
+//
+// One cache can be used from any number of threads.
+class AstCache {
+public:
+  enum class Lookup { Hit, Miss, Corrupt };
+
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t corrupt = 0;  // Found but damaged, and deleted
+    size_t stored = 0;
+    size_t failed = 0;   // Couldn't be written
+    size_t evicted = 0;  // Deleted by trim()
+  };
+
+  // Use 'dir', creating it if need be, and keep it to about 'max_bytes'
+  AstCache(std::filesystem::path dir, uint64_t max_bytes,
+           std::string_view version);
+  AstCache(const AstCache &) = delete;
+  AstCache &operator=(const AstCache &) = delete;
+
+  // False if the directory couldn't be created
+  bool ok() const { return ok_; }
+
+  // Fill 'ast' with the tree stored for the 'n' bytes at 's', if there is
+  // one. The tree points into 's', as if it had just been parsed from it
+  // with the given 'path'.
+  Lookup load(const char *s, size_t n, const char *path, peg::CompactAst &ast);
+
+  // Keep 'ast', parsed from the 'n' bytes at 's'
+  bool store(const char *s, size_t n, const peg::CompactAst &ast);
+
+  // Delete the least recently used trees until the directory is within its
+  // size limit again
+  void trim();
+
+  Stats stats() const;
+
+  // One line of counts, for the end of a run
+  void report(std::ostream &os) const;
+
+private:
+  std::filesystem::path file_name(const char *s, size_t n) const;
+
+  std::filesystem::path dir_;
+  uint64_t max_bytes_;
+  uint64_t version_;
+  bool ok_ = false;
+
+  std::atomic<size_t> hits_{0};
+  std::atomic<size_t> misses_{0};
+  std::atomic<size_t> corrupt_{0};
+  std::atomic<size_t> stored_{0};
+  std::atomic<size_t> failed_{0};
+  std::atomic<size_t> evicted_{0};
+};
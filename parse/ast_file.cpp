@@ -0,0 +1,219 @@
+//
+//  ast_file.cpp
+//
+//  A binary file format for syntax trees, readable in place
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+using namespace std;
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "ast_file.hpp"
+#include "source_file.hpp"
+
+namespace peg {
+
+static_assert(sizeof(CompactAst::Node) == 32, "nodes are stored as they are");
+static_assert(sizeof(AstFileHeader) % 8 == 0 && sizeof(AstFileRule) == 16,
+              "the sections after the header stay aligned");
+
+static constexpr char magic[8] = {'V', 'H', 'D', 'L', 'A', 'S', 'T', '\x1a'};
+static constexpr uint32_t byte_order = 0x01020304;
+
+static size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+void write_ast_file(const CompactAst &tree, string &out, bool with_source) {
+  string strings;
+  vector<AstFileRule> rules;
+  for (uint32_t rule = 0; rule < tree.rule_count(); rule++) {
+    auto &name = tree.rule_name(rule);
+    rules.push_back(AstFileRule{static_cast<uint32_t>(strings.size()),
+                                static_cast<uint32_t>(name.size()),
+                                tree.rule_is_token(rule) ? AstFileRule::TOKEN
+                                                         : 0u,
+                                0});
+    strings += name;
+  }
+
+  AstFileHeader header{};
+  memcpy(header.magic, magic, sizeof(magic));
+  header.byte_order = byte_order;
+  header.major = AST_FILE_MAJOR;
+  header.minor = AST_FILE_MINOR;
+  header.header_size = sizeof(header);
+  header.source_size = tree.source().size();
+  header.path = static_cast<uint32_t>(strings.size());
+  header.path_length = static_cast<uint32_t>(tree.path().size());
+  strings += tree.path();
+
+  // Lay the sections out one after another
+  size_t offset = sizeof(header);
+  auto place = [&](AstFileHeader::Section &section, size_t size) {
+    offset = align8(offset);
+    section = {offset, size};
+    offset += size;
+  };
+  place(header.rules, rules.size() * sizeof(AstFileRule));
+  place(header.strings, strings.size());
+  place(header.nodes, tree.size() * sizeof(CompactAst::Node));
+  auto &lines = tree.line_ends();
+  place(header.lines, with_source ? lines.size() * sizeof(uint32_t) : 0);
+  place(header.source, with_source ? tree.source().size() : 0);
+  header.file_size = offset;
+
+  auto base = out.size();
+  out.resize(base + offset, '\0');
+  auto copy = [&](const AstFileHeader::Section &section, const void *p) {
+    if (section.size > 0) {
+      memcpy(&out[base + section.offset], p, section.size);
+    }
+  };
+  memcpy(&out[base], &header, sizeof(header));
+  copy(header.rules, rules.data());
+  copy(header.strings, strings.data());
+  copy(header.nodes, tree.empty() ? nullptr : &tree[0]);
+  copy(header.lines, lines.data());
+  copy(header.source, tree.source().data());
+}
+
+AstFile::AstFile() = default;
+AstFile::AstFile(AstFile &&) = default;
+AstFile &AstFile::operator=(AstFile &&) = default;
+AstFile::~AstFile() = default;
+
+void AstFile::close() {
+  file_.reset();
+  header_ = nullptr;
+  rules_ = nullptr;
+  strings_ = nullptr;
+  nodes_ = nullptr;
+  lines_ = nullptr;
+  source_ = nullptr;
+  rule_count_ = node_count_ = line_count_ = 0;
+}
+
+bool AstFile::open(const fs::path &path) {
+  close();
+  auto file = make_unique<SourceFile>();
+  if (!file->open(path) || !view(file->data(), file->size())) { return false; }
+  file_ = move(file);
+  return true;
+}
+
+bool AstFile::view(const char *data, size_t size) {
+  close();
+
+  AstFileHeader header;
+  if (size < sizeof(header) || reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+      header.byte_order != byte_order || header.major != AST_FILE_MAJOR ||
+      header.header_size < sizeof(header) || header.file_size > size) {
+    return false;
+  }
+
+  auto fits = [&](const AstFileHeader::Section &section, size_t unit) {
+    return section.offset % 8 == 0 && section.offset >= header.header_size &&
+           section.offset <= header.file_size &&
+           section.size <= header.file_size - section.offset &&
+           section.size % unit == 0;
+  };
+  auto n = header.source_size;
+  if (!fits(header.rules, sizeof(AstFileRule)) || !fits(header.strings, 1) ||
+      !fits(header.nodes, sizeof(Node)) || !fits(header.lines, 4) ||
+      !fits(header.source, 1) || n > UINT32_MAX ||
+      header.source.size != (header.lines.size > 0 ? n : 0) ||
+      header.path > header.strings.size ||
+      header.path_length > header.strings.size - header.path) {
+    return false;
+  }
+
+  auto rules = reinterpret_cast<const AstFileRule *>(data + header.rules.offset);
+  auto rule_count = header.rules.size / sizeof(AstFileRule);
+  for (size_t i = 0; i < rule_count; i++) {
+    if (rules[i].name > header.strings.size ||
+        rules[i].name_length > header.strings.size - rules[i].name) {
+      return false;
+    }
+  }
+
+  auto nodes = reinterpret_cast<const Node *>(data + header.nodes.offset);
+  auto node_count = header.nodes.size / sizeof(Node);
+  if (node_count >= NO_NODE) { return false; }
+  for (uint32_t id = 0; id < node_count; id++) {
+    auto &node = nodes[id];
+    auto parent_ok = id == 0 ? node.parent == NO_NODE : node.parent < id;
+    if (node.rule >= rule_count || !parent_ok || node.end <= id ||
+        node.end > node_count || node.position > n ||
+        node.length > n - node.position || node.token > n ||
+        node.token_length > n - node.token) {
+      return false;
+    }
+  }
+
+  auto lines = reinterpret_cast<const uint32_t *>(data + header.lines.offset);
+  auto line_count = header.lines.size / sizeof(uint32_t);
+  if (line_count > 0 && lines[line_count - 1] != n) { return false; }
+
+  header_ = reinterpret_cast<const AstFileHeader *>(data);
+  rules_ = rules;
+  strings_ = data + header.strings.offset;
+  nodes_ = nodes;
+  lines_ = line_count > 0 ? lines : nullptr;
+  source_ = line_count > 0 ? data + header.source.offset : nullptr;
+  rule_count_ = rule_count;
+  node_count_ = node_count;
+  line_count_ = line_count;
+  return true;
+}
+
+pair<size_t, size_t> AstFile::line_info(const Node &node) const {
+  if (!lines_) { return {0, 0}; }
+  auto pos = node.position;
+  auto it = lower_bound(lines_, lines_ + line_count_, pos);
+  auto id = static_cast<size_t>(it - lines_);
+  auto off = pos - (id == 0 ? 0 : lines_[id - 1] + 1);
+  return pair(id + 1, off + 1);
+}
+
+bool to_compact(const AstFile &file, const char *source, size_t n,
+                const char *path, CompactAst &tree) {
+  if (n != file.source_size()) { return false; }
+  tree.reset(source, n, path ? path : string(file.path()).c_str());
+  for (uint32_t rule = 0; rule < file.rule_count(); rule++) {
+    tree.add_rule(file.rule_name(rule), file.rule_is_token(rule));
+  }
+  for (uint32_t id = 0; id < file.size(); id++) {
+    tree.add(file[id]);
+  }
+  return true;
+}
+
+} // namespace peg
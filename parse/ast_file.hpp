@@ -0,0 +1,199 @@
+//
+//  ast_file.hpp
+//
+//  A binary file format for syntax trees, readable in place
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "compact_ast.hpp"
+
+class SourceFile;
+
+namespace peg {
+
+// An AST file is a CompactAst laid out so that it can be used straight from
+// a memory-mapped file:
+//
+//   header    AstFileHeader
+//   rules     AstFileRule per rule, indexed by Node::rule
+//   strings   the rule names and the source path, not NUL-terminated
+//   nodes     CompactAst::Node per node, in pre-order, the root first
+//   lines     uint32_t per line: the offset of its '\n', or of the end of
+//             the text for the last one
+//   source    the text the tree was parsed from
+//
+// Each section starts on an 8-byte boundary and is found through the header
+// rather than by position. The lines and source sections are optional, but
+// come together: both are empty, or lines has at least one entry. Node
+// offsets always refer to the original text, whose length is in the header
+// either way. Numbers are in the byte order of the machine that wrote the
+// file, which 'byte_order' records.
+//
+// The major version changes when a reader of the old version couldn't read
+// the file correctly; the minor version when something is only added, such
+// as fields at the end of the header (hence 'header_size').
+struct AstFileHeader {
+  struct Section {
+    uint64_t offset;
+    uint64_t size; // In bytes
+  };
+
+  char magic[8];       // "VHDLAST" and a 0x1a
+  uint32_t byte_order; // 0x01020304
+  uint16_t major;
+  uint16_t minor;
+  uint64_t header_size;
+  uint64_t file_size;
+  uint64_t source_size;
+  uint32_t path;       // Offset and length in the string table
+  uint32_t path_length;
+  Section rules;
+  Section strings;
+  Section nodes;
+  Section lines;
+  Section source;
+};
+
+struct AstFileRule {
+  uint32_t name; // Offset and length in the string table
+  uint32_t name_length;
+  uint32_t flags;
+  uint32_t reserved;
+
+  static constexpr uint32_t TOKEN = 1;
+};
+
+constexpr uint16_t AST_FILE_MAJOR = 1;
+constexpr uint16_t AST_FILE_MINOR = 0;
+
+// Write 'tree' to 'out' as an AST file, with its source text and line table
+// unless 'with_source' is false
+void write_ast_file(const CompactAst &tree, std::string &out,
+                    bool with_source = true);
+
+// An AST file, read in place. The header and the bounds of every section,
+// node and string are checked when the file is opened, so a damaged or
+// truncated file is refused rather than read outside its bytes; after that
+// nothing is copied or converted. Nodes are walked as in CompactAst.
+class AstFile {
+public:
+  using Node = CompactAst::Node;
+  static constexpr uint32_t NO_NODE = CompactAst::NO_NODE;
+
+  AstFile();
+  AstFile(AstFile &&);
+  AstFile &operator=(AstFile &&);
+  ~AstFile();
+
+  // Map the file at 'path'; false if it can't be read or isn't an AST file
+  bool open(const std::filesystem::path &path);
+
+  // Use the 'size' bytes at 'data', which must stay put while this is in
+  // use and be at least 8-byte aligned
+  bool view(const char *data, size_t size);
+
+  std::pair<uint16_t, uint16_t> version() const {
+    return {header_->major, header_->minor};
+  }
+
+  bool empty() const { return node_count_ == 0; }
+  size_t size() const { return node_count_; }
+
+  // The root is node 0
+  const Node &operator[](uint32_t id) const { return nodes_[id]; }
+
+  uint32_t first_child(uint32_t id) const {
+    return nodes_[id].end > id + 1 ? id + 1 : NO_NODE;
+  }
+
+  uint32_t next_sibling(uint32_t id) const {
+    auto parent = nodes_[id].parent;
+    auto next = nodes_[id].end;
+    return parent != NO_NODE && next < nodes_[parent].end ? next : NO_NODE;
+  }
+
+  size_t rule_count() const { return rule_count_; }
+  std::string_view rule_name(uint32_t rule) const {
+    return std::string_view(strings_ + rules_[rule].name,
+                            rules_[rule].name_length);
+  }
+  bool rule_is_token(uint32_t rule) const {
+    return (rules_[rule].flags & AstFileRule::TOKEN) != 0;
+  }
+
+  std::string_view name(const Node &node) const { return rule_name(node.rule); }
+  bool is_token(const Node &node) const { return rule_is_token(node.rule); }
+
+  std::string_view path() const {
+    return std::string_view(strings_ + header_->path, header_->path_length);
+  }
+
+  // The text, if the file holds it; tokens can't be read without it
+  bool has_source() const { return source_ != nullptr; }
+  std::string_view source() const {
+    return source_ ? std::string_view(source_, header_->source_size)
+                   : std::string_view();
+  }
+  size_t source_size() const { return header_->source_size; }
+
+  std::string_view token(const Node &node) const {
+    return source_ ? std::string_view(source_ + node.token, node.token_length)
+                   : std::string_view();
+  }
+
+  // The 1-based line and column where 'node' starts, or {0, 0} if the file
+  // has no line table
+  std::pair<size_t, size_t> line_info(const Node &node) const;
+
+private:
+  void close();
+
+  std::unique_ptr<SourceFile> file_;
+  const AstFileHeader *header_ = nullptr;
+  const AstFileRule *rules_ = nullptr;
+  const char *strings_ = nullptr;
+  const Node *nodes_ = nullptr;
+  const uint32_t *lines_ = nullptr;
+  const char *source_ = nullptr;
+  size_t rule_count_ = 0;
+  size_t node_count_ = 0;
+  size_t line_count_ = 0;
+};
+
+// Copy the tree in 'file' into 'tree', pointing its tokens into the 'n'
+// bytes at 'source' and giving it 'path' (or the file's own, if null);
+// false if the file was parsed from a different length of text
+bool to_compact(const AstFile &file, const char *source, size_t n,
+                const char *path, CompactAst &tree);
+
+} // namespace peg
@@ -0,0 +1,342 @@
+//
+//  ast_stream.cpp
+//
+//  Syntax trees written out as a stream of events
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <iostream>
+using namespace std;
+
+#include "ast_stream.hpp"
+
+namespace peg {
+
+OutputBuffer::OutputBuffer(ostream &os, size_t capacity)
+    : os_(os), data_(new char[capacity]), capacity_(capacity) {}
+
+void OutputBuffer::flush() {
+  if (used_ > 0) {
+    os_.rdbuf()->sputn(data_.get(), static_cast<streamsize>(used_));
+    used_ = 0;
+  }
+}
+
+void OutputBuffer::overflow(const char *p, size_t n) {
+  flush();
+  if (n >= capacity_) {
+    os_.rdbuf()->sputn(p, static_cast<streamsize>(n));
+  } else {
+    memcpy(data_.get(), p, n);
+    used_ = n;
+  }
+}
+
+void OutputBuffer::put_decimal(uint64_t v) {
+  char digits[20];
+  auto p = digits + sizeof(digits);
+  do {
+    *--p = static_cast<char>('0' + v % 10);
+    v /= 10;
+  } while (v != 0);
+  write(p, static_cast<size_t>(digits + sizeof(digits) - p));
+}
+
+void replay(const CompactAst &tree, AstSink &sink) {
+  auto source = tree.source();
+  sink.begin(source.data(), source.size(), tree.path().c_str());
+
+  // Nodes are in pre-order, so a rule is left once the walk passes the end
+  // of its subtree
+  vector<uint32_t> open;
+  auto event = [&](uint32_t id) {
+    auto &node = tree[id];
+    return AstEvent{node.rule,     tree.name(node),   node.position,
+                    node.length,   tree.token(node),  node.choice_count,
+                    node.choice};
+  };
+  for (uint32_t id = 0; id < tree.size(); id++) {
+    while (!open.empty() && tree[open.back()].end <= id) {
+      sink.leave(event(open.back()));
+      open.pop_back();
+    }
+    if (tree.is_token(tree[id])) {
+      sink.token(event(id));
+    } else {
+      sink.enter(event(id));
+      open.push_back(id);
+    }
+  }
+  while (!open.empty()) {
+    sink.leave(event(open.back()));
+    open.pop_back();
+  }
+
+  sink.end(true);
+}
+
+TextSink::TextSink(OutputBuffer &out, bool name_file, bool indent)
+    : out_(out), name_file_(name_file), indent_(indent), spaces_(256, ' ') {}
+
+void TextSink::begin(const char *, size_t, const char *path) {
+  level_ = 0;
+  if (name_file_) {
+    out_.write("==> ");
+    out_.write(path ? path : "");
+    out_.write(" <==\n");
+  }
+}
+
+void TextSink::line(char kind, const AstEvent &event) {
+  if (indent_) {
+    if (spaces_.size() < level_ * 2) { spaces_.resize(level_ * 4, ' '); }
+    out_.write(spaces_.data(), level_ * 2);
+  }
+  out_.put(kind);
+  out_.put(' ');
+  out_.write(event.name);
+  if (event.choice_count > 0) {
+    out_.put('/');
+    out_.put_decimal(event.choice);
+  }
+}
+
+void TextSink::enter(const AstEvent &event) {
+  line('+', event);
+  out_.put('\n');
+  level_++;
+}
+
+void TextSink::token(const AstEvent &event) {
+  line('-', event);
+  out_.write(" (");
+  out_.write(event.token);
+  out_.write(")\n");
+}
+
+void write_text(const CompactAst &tree, OutputBuffer &out, bool indent) {
+  TextSink sink(out, false, indent);
+  replay(tree, sink);
+}
+
+// The length of the UTF-8 sequence at 'p', or 0 if it isn't a valid one
+static size_t utf8_length(const unsigned char *p, const unsigned char *end) {
+  size_t len;
+  char32_t min;
+  if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+    len = 2, min = 0x80;
+  } else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+    len = 3, min = 0x800;
+  } else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+    len = 4, min = 0x10000;
+  } else {
+    return 0;
+  }
+  if (static_cast<size_t>(end - p) < len) { return 0; }
+
+  char32_t cp = p[0] & (0x3f >> (len - 1));
+  for (size_t i = 1; i < len; i++) {
+    if ((p[i] & 0xc0) != 0x80) { return 0; }
+    cp = (cp << 6) | (p[i] & 0x3f);
+  }
+  if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+    return 0;
+  }
+  return len;
+}
+
+// Adds to a std::string the way OutputBuffer writes to a stream
+namespace {
+struct StringOutput {
+  string &s;
+  void put(char c) { s += c; }
+  void write(string_view v) { s.append(v.data(), v.size()); }
+};
+} // namespace
+
+// Write 's' to 'out', an OutputBuffer or a StringOutput, as a JSON string
+template <typename Output>
+static void write_json_string(Output &out, string_view s) {
+  static constexpr char hex[] = "0123456789abcdef";
+  auto p = reinterpret_cast<const unsigned char *>(s.data());
+  auto end = p + s.size();
+
+  out.put('"');
+  while (p < end) {
+    auto c = *p;
+    if (c >= 0x80) {
+      if (auto len = utf8_length(p, end)) {
+        out.write(string_view(reinterpret_cast<const char *>(p), len));
+        p += len;
+        continue;
+      }
+    }
+    switch (c) {
+    case '"': out.write("\\\""); break;
+    case '\\': out.write("\\\\"); break;
+    case '\n': out.write("\\n"); break;
+    case '\r': out.write("\\r"); break;
+    case '\t': out.write("\\t"); break;
+    default:
+      if (c < 0x20 || c >= 0x80) {
+        out.write("\\u00");
+        out.put(hex[c >> 4]);
+        out.put(hex[c & 0xf]);
+      } else {
+        out.put(static_cast<char>(c));
+      }
+    }
+    p++;
+  }
+  out.put('"');
+}
+
+void JsonLinesSink::quote(string_view s) { write_json_string(out_, s); }
+
+void append_json_string(string &out, string_view s) {
+  StringOutput output{out};
+  write_json_string(output, s);
+}
+
+void JsonLinesSink::choice(const AstEvent &event) {
+  if (event.choice_count > 0) {
+    out_.write(",\"choice\":");
+    out_.put_decimal(event.choice);
+  }
+}
+
+void JsonLinesSink::begin(const char *, size_t n, const char *path) {
+  out_.write("{\"file\":");
+  quote(path ? path : "");
+  out_.write(",\"size\":");
+  out_.put_decimal(n);
+  out_.write("}\n");
+}
+
+void JsonLinesSink::enter(const AstEvent &event) {
+  out_.write("{\"enter\":");
+  quote(event.name);
+  out_.write(",\"pos\":");
+  out_.put_decimal(event.position);
+  choice(event);
+  out_.write("}\n");
+}
+
+void JsonLinesSink::token(const AstEvent &event) {
+  out_.write("{\"token\":");
+  quote(event.name);
+  out_.write(",\"pos\":");
+  out_.put_decimal(event.position);
+  out_.write(",\"len\":");
+  out_.put_decimal(event.length);
+  out_.write(",\"text\":");
+  quote(event.token);
+  choice(event);
+  out_.write("}\n");
+}
+
+void JsonLinesSink::leave(const AstEvent &event) {
+  out_.write("{\"leave\":");
+  quote(event.name);
+  out_.write(",\"pos\":");
+  out_.put_decimal(event.position);
+  out_.write(",\"len\":");
+  out_.put_decimal(event.length);
+  out_.write("}\n");
+}
+
+void JsonLinesSink::end(bool complete) {
+  out_.write(complete ? "{\"end\":true}\n" : "{\"end\":false}\n");
+}
+
+void BinaryEventSink::number(uint64_t v) {
+  while (v >= 0x80) {
+    out_.put(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out_.put(static_cast<char>(v));
+}
+
+uint32_t BinaryEventSink::define(const AstEvent &event, bool is_token) {
+  if (event.rule >= ids_.size()) { ids_.resize(event.rule + 1, UNDEFINED); }
+  auto &id = ids_[event.rule];
+  if (id == UNDEFINED) {
+    id = next_id_++;
+    out_.put('R');
+    number(id);
+    number(is_token ? 1 : 0);
+    number(event.name.size());
+    out_.write(event.name);
+  }
+  return id;
+}
+
+void BinaryEventSink::choice(const AstEvent &event) {
+  number(event.choice_count);
+  if (event.choice_count > 0) { number(event.choice); }
+}
+
+void BinaryEventSink::begin(const char *source, size_t n, const char *path) {
+  source_ = source;
+  ids_.clear();
+  next_id_ = 0;
+  out_.write("VHDLEVT\x1a\x01", 9);
+  out_.put('F');
+  string_view name = path ? path : "";
+  number(name.size());
+  out_.write(name);
+  number(n);
+}
+
+void BinaryEventSink::enter(const AstEvent &event) {
+  auto id = define(event, false);
+  out_.put('+');
+  number(id);
+  number(event.position);
+  choice(event);
+}
+
+void BinaryEventSink::token(const AstEvent &event) {
+  auto id = define(event, true);
+  out_.put('-');
+  number(id);
+  number(event.position);
+  number(event.length);
+  number(static_cast<uint64_t>(event.token.data() - source_));
+  number(event.token.size());
+  out_.write(event.token);
+  choice(event);
+}
+
+void BinaryEventSink::leave(const AstEvent &event) {
+  out_.put(')');
+  number(ids_[event.rule]);
+  number(event.length);
+}
+
+void BinaryEventSink::end(bool complete) {
+  out_.put('.');
+  number(complete ? 1 : 0);
+}
+
+} // namespace peg
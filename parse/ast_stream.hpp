@@ -0,0 +1,213 @@
+//
+//  ast_stream.hpp
+//
+//  Syntax trees written out as a stream of events
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "compact_ast.hpp"
+
+namespace peg {
+
+// Bytes on their way to a stream, copied into one big block and handed over
+// a block at a time rather than a piece at a time
+class OutputBuffer {
+public:
+  explicit OutputBuffer(std::ostream &os, size_t capacity = 1 << 20);
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+  ~OutputBuffer() { flush(); }
+
+  void write(const char *p, size_t n) {
+    if (n > capacity_ - used_) {
+      overflow(p, n);
+      return;
+    }
+    std::memcpy(data_.get() + used_, p, n);
+    used_ += n;
+  }
+  void write(std::string_view s) { write(s.data(), s.size()); }
+
+  void put(char c) {
+    if (used_ == capacity_) { flush(); }
+    data_[used_++] = c;
+  }
+
+  // 'v' in decimal
+  void put_decimal(uint64_t v);
+
+  // Pass everything written so far on to the stream
+  void flush();
+
+private:
+  void overflow(const char *p, size_t n);
+
+  std::ostream &os_;
+  std::unique_ptr<char[]> data_;
+  size_t capacity_;
+  size_t used_ = 0;
+};
+
+// A node as an event. Rule numbers and names are those of the tree (or
+// parser) that sends it. The length of a rule isn't known until it has
+// been matched, so it's only given on leave().
+struct AstEvent {
+  uint32_t rule;
+  std::string_view name;
+  uint32_t position;
+  uint32_t length;
+  std::string_view token; // Token rules only
+  uint16_t choice_count;  // As in CompactAst::Node
+  uint16_t choice;
+};
+
+// Receives a tree as a run of events, in the order of a pre-order walk: an
+// enter() and a leave() around each rule's children, and one token() for
+// each token. Each tree comes between begin() and end().
+class AstSink {
+public:
+  virtual ~AstSink() = default;
+
+  // 'source' is the text that tokens point into
+  virtual void begin(const char *source, size_t n, const char *path) = 0;
+  virtual void enter(const AstEvent &event) = 0;
+  virtual void token(const AstEvent &event) = 0;
+  virtual void leave(const AstEvent &event) = 0;
+
+  // 'complete' is false if the parse failed part way, after some of the
+  // tree had already been sent
+  virtual void end(bool complete) = 0;
+};
+
+// Send all of 'tree' to 'sink', from begin() to end()
+void replay(const CompactAst &tree, AstSink &sink);
+
+// The indented text that ast_to_s() gives, as "+ rule" lines for rules and
+// "- rule (token)" lines for tokens, or the same lines without the
+// indentation if 'indent' is false. A tree's text starts with a
+// "==> path <==" line if 'name_file' is set.
+class TextSink : public AstSink {
+public:
+  TextSink(OutputBuffer &out, bool name_file, bool indent = true);
+
+  void begin(const char *source, size_t n, const char *path) override;
+  void enter(const AstEvent &event) override;
+  void token(const AstEvent &event) override;
+  void leave(const AstEvent &) override { level_--; }
+  void end(bool) override {}
+
+private:
+  void line(char kind, const AstEvent &event);
+
+  OutputBuffer &out_;
+  bool name_file_;
+  bool indent_;
+  size_t level_ = 0;
+  std::string spaces_; // Enough for the deepest line so far
+};
+
+// Write 'tree' to 'out' as TextSink does, without the file name
+void write_text(const CompactAst &tree, OutputBuffer &out, bool indent = true);
+
+// One JSON object per line and event:
+//
+//   {"file":"hello.vhd","size":512}
+//   {"enter":"design_unit","pos":0}
+//   {"token":"basic_identifier","pos":8,"len":4,"text":"ieee"}
+//   {"leave":"design_unit","pos":0,"len":120}
+//   {"end":true}
+//
+// Rules that record a choice also have "choice":n. Text that isn't valid
+// UTF-8 is written a byte at a time, as if it were Latin-1.
+class JsonLinesSink : public AstSink {
+public:
+  explicit JsonLinesSink(OutputBuffer &out) : out_(out) {}
+
+  void begin(const char *source, size_t n, const char *path) override;
+  void enter(const AstEvent &event) override;
+  void token(const AstEvent &event) override;
+  void leave(const AstEvent &event) override;
+  void end(bool complete) override;
+
+private:
+  void quote(std::string_view s);
+  void choice(const AstEvent &event);
+
+  OutputBuffer &out_;
+};
+
+// Add 's' to 'out' as a JSON string, quotes and all, as JsonLinesSink
+// writes them
+void append_json_string(std::string &out, std::string_view s);
+
+// The same events in binary. Each tree starts with the 8 bytes "VHDLEVT"
+// and 0x1a, then a version byte (1), then records, each a byte saying what
+// it is followed by unsigned LEB128 numbers and raw bytes:
+//
+//   'F' path length, path, source length       the file (always first)
+//   'R' rule, flags, name length, name         before a rule's first use;
+//                                              flags bit 0 marks a token
+//   '+' rule, position, choice count[, choice] enter
+//   '-' rule, position, length, token position,
+//       token length, token, choice count[, choice]
+//   ')' rule, length                           leave
+//   '.' complete (0 or 1)                      end
+//
+// The choice is only there when the choice count isn't zero. Rules are
+// numbered in the order they're first used, so the bytes don't depend on
+// which parser sent the tree.
+class BinaryEventSink : public AstSink {
+public:
+  explicit BinaryEventSink(OutputBuffer &out) : out_(out) {}
+
+  void begin(const char *source, size_t n, const char *path) override;
+  void enter(const AstEvent &event) override;
+  void token(const AstEvent &event) override;
+  void leave(const AstEvent &event) override;
+  void end(bool complete) override;
+
+private:
+  void number(uint64_t v);
+  uint32_t define(const AstEvent &event, bool is_token);
+  void choice(const AstEvent &event);
+
+  static constexpr uint32_t UNDEFINED = ~uint32_t(0);
+
+  OutputBuffer &out_;
+  const char *source_ = nullptr;
+  std::vector<uint32_t> ids_; // By the sender's rule number
+  uint32_t next_id_ = 0;
+};
+
+} // namespace peg
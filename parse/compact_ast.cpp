@@ -0,0 +1,175 @@
+//
+//  compact_ast.cpp
+//
+//  A syntax tree held in a few flat arrays
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+using namespace std;
+
+#include "compact_ast.hpp"
+
+namespace peg {
+
+pair<size_t, size_t> CompactAst::line_info(const Node &node) const {
+  auto pos = node.position;
+  auto it = lower_bound(line_ends_.begin(), line_ends_.end(), pos);
+  auto id = static_cast<size_t>(distance(line_ends_.begin(), it));
+  auto off = pos - (id == 0 ? 0 : line_ends_[id - 1] + 1);
+  return pair(id + 1, off + 1);
+}
+
+void CompactAst::clear() {
+  source_ = nullptr;
+  source_size_ = 0;
+  source_owner_.reset();
+  path_.clear();
+  rules_.clear();
+  nodes_.clear();
+  line_ends_.clear();
+}
+
+void CompactAst::reset(const char *source, size_t n, const char *path) {
+  clear();
+  source_ = source;
+  source_size_ = n;
+  path_ = path ? path : "";
+
+  for (auto p = source, end = source + n;
+       (p = static_cast<const char *>(memchr(p, '\n', end - p))); p++) {
+    line_ends_.push_back(static_cast<uint32_t>(p - source));
+  }
+  line_ends_.push_back(static_cast<uint32_t>(n));
+}
+
+uint32_t CompactAst::add_rule(string_view name, bool is_token) {
+  rules_.push_back(Rule{string(name), is_token});
+  return static_cast<uint32_t>(rules_.size() - 1);
+}
+
+static shared_ptr<Ast> to_ast(const CompactAst &tree, uint32_t id) {
+  auto &node = tree[id];
+  auto line = tree.line_info(node);
+  auto path = tree.path().c_str();
+  auto name = tree.name(node).c_str();
+
+  if (tree.is_token(node)) {
+    return make_shared<Ast>(path, line.first, line.second, name,
+                            tree.token(node), node.position, node.length,
+                            node.choice_count, node.choice);
+  }
+
+  vector<shared_ptr<Ast>> children;
+  for (auto child = tree.first_child(id); child != CompactAst::NO_NODE;
+       child = tree.next_sibling(child)) {
+    children.push_back(to_ast(tree, child));
+  }
+  auto ast = make_shared<Ast>(path, line.first, line.second, name, children,
+                              node.position, node.length, node.choice_count,
+                              node.choice);
+  for (auto &child : ast->nodes) {
+    child->parent = ast;
+  }
+  return ast;
+}
+
+shared_ptr<Ast> to_ast(const CompactAst &tree) {
+  return tree.empty() ? nullptr : to_ast(tree, 0);
+}
+
+static void to_compact(const Ast &ast, uint32_t parent, const char *source,
+                       unordered_map<string, uint32_t> &rules,
+                       CompactAst &tree) {
+  auto rule = rules.find(ast.name);
+  if (rule == rules.end()) {
+    rule = rules.emplace(ast.name, tree.add_rule(ast.name, ast.is_token)).first;
+  }
+
+  CompactAst::Node node{};
+  node.rule = rule->second;
+  node.parent = parent;
+  node.position = static_cast<uint32_t>(ast.position);
+  node.length = static_cast<uint32_t>(ast.length);
+  if (ast.is_token) {
+    node.token = static_cast<uint32_t>(ast.token.data() - source);
+    node.token_length = static_cast<uint32_t>(ast.token.size());
+  }
+  node.choice_count = static_cast<uint16_t>(ast.choice_count);
+  node.choice = static_cast<uint16_t>(ast.choice);
+
+  auto id = tree.add(node);
+  for (auto &child : ast.nodes) {
+    to_compact(*child, id, source, rules, tree);
+  }
+  tree.close(id);
+}
+
+void to_compact(const shared_ptr<Ast> &ast, const char *source, size_t n,
+                CompactAst &tree) {
+  tree.reset(source, n, ast ? ast->path.c_str() : nullptr);
+  if (!ast) { return; }
+  unordered_map<string, uint32_t> rules;
+  to_compact(*ast, CompactAst::NO_NODE, source, rules, tree);
+}
+
+static void to_compact(const AstNodes &nodes, uint32_t id, uint32_t parent,
+                       unordered_map<const Definition *, uint32_t> &rules,
+                       CompactAst &tree) {
+  auto &from = nodes.nodes[id];
+  auto rule = rules.find(from.rule);
+  if (rule == rules.end()) {
+    rule = rules
+               .emplace(from.rule, tree.add_rule(from.rule->name,
+                                                 from.rule->is_token()))
+               .first;
+  }
+
+  CompactAst::Node node{};
+  node.rule = rule->second;
+  node.parent = parent;
+  node.position = from.position;
+  node.length = from.length;
+  node.token = from.token;
+  node.token_length = from.token_length;
+  node.choice_count = from.choice_count;
+  node.choice = from.choice;
+
+  auto to = tree.add(node);
+  for (uint32_t i = 0; i < from.child_count; i++) {
+    to_compact(nodes, nodes.children[from.children + i], to, rules, tree);
+  }
+  tree.close(to);
+}
+
+void to_compact(const AstNodes &nodes, const char *source, size_t n,
+                const char *path, CompactAst &tree) {
+  tree.reset(source, n, path);
+  if (nodes.root == AstNodes::NO_NODE) { return; }
+  unordered_map<const Definition *, uint32_t> rules;
+  to_compact(nodes, nodes.root, CompactAst::NO_NODE, rules, tree);
+}
+
+} // namespace peg
@@ -0,0 +1,154 @@
+//
+//  compact_ast.hpp
+//
+//  A syntax tree held in a few flat arrays
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "peglib.h"
+
+namespace peg {
+
+// The same tree as a peg::Ast, without a heap block per node. Nodes sit in
+// one array in pre-order, so a node's children follow it directly and each
+// knows where its subtree ends; rule names are stored once per tree, and
+// tokens and line numbers are worked out from the source text, which the
+// tree points into rather than copies. Freeing the tree frees the arrays.
+class CompactAst {
+public:
+  static constexpr uint32_t NO_NODE = static_cast<uint32_t>(-1);
+
+  struct Node {
+    uint32_t rule;         // Index into the rule names
+    uint32_t parent;       // NO_NODE for the root
+    uint32_t end;          // One past the last node of the subtree
+    uint32_t position;     // Offset of the match in the source
+    uint32_t length;
+    uint32_t token;        // Offset of the token, for token rules
+    uint32_t token_length;
+    uint16_t choice_count; // As in peg::Ast
+    uint16_t choice;
+  };
+
+  bool empty() const { return nodes_.empty(); }
+  size_t size() const { return nodes_.size(); }
+
+  // The root is node 0
+  const Node &operator[](uint32_t id) const { return nodes_[id]; }
+
+  // The first child of 'id', or NO_NODE
+  uint32_t first_child(uint32_t id) const {
+    return nodes_[id].end > id + 1 ? id + 1 : NO_NODE;
+  }
+
+  // The sibling after 'id', or NO_NODE
+  uint32_t next_sibling(uint32_t id) const {
+    auto parent = nodes_[id].parent;
+    auto next = nodes_[id].end;
+    return parent != NO_NODE && next < nodes_[parent].end ? next : NO_NODE;
+  }
+
+  const std::string &name(const Node &node) const {
+    return rules_[node.rule].name;
+  }
+
+  bool is_token(const Node &node) const { return rules_[node.rule].is_token; }
+
+  // The rule names, by index
+  size_t rule_count() const { return rules_.size(); }
+  const std::string &rule_name(uint32_t rule) const {
+    return rules_[rule].name;
+  }
+  bool rule_is_token(uint32_t rule) const { return rules_[rule].is_token; }
+
+  std::string_view token(const Node &node) const {
+    return std::string_view(source_ + node.token, node.token_length);
+  }
+
+  // The 1-based line and column where 'node' starts
+  std::pair<size_t, size_t> line_info(const Node &node) const;
+
+  const std::string &path() const { return path_; }
+
+  // The text the tree was parsed from
+  std::string_view source() const {
+    return std::string_view(source_, source_size_);
+  }
+
+  // The offset of each line's '\n', then the offset of the end of the text
+  const std::vector<uint32_t> &line_ends() const { return line_ends_; }
+
+  // Keep 'owner', whatever holds the source text, alive with the tree
+  void own_source(std::shared_ptr<const void> owner) {
+    source_owner_ = std::move(owner);
+  }
+
+  void clear();
+
+  // Building a tree: reset() it, then add() each node in pre-order and
+  // close() it once its children have been added
+  void reset(const char *source, size_t n, const char *path);
+  uint32_t add_rule(std::string_view name, bool is_token);
+  uint32_t add(const Node &node) {
+    nodes_.push_back(node);
+    return static_cast<uint32_t>(nodes_.size() - 1);
+  }
+  void close(uint32_t id) { nodes_[id].end = static_cast<uint32_t>(size()); }
+  void reserve(size_t nodes) { nodes_.reserve(nodes); }
+
+private:
+  struct Rule {
+    std::string name;
+    bool is_token;
+  };
+
+  const char *source_ = nullptr;
+  size_t source_size_ = 0;
+  std::shared_ptr<const void> source_owner_;
+  std::string path_;
+  std::vector<Rule> rules_;
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> line_ends_;
+};
+
+// The tree as a peg::Ast
+std::shared_ptr<Ast> to_ast(const CompactAst &tree);
+
+// Copy 'ast', parsed from the 'n' bytes at 'source', into 'tree'
+void to_compact(const std::shared_ptr<Ast> &ast, const char *source, size_t n,
+                CompactAst &tree);
+
+// The same for the tree in 'nodes', giving it 'path'
+void to_compact(const AstNodes &nodes, const char *source, size_t n,
+                const char *path, CompactAst &tree);
+
+} // namespace peg
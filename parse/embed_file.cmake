@@ -0,0 +1,13 @@
+# Writes INPUT into OUTPUT as a NUL-terminated C++ unsigned char array called NAME.
+#
+# Usage: cmake -DINPUT=<file> -DOUTPUT=<file.cpp> -DNAME=<symbol> -P embed_file.cmake
+#
+# An array initialiser has no length limit, unlike a string literal, so this
+# builds with MSVC as well as GCC and Clang.
+
+file(READ "${INPUT}" hex HEX)
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," hex "${hex}")
+string(REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n" hex "${hex}")
+get_filename_component(input_name "${INPUT}" NAME)
+file(WRITE "${OUTPUT}" "// Generated from ${input_name} by embed_file.cmake - do not edit\n\n")
+file(APPEND "${OUTPUT}" "extern const unsigned char ${NAME}[];\nconst unsigned char ${NAME}[] = {\n${hex}0x00};\n")
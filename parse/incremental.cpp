@@ -0,0 +1,299 @@
+//
+//  incremental.cpp
+//
+//  A VHDL file that is parsed again a piece at a time as it is edited
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "incremental.hpp"
+
+using peg::CompactAst;
+
+// How far past its end a design unit's match can look: its trailing
+// whitespace stops at the first byte that doesn't start a space, "--",
+// "/*" or "\r\n"
+static constexpr size_t lookahead = 2;
+
+// The child of 'id' matched by rule 'name', or NO_NODE
+static uint32_t child_named(const CompactAst &tree, uint32_t id,
+                            string_view name) {
+  for (auto child = tree.first_child(id); child != CompactAst::NO_NODE;
+       child = tree.next_sibling(child)) {
+    if (tree.name(tree[child]) == name) { return child; }
+  }
+  return CompactAst::NO_NODE;
+}
+
+// Add the nodes [first, end) of 'from', a run of whole subtrees, to 'to',
+// under 'parent' and 'shift' bytes further on (mod 2^32, so it can be
+// negative), renumbering their rules through 'rules' if it's given
+static void copy_nodes(const CompactAst &from, uint32_t first, uint32_t end,
+                       uint32_t parent, uint32_t shift,
+                       const vector<uint32_t> *rules, CompactAst &to) {
+  vector<char> is_token(from.rule_count());
+  for (uint32_t rule = 0; rule < from.rule_count(); rule++) {
+    is_token[rule] = from.rule_is_token(rule);
+  }
+
+  auto base = static_cast<uint32_t>(to.size());
+  for (auto i = first; i < end; i++) {
+    auto node = from[i];
+    node.parent = node.parent >= first && node.parent < end
+                      ? node.parent - first + base
+                      : parent;
+    node.end = node.end - first + base;
+    node.position += shift;
+    if (is_token[node.rule]) { node.token += shift; }
+    if (rules) { node.rule = (*rules)[node.rule]; }
+    to.add(node);
+  }
+}
+
+Vhdl2008Document::Vhdl2008Document(Vhdl2008Options options)
+    : options_(options) {
+  // The tree is always built here, never cached or printed
+  options_.cache = nullptr;
+}
+
+bool Vhdl2008Document::open(string text, string path, peg::Log log) {
+  text_ = move(text);
+  path_ = move(path);
+  tree_.clear();
+  current_ = false;
+  return parse_all(log);
+}
+
+bool Vhdl2008Document::edit(size_t offset, size_t removed,
+                            string_view inserted, peg::Log log) {
+  if (offset > text_.size() || removed > text_.size() - offset) {
+    throw out_of_range("edit outside the text");
+  }
+  text_.replace(offset, removed, inserted.data(), inserted.size());
+
+  // Fold the edit into the region where the two texts differ, in the
+  // coordinates of the tree's text: before the region they're the same,
+  // after it they're 'changed_delta_' apart
+  auto delta = static_cast<ptrdiff_t>(inserted.size()) -
+               static_cast<ptrdiff_t>(removed);
+  if (current_) {
+    changed_begin_ = offset;
+    changed_end_ = offset + removed;
+    changed_delta_ = delta;
+  } else {
+    auto end = static_cast<size_t>(static_cast<ptrdiff_t>(offset + removed) -
+                                   changed_delta_);
+    changed_begin_ = min(changed_begin_, offset);
+    changed_end_ = max(changed_end_, end);
+    changed_delta_ += delta;
+  }
+  current_ = false;
+
+  return reparse(log);
+}
+
+bool Vhdl2008Document::parse_all(peg::Log log) {
+  last_ = Reparse{true, text_.size(), 0, 0};
+
+  auto text = make_shared<const string>(text_);
+  CompactAst tree;
+  if (!Vhdl2008Parser::instance().parse(text->data(), text->size(), tree,
+                                        path_.c_str(), log, options_)) {
+    return false;
+  }
+  tree.own_source(text);
+
+  auto file = child_named(tree, 0, "design_file");
+  if (file != CompactAst::NO_NODE) {
+    for (auto unit = tree.first_child(file); unit != CompactAst::NO_NODE;
+         unit = tree.next_sibling(unit)) {
+      last_.parsed_units++;
+    }
+  }
+
+  tree_ = move(tree);
+  current_ = true;
+  return true;
+}
+
+bool Vhdl2008Document::reparse(peg::Log log) {
+  auto file = tree_.empty() ? CompactAst::NO_NODE
+                            : child_named(tree_, 0, "design_file");
+  if (file == CompactAst::NO_NODE) { return parse_all(log); }
+
+  vector<uint32_t> units;
+  for (auto unit = tree_.first_child(file); unit != CompactAst::NO_NODE;
+       unit = tree_.next_sibling(unit)) {
+    units.push_back(unit);
+  }
+  if (units.empty()) { return parse_all(log); }
+
+  // The units the change could have touched: from the first that reaches
+  // (or looks) into it, to the last that starts inside it
+  auto start = [&](size_t i) { return size_t(tree_[units[i]].position); };
+  auto end = [&](size_t i) { return start(i) + tree_[units[i]].length; };
+  size_t first = 0;
+  while (first + 1 < units.size() && end(first) + lookahead <= changed_begin_) {
+    first++;
+  }
+  auto last = units.size() - 1;
+  while (last > first && start(last) > changed_end_) {
+    last--;
+  }
+
+  // The same region of the new text, starting with the whitespace before
+  // the first unit if that's in it
+  auto begin = first == 0 ? size_t(0) : start(first);
+  auto size = static_cast<size_t>(static_cast<ptrdiff_t>(end(last)) +
+                                  changed_delta_) -
+              begin;
+  auto text = make_shared<const string>(text_);
+
+  struct Error {
+    size_t line, col;
+    string msg, rule;
+  };
+  vector<Error> errors;
+  auto collect = [&](size_t line, size_t col, const string &msg,
+                     const string &rule) {
+    errors.push_back(Error{line, col, msg, rule});
+  };
+
+  CompactAst fragment;
+  if (!Vhdl2008Parser::instance().parse(text->data() + begin, size, fragment,
+                                        path_.c_str(), collect, options_)) {
+    // An error that's found inside the region is the same in the whole
+    // text. One at either end might not be: the units after the region may
+    // be what the parse was missing, and at its start the whole text could
+    // also have ended there.
+    auto region = text->data() + begin;
+    auto region_end = region + size;
+    auto inside = !errors.empty();
+    for (auto &error : errors) {
+      auto p = region;
+      for (size_t line = 1; line < error.line && p < region_end; p++) {
+        if (*p == '\n') { line++; }
+      }
+      for (size_t col = 1; col < error.col && p < region_end; col++) {
+        p += peg::codepoint_length(p, static_cast<size_t>(region_end - p));
+      }
+      inside = inside && (p > region || begin == 0) && p < region_end;
+    }
+    if (!inside) { return parse_all(log); }
+
+    last_ = Reparse{false, size, 0, 0};
+    if (log) {
+      auto lines = peg::line_info(text->data(), region);
+      for (auto &error : errors) {
+        auto col = error.line == 1 ? error.col + lines.second - 1 : error.col;
+        log(error.line + lines.first - 1, col, error.msg, error.rule);
+      }
+    }
+    return false;
+  }
+
+  // Splice the new units in between the old ones, taking the rule numbers
+  // of the old tree
+  CompactAst tree;
+  tree.reset(text->data(), text->size(), path_.c_str());
+  tree.reserve(tree_.size() - (tree_[units[last]].end - units[first]) +
+               fragment.size());
+  unordered_map<string_view, uint32_t> rule_ids;
+  for (uint32_t rule = 0; rule < tree_.rule_count(); rule++) {
+    rule_ids.emplace(tree_.rule_name(rule),
+                     tree.add_rule(tree_.rule_name(rule),
+                                   tree_.rule_is_token(rule)));
+  }
+  vector<uint32_t> rules(fragment.rule_count());
+  for (uint32_t rule = 0; rule < fragment.rule_count(); rule++) {
+    auto &name = fragment.rule_name(rule);
+    auto it = rule_ids.find(name);
+    rules[rule] = it != rule_ids.end()
+                      ? it->second
+                      : tree.add_rule(name, fragment.rule_is_token(rule));
+  }
+
+  auto fragment_file = child_named(fragment, 0, "design_file");
+  auto root_node = tree_[0];
+  root_node.position = begin == 0 ? fragment[0].position : tree_[0].position;
+  root_node.length = static_cast<uint32_t>(text->size()) - root_node.position;
+  auto root = tree.add(root_node);
+  size_t parsed = 0;
+
+  // What comes before the units (the leading whitespace) is in the region
+  // if the first unit is, and what comes after (the end of the file) if
+  // the last one is
+  auto copy_around = [&](bool before) {
+    auto from_fragment = before ? begin == 0 : last + 1 == units.size();
+    auto &from = from_fragment ? fragment : tree_;
+    auto from_file = from_fragment ? fragment_file : file;
+    auto shift = before          ? 0
+                 : from_fragment ? static_cast<uint32_t>(begin)
+                                 : static_cast<uint32_t>(changed_delta_);
+    for (auto child = from.first_child(0); child != CompactAst::NO_NODE;
+         child = from.next_sibling(child)) {
+      if (before ? child < from_file : child > from_file) {
+        copy_nodes(from, child, from[child].end, root, shift,
+                   from_fragment ? &rules : nullptr, tree);
+      }
+    }
+  };
+
+  copy_around(true);
+  auto file_node = tree_[file];
+  file_node.parent = root;
+  file_node.position = begin == 0 ? fragment[fragment_file].position
+                                  : tree_[file].position;
+  file_node.length = static_cast<uint32_t>(text->size()) - file_node.position;
+  auto new_file = tree.add(file_node);
+  if (first > 0) {
+    copy_nodes(tree_, units[0], units[first], new_file, 0, nullptr, tree);
+  }
+  for (auto unit = fragment.first_child(fragment_file);
+       unit != CompactAst::NO_NODE; unit = fragment.next_sibling(unit)) {
+    parsed++;
+  }
+  copy_nodes(fragment, fragment_file + 1, fragment[fragment_file].end,
+             new_file, static_cast<uint32_t>(begin), &rules, tree);
+  if (last + 1 < units.size()) {
+    copy_nodes(tree_, units[last + 1], tree_[file].end, new_file,
+               static_cast<uint32_t>(changed_delta_), nullptr, tree);
+  }
+  tree.close(new_file);
+  copy_around(false);
+  tree.close(root);
+  tree.own_source(text);
+
+  last_ = Reparse{false, size, parsed, units.size() - (last - first + 1)};
+  tree_ = move(tree);
+  current_ = true;
+  return true;
+}
@@ -0,0 +1,106 @@
+//
+//  incremental.hpp
+//
+//  A VHDL file that is parsed again a piece at a time as it is edited
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "compact_ast.hpp"
+#include "parse.hpp"
+
+// The text of a file being edited, and its tree.
+//
+// The parser commits to each design unit once it has matched (nothing
+// backtracks into it, and the packrat cache is dropped), and a unit's match
+// depends only on its own text and the first couple of bytes after it. So
+// after an edit only the units that the edit touches, and the one before
+// if the edit is at its very end, need parsing again: they're parsed on
+// their own, and their subtrees are spliced in place of the old ones, with
+// the units after them moved along. Anything that can't be settled that
+// way, such as an edit that merges or splits units so that they no longer
+// end where they should, falls back to parsing the whole text.
+//
+// While the text has a syntax error the tree stays as it was at the last
+// text that parsed, and the edits since are put together into one region,
+// which is parsed again as a whole at the next edit.
+class Vhdl2008Document {
+public:
+  // What the last parse did
+  struct Reparse {
+    bool full = false;         // The whole text was parsed
+    size_t parsed_bytes = 0;
+    size_t parsed_units = 0;   // Design units matched again...
+    size_t kept_units = 0;     // ...and those taken from the old tree
+  };
+
+  explicit Vhdl2008Document(Vhdl2008Options options = {});
+  Vhdl2008Document(const Vhdl2008Document &) = delete;
+  Vhdl2008Document &operator=(const Vhdl2008Document &) = delete;
+
+  // Parse 'text' from scratch, sending syntax errors to 'log'
+  bool open(std::string text, std::string path = {}, peg::Log log = nullptr);
+
+  // Replace the 'removed' bytes at 'offset' with 'inserted', and bring the
+  // tree up to date. Errors are reported against the whole text, as if it
+  // had been parsed from scratch. Throws std::out_of_range if the bytes
+  // aren't there.
+  bool edit(size_t offset, size_t removed, std::string_view inserted,
+            peg::Log log = nullptr);
+
+  const std::string &text() const { return text_; }
+  const std::string &path() const { return path_; }
+
+  // The tree of the last text that parsed; that's text() itself if
+  // current() is true
+  const peg::CompactAst &tree() const { return tree_; }
+  bool current() const { return current_; }
+
+  const Reparse &last_reparse() const { return last_; }
+
+private:
+  bool parse_all(peg::Log log);
+  bool reparse(peg::Log log);
+
+  Vhdl2008Options options_;
+  std::string path_;
+  std::string text_;
+
+  // The tree holds its own copy of the text it was parsed from, which stays
+  // put however text_ is edited. Where the two texts differ is one region:
+  // [changed_begin_, changed_end_) of the tree's text, which is
+  // 'changed_delta_' bytes longer in text_.
+  peg::CompactAst tree_;
+  bool current_ = false;
+  size_t changed_begin_ = 0;
+  size_t changed_end_ = 0;
+  ptrdiff_t changed_delta_ = 0;
+
+  Reparse last_;
+};
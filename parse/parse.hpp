@@ -25,7 +25,235 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE
 
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ast_stream.hpp"
+#include "compact_ast.hpp"
+#include "peglib.h"
+
+class AstCache;
+
+// Which implementation of the grammar to run
+enum class Vhdl2008Engine {
+  Generated,   // C++ generated from the grammar at build time, if it was built
+  Interpreter, // peglib interpreting the grammar at run time
+};
+
+// How parse_vhdl_2008() writes trees
+enum class Vhdl2008Format {
+  Text,      // Indented, as peg::ast_to_s() prints them
+  Compact,   // The same lines without the indentation
+  Binary,    // An AST file (see ast_file.hpp), with the source text
+  JsonLines, // Events, as peg::JsonLinesSink writes them
+  Events,    // Events, as peg::BinaryEventSink writes them
+};
+
+struct Vhdl2008Options {
+  Vhdl2008Engine engine = Vhdl2008Engine::Generated;
+
+  // Tokenize the input before parsing it (see scan.hpp), so that the
+  // generated parser can look whitespace and comments up instead of
+  // matching them; the interpreter ignores this
+  bool scan = true;
+
+  // Threads to parse a big file on: its design units are matched in chunks
+  // on all of them, and then put together as one tree (generated engine
+  // only)
+  unsigned threads = 1;
+
+  // Where parse_vhdl_2008() keeps trees between runs, if anywhere (see
+  // ast_cache.hpp); parse() ignores this
+  AstCache *cache = nullptr;
+
+  // ...and how it writes them; parse() ignores this too
+  Vhdl2008Format format = Vhdl2008Format::Text;
+
+  // Print each design unit as soon as it's been parsed rather than waiting
+  // for the whole tree, in the text formats; the event formats always do.
+  // A syntax error then comes after the units before it have been printed.
+  bool stream = false;
+};
+
+// How often a rule was tried, and how many of those tries were at a place
+// where it had already been tried (and so could come from the packrat cache)
+struct Vhdl2008RuleCounts {
+  size_t calls = 0;
+  size_t reentries = 0;
+};
+
+using Vhdl2008MemoProfile = std::map<std::string, Vhdl2008RuleCounts>;
+
+// Write the rules from 'profile' that are worth memoising, in the format of
+// grammar/vhdl2008.memo: those where at least 'min_ratio' of the tries were
+// repeats
+void write_memo_list(const Vhdl2008MemoProfile &profile, std::ostream &os,
+                     double min_ratio = 0.1);
+
+// What one rule cost over a profiled parse. Times are in nanoseconds; a
+// rule's total time includes the rules it called, but a recursive call is
+// only counted once, in the outermost one.
+struct Vhdl2008RuleStats {
+  size_t calls = 0;
+  size_t successes = 0;
+  size_t failures = 0;
+  size_t memo_hits = 0; // Answered from the packrat cache
+  size_t bytes = 0;     // Matched by the successes, whitespace included
+  uint64_t total_ns = 0;
+  uint64_t self_ns = 0;
+
+  // Alternatives of the choices in the rule's own expression, tried or
+  // ruled out by the byte they'd have started at
+  size_t alternatives_tried = 0;
+  size_t alternatives_skipped = 0;
+};
+
+struct Vhdl2008Profile {
+  std::map<std::string, Vhdl2008RuleStats> rules;
+  size_t files = 0;
+  size_t bytes = 0; // Of source text
+  uint64_t ns = 0;  // Parsing, profiling overhead included
+
+  // The most semantic value frames and capture scopes that one parse made.
+  // They're reused from one rule call to the next, so this is the deepest
+  // nesting, however many rules were called.
+  size_t value_frames = 0;
+  size_t capture_frames = 0;
+
+  // Spent in the native %whitespace skipper, which the rules don't include
+  size_t whitespace_calls = 0;
+  uint64_t whitespace_ns = 0;
+};
+
+// The rules from 'profile' as a table, the most expensive (by self time)
+// first, with 'limit' rows at most if it isn't zero
+void write_profile_table(const Vhdl2008Profile &profile, std::ostream &os,
+                         size_t limit = 0);
+
+// All of 'profile' as one JSON object
+void write_profile_json(const Vhdl2008Profile &profile, std::ostream &os);
+
+// A compiled VHDL-2008 grammar.
+//
+// Compiling the grammar for the interpreter (parsing the PEG, linking
+// references and checking for left recursion) costs far more than parsing a
+// typical source file, so build one of these and reuse it. The generated
+// parser needs no compiling; the interpreter is then only set up the first
+// time a syntax error has to be explained. Syntax errors are always
+// explained by a second copy of the grammar with every rule memoised, as
+// peglib's messages depend on which rules come from the packrat cache. Apart
+// from that one-off set-up the object is never modified, so one instance can
+// be shared by any number of threads.
+class Vhdl2008Parser {
+public:
+  // The process-wide parser
+  static const Vhdl2008Parser &instance();
+
+  // True if the generated parser was built in
+  static bool has_generated();
+
+  // The text of the grammar, which is also what decides the trees it builds
+  static std::string_view grammar();
+
+  // Parse 'n' bytes of VHDL into an AST, sending syntax errors to 'log'. Both
+  // engines build the same AST and report the same errors.
+  bool parse(const char *s, size_t n, std::shared_ptr<peg::Ast> &ast,
+             const char *path = nullptr, peg::Log log = nullptr,
+             const Vhdl2008Options &options = {}) const;
+
+  // The same, but into a peg::CompactAst, which is smaller and quicker to
+  // build. Its tokens point into 's', so the text must outlive the tree.
+  bool parse(const char *s, size_t n, peg::CompactAst &ast,
+             const char *path = nullptr, peg::Log log = nullptr,
+             const Vhdl2008Options &options = {}) const;
+
+  // The same, but sending the tree to 'sink' as it's parsed. The generated
+  // parser sends each design unit as soon as it's matched, and never holds
+  // the whole tree; with the interpreter, the tree is sent once it's built.
+  // If the parse fails, 'sink' may already have had some of the tree.
+  bool parse(const char *s, size_t n, peg::AstSink &sink,
+             const char *path = nullptr, peg::Log log = nullptr,
+             const Vhdl2008Options &options = {}) const;
+
+  // Parse with the interpreter and add each rule's counts to 'profile'. This
+  // compiles its own copy of the grammar, so it's meant for tuning rather
+  // than for everyday parsing.
+  bool profile_memo(const char *s, size_t n,
+                    Vhdl2008MemoProfile &profile) const;
+
+  // Parse with the interpreter, timing and counting every rule it tries,
+  // and add the results to 'profile'. Like profile_memo(), this uses its
+  // own copy of the grammar, memoised as for parsing.
+  bool profile(const char *s, size_t n, Vhdl2008Profile &profile) const;
+
+  // How long it took to compile the grammar for the interpreter and for
+  // explaining syntax errors, or zero if neither has been needed yet
+  std::chrono::steady_clock::duration load_time() const {
+    return std::chrono::steady_clock::duration(load_ticks_.load());
+  }
+
+private:
+  // The interpreter's start rule, with only the rules in vhdl2008.memo
+  // memoised, or with all of them if 'diagnose' is set
+  const peg::Definition &interpreter(bool diagnose = false) const;
+
+  // Parse with the interpreter; if that fails and 'log' is set, parse again
+  // with diagnose() to report the error
+  bool interpret(const char *s, size_t n, std::shared_ptr<peg::Ast> &ast,
+                 const char *path, peg::Log log) const;
+  bool interpret(const char *s, size_t n, peg::CompactAst &ast,
+                 const char *path, peg::Log log) const;
+
+  // Parse with every rule memoised, sending syntax errors to 'log'
+  bool diagnose(const char *s, size_t n, peg::CompactAst &ast,
+                const char *path, peg::Log log) const;
+
+  struct Interpreter {
+    std::once_flag load_once;
+    peg::parser parser;
+    const peg::Definition *start = nullptr;
+  };
+  mutable Interpreter interpreters_[2]; // Indexed by 'diagnose'
+  mutable std::atomic<std::chrono::steady_clock::rep> load_ticks_{0};
+};
 
 //int parse(std::filesystem::path file_path);
-int parse_vhdl_2008(std::filesystem::path hdl_file_path);
+
+// Profile how the rules in a file are re-entered, adding to 'profile'
+int profile_vhdl_2008_memo(std::filesystem::path hdl_file_path,
+                           Vhdl2008MemoProfile &profile);
+
+// Profile the rules tried in parsing a file, adding to 'profile'
+int profile_vhdl_2008(std::filesystem::path hdl_file_path,
+                      Vhdl2008Profile &profile);
+
+// Parse a file ("-" for stdin) and print its AST to stdout; if 'timing' is
+// set, a breakdown of where the time went is written to it
+int parse_vhdl_2008(std::filesystem::path hdl_file_path,
+                    std::ostream *timing = nullptr,
+                    const Vhdl2008Options &options = {});
+
+// Parse several files on up to 'jobs' threads, all sharing the one compiled
+// grammar. Output comes out in the order the files are listed, as if they
+// had been parsed one at a time, except that each AST starts with a
+// "==> path <==" line and each syntax error with the file name. A file that
+// is next in that order when its parse starts is written as it's parsed,
+// streamed if 'options' says so; the output of the others is held in memory
+// until their turn. If
+// 'options.threads' is above 1, the files big enough to split are parsed
+// first, one at a time on that many threads, and the rest without
+// splitting, so no more than 'jobs' or 'options.threads' threads run at once.
+int parse_vhdl_2008(const std::vector<std::filesystem::path> &hdl_file_paths,
+                    unsigned jobs, std::ostream *timing = nullptr,
+                    const Vhdl2008Options &options = {});
@@ -0,0 +1,621 @@
+//
+//  peg_generated.hpp
+//
+//  Runtime support for parsers generated by peg2cpp
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ast_stream.hpp"
+#include "compact_ast.hpp"
+#include "peglib.h"
+
+// A generated parser is a set of plain functions, one per grammar rule, that
+// follow the same matching rules as the peglib interpreter with packrat
+// parsing and AST generation turned on. Only the state they share lives here.
+//
+// Instead of a SemanticValues scope per operator, child nodes and tokens are
+// kept on two stacks in the context. Operators that can discard a partial
+// match (choices, repetitions and predicates) remember the stack heights and
+// cut the stacks back on failure; a rule turns everything above its marks
+// into one node.
+//
+// Nodes are plain records appended to one array, and the stacks and the
+// packrat cache hold their indices. Backtracking leaves discarded nodes
+// behind, so once the parse succeeds, finish() copies the tree that was
+// kept out into a CompactAst.
+//
+// Alternatively the tree can be sent to an AstSink as it's matched. Each
+// time a commit rule matches, its node can't be backtracked over any more,
+// and nor can the rules it's nested in, so the context sends enter events
+// for those rules, their children so far and the new node. Those nodes are
+// then only needed by the packrat cache, if at all, so every so often the
+// nodes still in use are copied to a fresh array and the rest dropped. The
+// rules around the commit rule are only left once the whole parse has
+// matched, so a parse that fails never sends a tree that looks complete.
+
+namespace peg {
+namespace generated {
+
+constexpr size_t FAIL = static_cast<size_t>(-1);
+constexpr size_t NO_MEMO = static_cast<size_t>(-1);
+constexpr size_t NO_KEYWORD = static_cast<size_t>(-1);
+
+struct Rule {
+  const char *name;
+  bool is_token;    // The rule's node holds a token rather than children
+  bool ignore;      // '~rule': matched, but never added to the AST
+  bool keep_choice; // The rule's body is a choice, so record which one matched
+  size_t memo;      // Index into the packrat tables, or NO_MEMO
+  bool commit;      // Never backtracked over once matched (Definition::commit)
+};
+
+// Where the tokens are, found by scanning the input before parsing it: two
+// sorted arrays of offsets, the last entry an empty token at the end of the
+// input. Everything in front of a token, back to the end of the one before
+// (or to the start of the input), is what %whitespace matches there.
+struct TokenSpans {
+  const uint32_t *begins = nullptr;
+  const uint32_t *ends = nullptr;
+  size_t count = 0;
+};
+
+// A node as a Context builds it: its children are a run of the context's
+// child ids
+struct BuiltNode {
+  uint32_t rule;
+  uint32_t position;
+  uint32_t length;
+  uint32_t token;
+  uint32_t token_length;
+  uint32_t children;
+  uint32_t child_count;
+  uint16_t choice_count;
+  uint16_t choice;
+};
+
+// Matches of one rule, found ahead of the main parse by another Context
+// (usually on another thread), along with the nodes they built. Whatever
+// part of the input they came from, a rule matches the same way at the same
+// place, so the main parse can take them as they are.
+struct Prematched {
+  struct Match {
+    uint32_t position;
+    uint32_t length;
+    uint32_t node;
+  };
+
+  size_t rule = 0;
+  std::vector<Match> matches;
+  std::vector<BuiltNode> nodes;
+  std::vector<uint32_t> child_ids;
+};
+
+class Context {
+public:
+  // 'rules' is the parser's rule table, which every Rule passed in must
+  // come from
+  Context(const char *s, size_t l, const char *path, const Rule *rules,
+          size_t memo_count, const TokenSpans &spans = {})
+      : s(s), l(l), path(path), spans(spans), rules_(rules),
+        memo_count_(memo_count), cache_flags_(memo_count, l) {}
+
+  const char *const s;
+  const size_t l;
+  const char *const path;
+  const TokenSpans spans;
+
+  std::vector<uint32_t> nodes;
+  std::vector<std::string_view> tokens;
+
+  // Which alternative the last top-level choice of a rule took
+  size_t choice_count = 0;
+  size_t choice = 0;
+
+  size_t in_token_boundary_count = 0;
+  bool in_whitespace = false;
+
+  // The keyword found by the last word scan, and where; every keyword rule
+  // tried at the same place shares the one scan
+  const char *keyword_pos = nullptr;
+  size_t keyword = NO_KEYWORD;
+
+  void truncate(size_t node_mark, size_t token_mark) {
+    if (node_mark < sent_) {
+      broken_ = true;
+      sent_ = node_mark;
+    }
+    nodes.resize(node_mark);
+    tokens.resize(token_mark);
+  }
+
+  // The length of the whitespace at 's' if the scan ended a token there (or
+  // 's' is the start), otherwise FAIL and it has to be matched
+  size_t known_whitespace(const char *s) {
+    auto pos = static_cast<uint32_t>(s - this->s);
+    if (pos == 0) { return spans.begins[0]; }
+
+    // The parser mostly moves forward a token at a time, so look next to
+    // the last hit before searching
+    auto i = span_cursor_;
+    if (spans.ends[i] != pos) {
+      if (i + 1 < spans.count && spans.ends[i + 1] == pos) {
+        i++;
+      } else {
+        auto end = spans.ends + spans.count;
+        auto it = std::lower_bound(spans.ends, end, pos);
+        if (it == end || *it != pos) { return FAIL; }
+        i = static_cast<size_t>(it - spans.ends);
+      }
+    }
+    span_cursor_ = i;
+    return i + 1 < spans.count ? spans.begins[i + 1] - pos : 0;
+  }
+
+  // Send the tree to 'sink' instead of keeping it for finish(CompactAst&);
+  // events name nodes after the first 'rule_count' rules
+  void stream_to(AstSink *sink, size_t rule_count) {
+    sink_ = sink;
+    names_.clear();
+    for (size_t id = 0; id < rule_count; id++) {
+      names_.emplace_back(rules_[id].name);
+    }
+  }
+
+  // Once the parse has matched, send whatever of the tree hasn't been sent
+  // to the sink yet. Returns false if a node that was sent has since been
+  // backtracked over, which a commit rule should never allow.
+  bool finish() {
+    if (broken_) { return false; }
+    send_leaves();
+    if (!nodes.empty()) { send_nodes(0, 1); }
+    return true;
+  }
+
+  // Copy the tree under the first node on the stack into 'tree', naming
+  // its nodes after the first 'rule_count' rules
+  void finish(CompactAst &tree, size_t rule_count) const {
+    tree.reset(s, l, path);
+    for (size_t id = 0; id < rule_count; id++) {
+      tree.add_rule(rules_[id].name, rules_[id].is_token);
+    }
+    if (!nodes.empty()) { copy(nodes.front(), CompactAst::NO_NODE, tree); }
+  }
+
+  // Run 'body' as 'rule' at 's', with packrat memoisation if the rule has a
+  // memo slot, and push the rule's node on success
+  template <typename Body>
+  size_t rule(const Rule &rule, const char *s, size_t n, Body body) {
+    auto len = FAIL;
+    if (!prematched_.empty() &&
+        static_cast<size_t>(&rule - rules_) == prematched_rule_) {
+      len = reuse(s);
+    }
+    if (fail(len)) {
+      len = rule.memo == NO_MEMO ? run(rule, s, n, body)
+                                 : memoised(rule, s, n, body);
+    }
+    if (rule.commit && success(len)) {
+      commit(s + len);
+      if (sink_ && !rule.ignore) { send_committed(); }
+    }
+    return len;
+  }
+
+  // Match 'rule' with 'match' again and again from offset 'begin', until a
+  // match reaches 'end' or one fails, and move the results into 'out'
+  template <typename Match>
+  void prematch(const Rule &rule, size_t begin, size_t end, Prematched &out,
+                Match match) {
+    out.rule = static_cast<size_t>(&rule - rules_);
+    for (auto pos = begin; pos < end;) {
+      auto len = match(s + pos, l - pos);
+      if (fail(len) || len == 0 || rule.ignore) { break; }
+      out.matches.push_back({static_cast<uint32_t>(pos),
+                             static_cast<uint32_t>(len), nodes.back()});
+      truncate(0, 0);
+      pos += len;
+    }
+    out.nodes = std::move(built_);
+    out.child_ids = std::move(child_ids_);
+  }
+
+  // Take the matches in 'parts' instead of running their rule at those
+  // places; 'parts' is emptied
+  void use_prematched(std::vector<Prematched> &parts) {
+    for (auto &part : parts) {
+      auto node_base = static_cast<uint32_t>(built_.size());
+      auto child_base = static_cast<uint32_t>(child_ids_.size());
+      for (auto node : part.nodes) {
+        node.children += child_base;
+        built_.push_back(node);
+      }
+      for (auto id : part.child_ids) {
+        child_ids_.push_back(id + node_base);
+      }
+      for (auto match : part.matches) {
+        match.node += node_base;
+        prematched_.push_back(match);
+      }
+      prematched_rule_ = part.rule;
+    }
+    parts.clear();
+
+    std::stable_sort(prematched_.begin(), prematched_.end(),
+                     [](const Prematched::Match &a, const Prematched::Match &b) {
+                       return a.position < b.position;
+                     });
+  }
+
+private:
+  template <typename Body>
+  size_t memoised(const Rule &rule, const char *s, size_t n, Body body) {
+    auto col = static_cast<size_t>(s - this->s);
+    auto idx = memo_count_ * col + rule.memo;
+
+    // A success whose value has gone missing is treated as a miss
+    bool succeeded;
+    if (cache_flags_.find(col, rule.memo, succeeded)) {
+      if (!succeeded) { return FAIL; }
+      auto len = FAIL;
+      if (auto id = cache_values_.find(idx, len)) {
+        if (!rule.ignore) { nodes.push_back(*id); }
+        return len;
+      }
+    }
+
+    auto len = run(rule, s, n, body);
+
+    if (col < cache_flags_.base()) { return len; }
+    cache_flags_.set(col, rule.memo, success(len));
+    if (success(len)) {
+      cache_values_.insert(idx, len,
+                           rule.ignore ? CompactAst::NO_NODE : nodes.back());
+    }
+    return len;
+  }
+
+  // Drop the packrat results for everything before 's'
+  void commit(const char *s) {
+    auto col = static_cast<size_t>(s - this->s);
+    if (col <= cache_flags_.base()) { return; }
+    cache_flags_.commit(col);
+    cache_values_.erase_below(memo_count_ * col);
+  }
+
+  template <typename Body>
+  size_t run(const Rule &rule, const char *s, size_t n, Body body) {
+    auto node_mark = nodes.size();
+    auto token_mark = tokens.size();
+
+    if (sink_) { frames_.push_back({&rule, s, node_mark}); }
+
+    auto len = body(s, n);
+
+    if (sink_) {
+      frames_.pop_back();
+      if (frames_.size() < entered_) {
+        entered_--;
+        if (fail(len)) {
+          broken_ = true;
+        } else {
+          return leave(rule, s, len, node_mark, token_mark);
+        }
+      }
+    }
+
+    if (fail(len)) {
+      truncate(node_mark, token_mark);
+      return len;
+    }
+
+    auto id = CompactAst::NO_NODE;
+    if (!rule.ignore) {
+      size_t cc = 0;
+      size_t ch = 0;
+      if (rule.keep_choice) {
+        cc = choice_count;
+        ch = choice;
+      }
+      id = make_node(rule, s, len, node_mark, token_mark, cc, ch);
+    }
+    truncate(node_mark, token_mark);
+
+    if (!rule.ignore) { nodes.push_back(id); }
+    return len;
+  }
+
+  size_t reuse(const char *s) {
+    auto pos = static_cast<uint32_t>(s - this->s);
+    auto it = std::lower_bound(
+        prematched_.begin(), prematched_.end(), pos,
+        [](const Prematched::Match &m, uint32_t pos) { return m.position < pos; });
+    if (it == prematched_.end() || it->position != pos) { return FAIL; }
+    nodes.push_back(it->node);
+    return it->length;
+  }
+
+  uint32_t make_node(const Rule &rule, const char *s, size_t len,
+                     size_t node_mark, size_t token_mark, size_t cc,
+                     size_t ch) {
+    BuiltNode node{};
+    node.rule = static_cast<uint32_t>(&rule - rules_);
+    node.position = static_cast<uint32_t>(s - this->s);
+    node.length = static_cast<uint32_t>(len);
+    node.choice_count = static_cast<uint16_t>(cc);
+    node.choice = static_cast<uint16_t>(ch);
+
+    if (rule.is_token) {
+      auto token = tokens.size() > token_mark ? tokens[token_mark]
+                                              : std::string_view(s, len);
+      node.token = static_cast<uint32_t>(token.data() - this->s);
+      node.token_length = static_cast<uint32_t>(token.size());
+    } else {
+      node.children = static_cast<uint32_t>(child_ids_.size());
+      node.child_count = static_cast<uint32_t>(nodes.size() - node_mark);
+      child_ids_.insert(child_ids_.end(), nodes.begin() + node_mark,
+                        nodes.end());
+    }
+
+    built_.push_back(node);
+    return static_cast<uint32_t>(built_.size() - 1);
+  }
+
+  void copy(uint32_t id, uint32_t parent, CompactAst &tree) const {
+    auto &node = built_[id];
+    auto to = tree.add({node.rule, parent, 0, node.position, node.length,
+                        node.token, node.token_length, node.choice_count,
+                        node.choice});
+    for (uint32_t k = 0; k < node.child_count; k++) {
+      copy(child_ids_[node.children + k], to, tree);
+    }
+    tree.close(to);
+  }
+
+  // Streaming
+
+  // A rule being matched, and where its children start on the node stack
+  struct Frame {
+    const Rule *rule;
+    const char *s;
+    size_t node_mark;
+  };
+
+  // Stands in for a node on the stack that has already been sent
+  static constexpr uint32_t SENT = CompactAst::NO_NODE - 1;
+
+  AstEvent event(const BuiltNode &node) const {
+    return AstEvent{node.rule,
+                    names_[node.rule],
+                    node.position,
+                    node.length,
+                    std::string_view(s + node.token, node.token_length),
+                    node.choice_count,
+                    node.choice};
+  }
+
+  void send(uint32_t id) {
+    auto &node = built_[id];
+    if (rules_[node.rule].is_token) {
+      sink_->token(event(node));
+      return;
+    }
+    sink_->enter(event(node));
+    for (uint32_t k = 0; k < node.child_count; k++) {
+      send(child_ids_[node.children + k]);
+    }
+    sink_->leave(event(node));
+  }
+
+  // Send the nodes at [begin, end) on the stack that haven't been sent
+  void send_nodes(size_t begin, size_t end) {
+    send_leaves();
+    for (auto i = std::max(begin, sent_); i < end; i++) {
+      if (nodes[i] != SENT) { send(nodes[i]); }
+      nodes[i] = SENT;
+    }
+    sent_ = std::max(sent_, end);
+  }
+
+  // A commit rule has just pushed its node: send it, along with the rules
+  // it's nested in and what they've matched before it
+  void send_committed() {
+    // An enter event has to say which alternative the rule took, and its
+    // node has to end up in the tree
+    for (auto &frame : frames_) {
+      auto &rule = *frame.rule;
+      if (rule.ignore || rule.is_token || rule.keep_choice) { return; }
+    }
+
+    send_leaves();
+    for (size_t i = 0; i < frames_.size(); i++) {
+      auto &frame = frames_[i];
+      if (i >= entered_) {
+        sink_->enter(AstEvent{
+            static_cast<uint32_t>(frame.rule - rules_),
+            names_[frame.rule - rules_],
+            static_cast<uint32_t>(frame.s - s), 0, {}, 0, 0});
+        entered_ = i + 1;
+      }
+      send_nodes(frame.node_mark,
+                 i + 1 < frames_.size() ? frames_[i + 1].node_mark : 0);
+    }
+    send_nodes(0, nodes.size());
+
+    if (prematched_.empty() && built_.size() >= collect_at_) { collect(); }
+  }
+
+  // A rule that was entered has matched: send the rest of its children, and
+  // leave it once something else is sent, leaving a sent node on the stack
+  // in its place
+  size_t leave(const Rule &rule, const char *s, size_t len, size_t node_mark,
+               size_t token_mark) {
+    send_nodes(node_mark, nodes.size());
+    auto id = static_cast<uint32_t>(&rule - rules_);
+    leaves_.push_back(AstEvent{id, names_[id],
+                               static_cast<uint32_t>(s - this->s),
+                               static_cast<uint32_t>(len), {}, 0, 0});
+    sent_ = node_mark;
+    truncate(node_mark, token_mark);
+    nodes.push_back(SENT);
+    sent_ = nodes.size();
+    return len;
+  }
+
+  // Send the leave events held back by leave(). Until then the rule that
+  // holds it could still fail, and with it the parse.
+  void send_leaves() {
+    for (auto &event : leaves_) { sink_->leave(event); }
+    leaves_.clear();
+  }
+
+  // Copy the nodes that can still be reached, from the stack or the packrat
+  // cache, to new arrays, and drop the rest
+  void collect() {
+    std::vector<uint32_t> moved(built_.size(), CompactAst::NO_NODE);
+    std::vector<BuiltNode> built;
+    std::vector<uint32_t> child_ids;
+    for (auto &id : nodes) {
+      if (id != SENT) { id = keep(id, moved, built, child_ids); }
+    }
+    cache_values_.for_each_value([&](uint32_t &id) {
+      if (id < SENT) { id = keep(id, moved, built, child_ids); }
+    });
+    built_.swap(built);
+    child_ids_.swap(child_ids);
+    collect_at_ = std::max(collect_threshold, 2 * built_.size());
+  }
+
+  uint32_t keep(uint32_t id, std::vector<uint32_t> &moved,
+                std::vector<BuiltNode> &built,
+                std::vector<uint32_t> &child_ids) const {
+    if (moved[id] != CompactAst::NO_NODE) { return moved[id]; }
+    auto node = built_[id];
+    if (!rules_[node.rule].is_token) {
+      std::vector<uint32_t> children;
+      for (uint32_t k = 0; k < node.child_count; k++) {
+        children.push_back(
+            keep(child_ids_[node.children + k], moved, built, child_ids));
+      }
+      node.children = static_cast<uint32_t>(child_ids.size());
+      child_ids.insert(child_ids.end(), children.begin(), children.end());
+    }
+    built.push_back(node);
+    return moved[id] = static_cast<uint32_t>(built.size() - 1);
+  }
+
+  static constexpr size_t collect_threshold = 1 << 16;
+
+  AstSink *sink_ = nullptr;
+  std::vector<std::string_view> names_;
+  std::vector<Frame> frames_;
+  size_t entered_ = 0; // Frames whose enter event has been sent
+  std::vector<AstEvent> leaves_; // ...and whose leave event hasn't yet
+  size_t sent_ = 0;    // Nodes on the stack below this have been sent
+  bool broken_ = false;
+  size_t collect_at_ = collect_threshold;
+
+  size_t span_cursor_ = 0;
+  const Rule *const rules_;
+  const size_t memo_count_;
+  MemoFlags cache_flags_;
+  MemoTable<uint32_t> cache_values_;
+  std::vector<BuiltNode> built_;
+  std::vector<uint32_t> child_ids_;
+  std::vector<Prematched::Match> prematched_;
+  size_t prematched_rule_ = 0;
+};
+
+// Same case folding as std::tolower() in the "C" locale
+inline char fold_case(char c) {
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+inline bool match_literal(const char *s, size_t n, const char *lit,
+                          size_t len) {
+  return n >= len && std::memcmp(s, lit, len) == 0;
+}
+
+// 'lit' must already be folded to lower case
+inline bool match_literal_i(const char *s, size_t n, const char *lit,
+                            size_t len) {
+  if (n < len) { return false; }
+  for (size_t i = 0; i < len; i++) {
+    if (fold_case(s[i]) != lit[i]) { return false; }
+  }
+  return true;
+}
+
+// FNV-1a over the case-folded word, for the keyword tables that peg2cpp
+// builds; it searches for a seed that gives every keyword its own slot
+inline uint32_t hash_keyword(const char *s, size_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+  for (size_t i = 0; i < len; i++) {
+    h ^= static_cast<unsigned char>(fold_case(s[i]));
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Decode the code point at 's' the way peglib's CharacterClass does,
+// including its treatment of truncated and invalid sequences
+inline size_t next_codepoint(const char *s, size_t n, char32_t &cp) {
+  auto b = static_cast<unsigned char>(s[0]);
+  if (b < 0x80) {
+    cp = b;
+    return 1;
+  }
+  cp = 0;
+  return decode_codepoint(s, n, cp);
+}
+
+// Read a list of rule names, one per line, where '#' starts a comment. Both
+// peg2cpp and the interpreter's set-up read the list of memoised rules this
+// way, so the two engines always memoise the same rules.
+inline std::set<std::string> read_rule_list(std::string_view text) {
+  std::set<std::string> names;
+  while (!text.empty()) {
+    auto eol = text.find('\n');
+    auto line = text.substr(0, eol);
+    text = eol == std::string_view::npos ? std::string_view()
+                                         : text.substr(eol + 1);
+
+    line = line.substr(0, line.find('#'));
+    auto first = line.find_first_not_of(" \t\r");
+    if (first == std::string_view::npos) { continue; }
+    auto last = line.find_last_not_of(" \t\r");
+    names.emplace(line.substr(first, last - first + 1));
+  }
+  return names;
+}
+
+} // namespace generated
+} // namespace peg
@@ -17,12 +17,15 @@
 
 #include <algorithm>
 #include <any>
+#include <bitset>
 #include <cassert>
 #include <cctype>
+#include <cstdint>
 #if __has_include(<charconv>)
 #include <charconv>
 #endif
 #include <cstring>
+#include <deque>
 #include <functional>
 #include <initializer_list>
 #include <iostream>
@@ -378,74 +381,118 @@ template <typename T> T token_to_number_(std::string_view sv) {
 class Trie {
 public:
   Trie(const std::vector<std::string> &items, bool ignore_case)
-      : ignore_case_(ignore_case) {
+      : ignore_case_(ignore_case), items_count_(items.size()) {
+    // Build with a map of children per node...
+    struct Building {
+      std::map<unsigned char, size_t> next;
+      bool match = false;
+      size_t id = 0;
+    };
+    std::vector<Building> building(1);
+
     size_t id = 0;
     for (const auto &item : items) {
-      const auto &s = ignore_case ? to_lower(item) : item;
-      for (size_t len = 1; len <= item.size(); len++) {
-        auto last = len == item.size();
-        std::string_view sv(s.data(), len);
-        auto it = dic_.find(sv);
-        if (it == dic_.end()) {
-          dic_.emplace(sv, Info{last, last, id});
-        } else if (last) {
-          it->second.match = true;
+      size_t node = 0;
+      for (auto ch : item) {
+        auto key = fold(ch);
+        auto it = building[node].next.find(key);
+        if (it == building[node].next.end()) {
+          building[node].next.emplace(key, building.size());
+          node = building.size();
+          building.emplace_back();
         } else {
-          it->second.done = false;
+          node = it->second;
         }
       }
+      if (!building[node].match) {
+        building[node].match = true;
+        building[node].id = id;
+      }
       id++;
     }
-  }
 
-  size_t match(const char *text, size_t text_len, size_t &id) const {
-    std::string lower_text;
-    if (ignore_case_) {
-      lower_text = to_lower(text);
-      text = lower_text.data();
+    // ...then lay the nodes out breadth first, with each node's children
+    // next to each other in 'edges_', so that matching walks two flat arrays
+    std::vector<size_t> order{0};
+    std::vector<size_t> index(building.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      for (const auto &[key, child] : building[order[i]].next) {
+        index[child] = order.size();
+        order.push_back(child);
+      }
     }
 
-    size_t match_len = 0;
-    auto done = false;
-    size_t len = 1;
-    while (!done && len <= text_len) {
-      std::string_view sv(text, len);
-      auto it = dic_.find(sv);
-      if (it == dic_.end()) {
-        done = true;
-      } else {
-        if (it->second.match) {
-          match_len = len;
-          id = it->second.id;
-        }
-        if (it->second.done) { done = true; }
+    nodes_.resize(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      const auto &b = building[order[i]];
+      auto &node = nodes_[i];
+      node.first_edge = edges_.size();
+      node.edge_count = b.next.size();
+      node.match = b.match;
+      node.id = b.id;
+      for (const auto &[key, child] : b.next) {
+        edges_.push_back(Edge{key, index[child]});
       }
-      len += 1;
     }
-    return match_len;
   }
 
-  size_t size() const { return dic_.size(); }
+  // Longest item that 'text' starts with. Only looks at as many characters
+  // as the longest item has, and never allocates.
+  size_t match(const char *text, size_t text_len, size_t &id) const {
+    size_t match_len = 0;
+    size_t node = 0;
+    for (size_t len = 0; len < text_len; len++) {
+      auto key = ignore_case_ ? fold(text[len])
+                              : static_cast<unsigned char>(text[len]);
+      const auto &cur = nodes_[node];
+      auto edge = edges_.begin() + static_cast<std::ptrdiff_t>(cur.first_edge);
+      auto edge_end = edge + static_cast<std::ptrdiff_t>(cur.edge_count);
+      while (edge != edge_end && edge->key < key) {
+        ++edge;
+      }
+      if (edge == edge_end || edge->key != key) { break; }
 
-private:
-  std::string to_lower(std::string s) const {
-    for (char &c : s) {
-      c = std::tolower(c);
+      node = edge->node;
+      if (nodes_[node].match) {
+        match_len = len + 1;
+        id = nodes_[node].id;
+      }
     }
-    return s;
+    return match_len;
   }
 
-  struct Info {
-    bool done;
+  // The number of distinct prefixes of the items
+  size_t size() const { return nodes_.size() - 1; }
+
+  size_t items_count() const { return items_count_; }
+
+private:
+  // Same folding as std::tolower() in the "C" locale, but without the
+  // undefined behaviour for negative chars
+  unsigned char fold(char c) const {
+    auto uc = static_cast<unsigned char>(c);
+    return (ignore_case_ && uc >= 'A' && uc <= 'Z')
+               ? static_cast<unsigned char>(uc - 'A' + 'a')
+               : uc;
+  }
+
+  struct Node {
+    size_t first_edge;
+    size_t edge_count;
     bool match;
     size_t id;
   };
 
-  // TODO: Use unordered_map when heterogeneous lookup is supported in C++20
-  // std::unordered_map<std::string, Info> dic_;
-  std::map<std::string, Info, std::less<>> dic_;
+  struct Edge {
+    unsigned char key;
+    size_t node;
+  };
+
+  std::vector<Node> nodes_;
+  std::vector<Edge> edges_; // Sorted by key within each node
 
   bool ignore_case_;
+  size_t items_count_;
 };
 
 /*-----------------------------------------------------------------------------
@@ -499,6 +546,7 @@ inline constexpr unsigned int operator"" _(const char *s, size_t l) {
  * Semantic values
  */
 class Context;
+class Definition;
 
 struct SemanticValues : protected std::vector<std::any> {
   SemanticValues() = default;
@@ -556,6 +604,8 @@ struct SemanticValues : protected std::vector<std::any> {
   }
 
   void append(SemanticValues &chvs) {
+    // The nodes 'chvs' matched are already on the node stack, after ours
+    chvs.node_mark_ = static_cast<size_t>(-1);
     sv_ = chvs.sv_;
     for (auto &v : chvs) {
       emplace_back(std::move(v));
@@ -605,6 +655,46 @@ private:
   size_t choice_count_ = 0;
   size_t choice_ = 0;
   std::string name_;
+  size_t node_mark_ = 0; // Where this scope's nodes start on the node stack
+};
+
+/*
+ * Typed AST nodes
+ */
+
+// The tree that enable_ast() builds, as plain nodes in a few arrays rather
+// than an Ast per node passed up through std::any (see
+// Definition::parse_ast()). A rule's children are the nodes matched since it
+// started that are still on 'stack'; once it matches they're moved to
+// 'children' and the rule's own node takes their place. Nodes matched by an
+// attempt that fails are left behind in 'nodes', where the packrat cache may
+// still refer to them, but are never reached from the root.
+struct AstNodes {
+  static constexpr uint32_t NO_NODE = static_cast<uint32_t>(-1);
+
+  struct Node {
+    const Definition *rule;
+    uint32_t position; // Offsets into the parsed text
+    uint32_t length;
+    uint32_t token;    // For token rules, which have no children
+    uint32_t token_length;
+    uint16_t choice_count;
+    uint16_t choice;
+    uint32_t children; // The first of the node's children in 'children'
+    uint32_t child_count;
+  };
+
+  std::vector<Node> nodes;
+  std::vector<uint32_t> children;
+  std::vector<uint32_t> stack;
+  uint32_t root = NO_NODE;
+
+  void clear() {
+    nodes.clear();
+    children.clear();
+    stack.clear();
+    root = NO_NODE;
+  }
 };
 
 /*
@@ -679,8 +769,6 @@ using Log = std::function<void(size_t line, size_t col, const std::string &msg,
 /*
  * ErrorInfo
  */
-class Definition;
-
 struct ErrorInfo {
   const char *error_pos = nullptr;
   std::vector<std::pair<const char *, const Definition *>> expected_tokens;
@@ -745,6 +833,182 @@ private:
   }
 };
 
+/*
+ * Memo table
+ */
+
+// Successful packrat results, keyed by 'memo_count * column + memo_id'.
+// Open addressing with linear probing keeps every entry in one flat array,
+// so a lookup is a multiply, a shift and (usually) one cache line, and an
+// insert never allocates unless the table has to grow.
+template <typename T> class MemoTable {
+public:
+  void reserve(size_t count) {
+    auto capacity = capacity_for(count);
+    if (capacity > slots_.size()) { rehash(capacity); }
+  }
+
+  const T *find(size_t key, size_t &len) const {
+    if (slots_.empty()) { return nullptr; }
+    for (auto i = home(key);; i = (i + 1) & mask_) {
+      const auto &slot = slots_[i];
+      if (slot.key == key) {
+        len = slot.len;
+        return &slot.val;
+      }
+      if (slot.key == empty_key) { return nullptr; }
+    }
+  }
+
+  void insert(size_t key, size_t len, T val) {
+    if ((size_ + 1) * 2 > slots_.size()) {
+      rehash(slots_.empty() ? 16 : slots_.size() * 2);
+    }
+    auto i = home(key);
+    while (slots_[i].key != empty_key && slots_[i].key != key) {
+      i = (i + 1) & mask_;
+    }
+    auto &slot = slots_[i];
+    if (slot.key == empty_key) { size_++; }
+    slot.key = key;
+    slot.len = len;
+    slot.val = std::move(val);
+  }
+
+  // Drop every entry with a key below 'key', and shrink the table to suit
+  // what's left
+  void erase_below(size_t key) {
+    size_t live = 0;
+    for (const auto &slot : slots_) {
+      if (slot.key != empty_key && slot.key >= key) { live++; }
+    }
+    if (live == 0) {
+      slots_.clear();
+      slots_.shrink_to_fit();
+      size_ = 0;
+      return;
+    }
+    rehash(capacity_for(live), key);
+  }
+
+  size_t size() const { return size_; }
+
+  // Call 'f' on every value, which it may change
+  template <typename F> void for_each_value(F f) {
+    for (auto &slot : slots_) {
+      if (slot.key != empty_key) { f(slot.val); }
+    }
+  }
+
+private:
+  static constexpr size_t empty_key = static_cast<size_t>(-1);
+
+  static size_t capacity_for(size_t count) {
+    size_t capacity = 16;
+    while (capacity / 2 < count) {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+
+  struct Slot {
+    size_t key = empty_key;
+    size_t len = 0;
+    T val{};
+  };
+
+  size_t home(size_t key) const {
+    // Fibonacci hashing spreads the consecutive keys of one column
+    return static_cast<size_t>((static_cast<uint64_t>(key) *
+                                0x9E3779B97F4A7C15ull) >>
+                               shift_) &
+           mask_;
+  }
+
+  void rehash(size_t capacity, size_t min_key = 0) {
+    std::vector<Slot> old(capacity);
+    old.swap(slots_);
+    mask_ = capacity - 1;
+    shift_ = 64;
+    for (auto c = capacity; c > 1; c >>= 1) {
+      shift_--;
+    }
+    size_ = 0;
+    for (auto &slot : old) {
+      if (slot.key != empty_key && slot.key >= min_key) {
+        insert(slot.key, slot.len, std::move(slot.val));
+      }
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t mask_ = 0;
+  unsigned shift_ = 64;
+  size_t size_ = 0;
+};
+
+// The packrat 'tried' and 'succeeded' bits, two per (column, memo_id).
+// Storage is allocated a block of columns at a time as the parse reaches
+// them, and blocks wholly behind the last commit are freed again, so a
+// parse that commits regularly only holds bits for the current window.
+class MemoFlags {
+public:
+  MemoFlags() = default;
+  MemoFlags(size_t memo_count, size_t l)
+      : memo_count_(memo_count),
+        blocks_(memo_count ? l / block_columns + 1 : 0) {}
+
+  // Returns false if nothing was recorded for 'memo_id' at 'col'; otherwise
+  // sets 'succeeded'
+  bool find(size_t col, size_t memo_id, bool &succeeded) const {
+    if (col < base_) { return false; }
+    const auto &block = blocks_[col / block_columns];
+    if (!block) { return false; }
+    auto bit = bit_index(col, memo_id);
+    auto bits = block[bit / 64] >> (bit % 64);
+    if (!(bits & 1)) { return false; }
+    succeeded = (bits & 2) != 0;
+    return true;
+  }
+
+  // Record a result; results behind the last commit are not kept
+  void set(size_t col, size_t memo_id, bool succeeded) {
+    if (col < base_) { return; }
+    auto &block = blocks_[col / block_columns];
+    if (!block) {
+      block.reset(new uint64_t[block_words()]());
+    }
+    auto bit = bit_index(col, memo_id);
+    block[bit / 64] |= (succeeded ? uint64_t(3) : uint64_t(1)) << (bit % 64);
+  }
+
+  // Nothing before 'col' will be looked up again
+  void commit(size_t col) {
+    if (col <= base_) { return; }
+    for (auto b = base_ / block_columns; b < col / block_columns; b++) {
+      blocks_[b].reset();
+    }
+    base_ = col;
+  }
+
+  size_t base() const { return base_; }
+
+private:
+  static constexpr size_t block_columns = 4096;
+
+  size_t bit_index(size_t col, size_t memo_id) const {
+    return ((col % block_columns) * memo_count_ + memo_id) * 2;
+  }
+
+  size_t block_words() const {
+    return (block_columns * memo_count_ * 2 + 63) / 64;
+  }
+
+  size_t memo_count_ = 0;
+  size_t base_ = 0;
+  std::vector<std::unique_ptr<uint64_t[]>> blocks_;
+};
+
 /*
  * Context
  */
@@ -760,6 +1024,10 @@ using TracerLeave = std::function<void(
 
 using TracerStartOrEnd = std::function<void(std::any &trace_data)>;
 
+// Matches what a grammar's %whitespace rule does at 's', natively, and
+// returns the length (see parser::set_whitespace_skipper())
+using WhitespaceSkipper = std::function<size_t(const char *s, size_t n)>;
+
 class Context {
 public:
   const char *path;
@@ -769,7 +1037,10 @@ public:
   ErrorInfo error_info;
   bool recovered = false;
 
-  std::vector<std::shared_ptr<SemanticValues>> value_stack;
+  // One frame per level of nesting, made the first time the parse goes that
+  // deep and reset in place every time after; a deque, so that frames in use
+  // stay put as it grows
+  std::deque<SemanticValues> value_stack;
   size_t value_stack_size = 0;
 
   std::vector<Definition *> rule_stack;
@@ -778,22 +1049,35 @@ public:
   size_t in_token_boundary_count = 0;
 
   std::shared_ptr<Ope> whitespaceOpe;
+  WhitespaceSkipper whitespace_skipper;
   bool in_whitespace = false;
 
   std::shared_ptr<Ope> wordOpe;
 
+  // Pooled like the value stack, and not used at all if the grammar has no
+  // captures or back references
   std::vector<std::map<std::string_view, std::string>> capture_scope_stack;
   size_t capture_scope_stack_size = 0;
+  const bool has_captures;
 
   std::vector<bool> cut_stack;
 
-  const size_t def_count;
+  // Skip the alternatives of a choice that can't start with the next byte
+  // (see parser::enable_first_char_dispatch()), and count the alternatives
+  // tried and skipped either way
+  bool first_char_dispatch = false;
+  size_t tried_alternatives = 0;
+  size_t skipped_alternatives = 0;
+
+  // Set when building typed nodes rather than semantic values
+  AstNodes *ast_nodes = nullptr;
+
+  const size_t memo_count;
   const bool enablePackratParsing;
-  std::vector<bool> cache_registered;
-  std::vector<bool> cache_success;
+  MemoFlags cache_flags;
 
-  std::map<std::pair<size_t, size_t>, std::tuple<size_t, std::any>>
-      cache_values;
+  MemoTable<std::any> cache_values;
+  MemoTable<uint32_t> cache_nodes;
 
   TracerEnter tracer_enter;
   TracerLeave tracer_leave;
@@ -802,15 +1086,14 @@ public:
 
   Log log;
 
-  Context(const char *path, const char *s, size_t l, size_t def_count,
+  Context(const char *path, const char *s, size_t l, size_t memo_count,
           std::shared_ptr<Ope> whitespaceOpe, std::shared_ptr<Ope> wordOpe,
           bool enablePackratParsing, TracerEnter tracer_enter,
           TracerLeave tracer_leave, std::any trace_data, bool verbose_trace,
-          Log log)
+          Log log, bool has_captures = true)
       : path(path), s(s), l(l), whitespaceOpe(whitespaceOpe), wordOpe(wordOpe),
-        def_count(def_count), enablePackratParsing(enablePackratParsing),
-        cache_registered(enablePackratParsing ? def_count * (l + 1) : 0),
-        cache_success(enablePackratParsing ? def_count * (l + 1) : 0),
+        has_captures(has_captures), memo_count(memo_count), enablePackratParsing(enablePackratParsing),
+        cache_flags(enablePackratParsing ? memo_count : 0, l),
         tracer_enter(tracer_enter), tracer_leave(tracer_leave),
         trace_data(trace_data), verbose_trace(verbose_trace), log(log) {
 
@@ -831,35 +1114,57 @@ public:
   Context operator=(const Context &) = delete;
 
   template <typename T>
-  void packrat(const char *a_s, size_t def_id, size_t &len, std::any &val,
+  void packrat(const char *a_s, size_t memo_id, size_t &len, std::any &val,
+               T fn) {
+    packrat(a_s, memo_id, len, val, cache_values, fn);
+  }
+
+  template <typename T>
+  void packrat(const char *a_s, size_t memo_id, size_t &len, uint32_t &node,
                T fn) {
+    packrat(a_s, memo_id, len, node, cache_nodes, fn);
+  }
+
+  template <typename V, typename T>
+  void packrat(const char *a_s, size_t memo_id, size_t &len, V &val,
+               MemoTable<V> &values, T fn) {
     if (!enablePackratParsing) {
       fn(val);
       return;
     }
 
-    auto col = a_s - s;
-    auto idx = def_count * static_cast<size_t>(col) + def_id;
+    auto col = static_cast<size_t>(a_s - s);
+    auto idx = memo_count * col + memo_id;
 
-    if (cache_registered[idx]) {
-      if (cache_success[idx]) {
-        auto key = std::pair(col, def_id);
-        std::tie(len, val) = cache_values[key];
-        return;
-      } else {
+    // A success whose value has gone missing is treated as a miss and
+    // matched again
+    bool succeeded;
+    if (cache_flags.find(col, memo_id, succeeded)) {
+      if (!succeeded) {
         len = static_cast<size_t>(-1);
         return;
       }
-    } else {
-      fn(val);
-      cache_registered[idx] = true;
-      cache_success[idx] = success(len);
-      if (success(len)) {
-        auto key = std::pair(col, def_id);
-        cache_values[key] = std::pair(len, val);
+      if (auto cached = values.find(idx, len)) {
+        val = *cached;
+        return;
       }
-      return;
     }
+
+    fn(val);
+    if (col < cache_flags.base()) { return; }
+    cache_flags.set(col, memo_id, success(len));
+    if (success(len)) { values.insert(idx, len, val); }
+  }
+
+  // The parse will never go back before 'a_s', so drop the packrat results
+  // for everything before it
+  void commit_packrat(const char *a_s) {
+    if (!enablePackratParsing) { return; }
+    auto col = static_cast<size_t>(a_s - s);
+    if (col <= cache_flags.base()) { return; }
+    cache_flags.commit(col);
+    cache_values.erase_below(memo_count * col);
+    cache_nodes.erase_below(memo_count * col);
   }
 
   SemanticValues &push() {
@@ -876,9 +1181,9 @@ public:
   SemanticValues &push_semantic_values_scope() {
     assert(value_stack_size <= value_stack.size());
     if (value_stack_size == value_stack.size()) {
-      value_stack.emplace_back(std::make_shared<SemanticValues>(this));
+      value_stack.emplace_back(this);
     } else {
-      auto &vs = *value_stack[value_stack_size];
+      auto &vs = value_stack[value_stack_size];
       if (!vs.empty()) {
         vs.clear();
         if (!vs.tags.empty()) { vs.tags.clear(); }
@@ -889,13 +1194,21 @@ public:
       if (!vs.tokens.empty()) { vs.tokens.clear(); }
     }
 
-    auto &vs = *value_stack[value_stack_size++];
+    auto &vs = value_stack[value_stack_size++];
     vs.path = path;
     vs.ss = s;
+    if (ast_nodes) { vs.node_mark_ = ast_nodes->stack.size(); }
     return vs;
   }
 
-  void pop_semantic_values_scope() { value_stack_size--; }
+  // Nodes matched in a scope that's dropped rather than appended to its
+  // parent are dropped with it
+  void pop_semantic_values_scope() {
+    auto &vs = value_stack[--value_stack_size];
+    if (ast_nodes && vs.node_mark_ < ast_nodes->stack.size()) {
+      ast_nodes->stack.resize(vs.node_mark_);
+    }
+  }
 
   // Arguments
   void push_args(std::vector<std::shared_ptr<Ope>> &&args) {
@@ -910,6 +1223,7 @@ public:
 
   // Capture scope
   void push_capture_scope() {
+    if (!has_captures) { return; }
     assert(capture_scope_stack_size <= capture_scope_stack.size());
     if (capture_scope_stack_size == capture_scope_stack.size()) {
       capture_scope_stack.emplace_back(
@@ -921,9 +1235,12 @@ public:
     capture_scope_stack_size++;
   }
 
-  void pop_capture_scope() { capture_scope_stack_size--; }
+  void pop_capture_scope() {
+    if (has_captures) { capture_scope_stack_size--; }
+  }
 
   void shift_capture_values() {
+    if (!has_captures) { return; }
     assert(capture_scope_stack_size >= 2);
     auto curr = &capture_scope_stack[capture_scope_stack_size - 1];
     auto prev = curr - 1;
@@ -932,6 +1249,12 @@ public:
     }
   }
 
+  // Whitespace, with the grammar's native skipper if it has one. Only the
+  // operators say what they expected when they fail, so they still run
+  // while errors are being logged.
+  size_t skip_whitespace(const char *a_s, size_t n, SemanticValues &vs,
+                         std::any &dt);
+
   // Error
   void set_error_pos(const char *a_s, const char *literal = nullptr);
 
@@ -1030,8 +1353,23 @@ public:
       if (!for_label_) { c.cut_stack.pop_back(); }
     });
 
+    // The alternatives that can start with the next byte, or match at the
+    // end of the input
+    const uint64_t *can_match = nullptr;
+    if (c.first_char_dispatch && !dispatch_.empty()) {
+      auto key = n > 0 ? static_cast<unsigned char>(*s) : 256u;
+      can_match = &dispatch_[key * ((opes_.size() + 63) / 64)];
+    }
+
     size_t id = 0;
     for (const auto &ope : opes_) {
+      if (can_match && !((can_match[id / 64] >> (id % 64)) & 1)) {
+        c.skipped_alternatives++;
+        id++;
+        continue;
+      }
+      c.tried_alternatives++;
+
       if (!c.cut_stack.empty()) { c.cut_stack.back() = false; }
 
       auto &chvs = c.push();
@@ -1065,6 +1403,11 @@ public:
 
   std::vector<std::shared_ptr<Ope>> opes_;
   bool for_label_ = false;
+
+  // Filled in by parser::enable_first_char_dispatch(), unless no alternative
+  // could ever be skipped: for each byte value, and then for the end of the
+  // input, a bit per alternative that might match there
+  std::vector<uint64_t> dispatch_;
 };
 
 class Repetition : public Ope {
@@ -1272,6 +1615,10 @@ public:
 
   void accept(Visitor &v) override;
 
+  std::vector<std::pair<char32_t, char32_t>> ranges_;
+  bool negated_;
+  bool ignore_case_;
+
 private:
   bool in_range(const std::pair<char32_t, char32_t> &range, char32_t cp) const {
     if (ignore_case_) {
@@ -1282,10 +1629,6 @@ private:
       return range.first <= cp && cp <= range.second;
     }
   }
-
-  std::vector<std::pair<char32_t, char32_t>> ranges_;
-  bool negated_;
-  bool ignore_case_;
 };
 
 class Character : public Ope, public std::enable_shared_from_this<Character> {
@@ -1437,6 +1780,7 @@ public:
   void accept(Visitor &v) override;
 
   std::any reduce(SemanticValues &vs, std::any &dt) const;
+  uint32_t reduce_node(SemanticValues &vs, Context &c) const;
 
   const std::string &name() const;
   const std::string &trace_name() const;
@@ -1447,6 +1791,12 @@ public:
   mutable std::string trace_name_;
 
   friend class Definition;
+
+private:
+  // A rule's value is a semantic value (std::any) or a typed node (uint32_t)
+  template <typename V>
+  size_t parse_rule(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt) const;
 };
 
 using Grammar = std::unordered_map<std::string, Definition>;
@@ -1518,6 +1868,9 @@ public:
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override {
+    if (c.ast_nodes) {
+      throw std::logic_error("Precedence climbing can't build typed nodes...");
+    }
     return parse_expression(s, n, vs, c, dt, 0);
   }
 
@@ -1773,18 +2126,27 @@ struct AssignIDToDefinition : public Ope::Visitor {
   void visit(Repetition &ope) override { ope.ope_->accept(*this); }
   void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
   void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
-  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
-  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override {
+    captures = true;
+    ope.ope_->accept(*this);
+  }
+  void visit(Capture &ope) override {
+    captures = true;
+    ope.ope_->accept(*this);
+  }
   void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
   void visit(Ignore &ope) override { ope.ope_->accept(*this); }
   void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
   void visit(Holder &ope) override;
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(BackReference &) override { captures = true; }
   void visit(PrecedenceClimbing &ope) override;
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
   std::unordered_map<void *, size_t> ids;
+  size_t memo_count = 0;
+  bool captures = false; // Whether any rule captures or refers back
 };
 
 struct IsLiteralToken : public Ope::Visitor {
@@ -2201,6 +2563,647 @@ private:
   const std::vector<std::string> &params_;
 };
 
+/*
+ * First characters
+ */
+
+// The bytes that a match of an expression can start with, and whether it can
+// match without consuming anything, in which case it can't be ruled out by
+// what comes next
+struct FirstSet {
+  std::bitset<256> chars;
+  bool empty = false;
+
+  static FirstSet any() {
+    FirstSet first;
+    first.chars.set();
+    first.empty = true;
+    return first;
+  }
+
+  bool operator==(const FirstSet &rhs) const {
+    return chars == rhs.chars && empty == rhs.empty;
+  }
+};
+
+using FirstSets = std::unordered_map<const Definition *, FirstSet>;
+
+// The first set of an expression, given those of the rules it refers to. It
+// errs on the side of too many bytes: anything it can't see through (user
+// parsers, back references, macro arguments, error recovery) could start
+// with anything.
+struct ComputeFirstSet : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  ComputeFirstSet(const FirstSets &rules) : rules_(rules) {}
+
+  void visit(Sequence &ope) override {
+    FirstSet first;
+    first.empty = true;
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+      first.chars |= result.chars;
+      if (!result.empty) {
+        first.empty = false;
+        break;
+      }
+    }
+    result = first;
+  }
+  void visit(PrioritizedChoice &ope) override {
+    FirstSet first;
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+      first.chars |= result.chars;
+      first.empty = first.empty || result.empty;
+    }
+    result = first;
+  }
+  void visit(Repetition &ope) override {
+    ope.ope_->accept(*this);
+    if (ope.min_ == 0) { result.empty = true; }
+  }
+  void visit(AndPredicate &) override { nothing(); }
+  void visit(NotPredicate &) override { nothing(); }
+  void visit(Dictionary &) override { result = FirstSet::any(); }
+  void visit(LiteralString &ope) override {
+    result = FirstSet();
+    if (ope.lit_.empty()) {
+      result.empty = true;
+      return;
+    }
+    // Compared as parse_literal() compares them
+    for (int b = 0; b < 256; b++) {
+      auto ch = static_cast<char>(b);
+      if (ope.ignore_case_ ? std::tolower(ch) == std::tolower(ope.lit_[0])
+                           : ch == ope.lit_[0]) {
+        result.chars.set(static_cast<size_t>(b));
+      }
+    }
+  }
+  void visit(CharacterClass &ope) override {
+    result = FirstSet();
+    auto high = ope.negated_;
+    for (const auto &[from, to] : ope.ranges_) {
+      if (to >= 0x80) { high = true; }
+    }
+    for (char32_t b = 0; b < 0x80; b++) {
+      auto in = false;
+      for (const auto &[from, to] : ope.ranges_) {
+        in = in || (ope.ignore_case_
+                        ? std::tolower(from) <= std::tolower(b) &&
+                              std::tolower(b) <= std::tolower(to)
+                        : from <= b && b <= to);
+      }
+      if (in != ope.negated_) { result.chars.set(b); }
+    }
+    if (high) { non_ascii(); }
+  }
+  void visit(Character &ope) override {
+    result = FirstSet();
+    if (ope.ch_ < 0x80) {
+      result.chars.set(ope.ch_);
+    } else {
+      non_ascii();
+    }
+  }
+  void visit(AnyCharacter &) override {
+    result = FirstSet();
+    result.chars.set();
+  }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(User &) override { result = FirstSet::any(); }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override;
+  void visit(Reference &ope) override;
+  void visit(Whitespace &ope) override {
+    // Matches nothing when it's already skipping whitespace
+    ope.ope_->accept(*this);
+    result.empty = true;
+  }
+  void visit(BackReference &) override { result = FirstSet::any(); }
+  void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Recovery &) override { result = FirstSet::any(); }
+  void visit(Cut &) override { nothing(); }
+
+  FirstSet result;
+
+private:
+  void nothing() {
+    result = FirstSet();
+    result.empty = true;
+  }
+
+  // Any lead byte of a multi-byte character, or a stray byte decoded alone
+  void non_ascii() {
+    for (size_t b = 0x80; b < 0x100; b++) {
+      result.chars.set(b);
+    }
+  }
+
+  void rule(const Definition &rule);
+
+  const FirstSets &rules_;
+};
+
+// Give every choice in an expression its dispatch table, without following
+// references into other rules
+struct SetFirstCharDispatch : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  SetFirstCharDispatch(const FirstSets &rules) : rules_(rules) {}
+
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    auto words = (ope.opes_.size() + 63) / 64;
+    std::vector<uint64_t> table(257 * words);
+    auto skips = false;
+    for (size_t id = 0; id < ope.opes_.size(); id++) {
+      ComputeFirstSet vis(rules_);
+      ope.opes_[id]->accept(vis);
+      auto bit = uint64_t(1) << (id % 64);
+      for (size_t key = 0; key < 257; key++) {
+        if (vis.result.empty || (key < 256 && vis.result.chars[key])) {
+          table[key * words + id / 64] |= bit;
+        } else {
+          skips = true;
+        }
+      }
+      ope.opes_[id]->accept(*this);
+    }
+    ope.dispatch_.clear();
+    if (skips) { ope.dispatch_.swap(table); }
+  }
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+
+private:
+  const FirstSets &rules_;
+};
+
+/*
+ * Flat programs
+ */
+
+// One operator of a FlatProgram. What 'a', 'b' and 'c' hold depends on the
+// kind; children, rules, literals and tables are indexes into the program's
+// arrays.
+struct FlatOpe {
+  enum class Kind : uint8_t {
+    Sequence,      // a: first operand, b: operand count
+    Choice,        // ...and c: dispatch table, or NO_INDEX
+    Repetition,    // a: child, b: min, c: max, or NO_INDEX for no limit
+    AndPredicate,  // a: child
+    NotPredicate,  // a: child
+    Dictionary,    // a: trie
+    Literal,       // a: text offset, b: length
+    Class,         // a: table of ASCII matches, c: the CharacterClass
+    Character,     // a: code point
+    AnyCharacter,  //
+    TokenBoundary, // a: child
+    Ignore,        // a: child
+    Whitespace,    // a: child
+    Rule,          // a: rule
+  };
+
+  Kind kind;
+  bool ignore_case;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+};
+
+// A grammar lowered from its tree of operators into arrays (see
+// Definition::enable_flat_program()). Rules and children are referred to by
+// index rather than through Reference, WeakHolder and Holder, so FlatMachine
+// runs it with a switch instead of a virtual call per operator, over a few
+// contiguous blocks of memory. It only builds typed nodes.
+struct FlatProgram {
+  static constexpr uint32_t NO_INDEX = static_cast<uint32_t>(-1);
+
+  struct Rule {
+    const Definition *definition;
+    uint32_t ope;
+    uint32_t memo_id;
+    bool memoize;
+    bool commit;
+    bool ignore;
+    bool token;
+    bool choice; // Whether its node keeps the choice its expression made
+  };
+
+  std::vector<FlatOpe> opes;
+  std::vector<uint32_t> operands;
+  std::vector<uint64_t> tables;
+  std::string text;
+  std::vector<const Trie *> tries;
+  // Only asked about characters outside ASCII
+  std::vector<const CharacterClass *> classes;
+  std::vector<Rule> rules;
+
+  uint32_t start = NO_INDEX;
+  uint32_t whitespace = NO_INDEX;
+};
+
+// Lower an expression, and the rules it refers to, into a FlatProgram.
+// Operators that the flat program can't run (captures, back references,
+// macros, user parsers, precedence climbing, error recovery and cuts) and
+// rules with enter, leave or predicate hooks clear 'ok'.
+struct LowerToFlat : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  LowerToFlat(FlatProgram &program) : program_(program) {}
+
+  uint32_t lower(Ope &ope) {
+    if (auto it = opes_.find(&ope); it != opes_.end()) { return it->second; }
+    result_ = 0;
+    ope.accept(*this);
+    opes_[&ope] = result_;
+    return result_;
+  }
+
+  void visit(Sequence &ope) override {
+    auto operands = children(ope.opes_);
+    result_ = emit(FlatOpe::Kind::Sequence, operands,
+                   static_cast<uint32_t>(ope.opes_.size()));
+  }
+  void visit(PrioritizedChoice &ope) override {
+    auto operands = children(ope.opes_);
+    auto table = FlatProgram::NO_INDEX;
+    if (!ope.dispatch_.empty()) {
+      table = static_cast<uint32_t>(program_.tables.size());
+      program_.tables.insert(program_.tables.end(), ope.dispatch_.begin(),
+                             ope.dispatch_.end());
+    }
+    result_ = emit(FlatOpe::Kind::Choice, operands,
+                   static_cast<uint32_t>(ope.opes_.size()), table);
+  }
+  void visit(Repetition &ope) override {
+    constexpr auto most = static_cast<size_t>(FlatProgram::NO_INDEX);
+    auto unlimited = ope.max_ == std::numeric_limits<size_t>::max();
+    if (ope.min_ >= most || (!unlimited && ope.max_ >= most)) {
+      ok = false;
+      return;
+    }
+    auto child = lower(*ope.ope_);
+    result_ = emit(FlatOpe::Kind::Repetition, child,
+                   static_cast<uint32_t>(ope.min_),
+                   unlimited ? FlatProgram::NO_INDEX
+                             : static_cast<uint32_t>(ope.max_));
+  }
+  void visit(AndPredicate &ope) override {
+    result_ = emit(FlatOpe::Kind::AndPredicate, lower(*ope.ope_));
+  }
+  void visit(NotPredicate &ope) override {
+    result_ = emit(FlatOpe::Kind::NotPredicate, lower(*ope.ope_));
+  }
+  void visit(Dictionary &ope) override {
+    program_.tries.push_back(&ope.trie_);
+    result_ = emit(FlatOpe::Kind::Dictionary,
+                   static_cast<uint32_t>(program_.tries.size() - 1));
+  }
+  void visit(LiteralString &ope) override {
+    auto offset = static_cast<uint32_t>(program_.text.size());
+    program_.text += ope.lit_;
+    result_ = emit(FlatOpe::Kind::Literal, offset,
+                   static_cast<uint32_t>(ope.lit_.size()));
+    program_.opes[result_].ignore_case = ope.ignore_case_;
+  }
+  void visit(CharacterClass &ope) override;
+  void visit(Character &ope) override {
+    result_ = emit(FlatOpe::Kind::Character, static_cast<uint32_t>(ope.ch_));
+  }
+  void visit(AnyCharacter &) override {
+    result_ = emit(FlatOpe::Kind::AnyCharacter);
+  }
+  // Nothing is captured, so there's nothing to scope
+  void visit(CaptureScope &ope) override { result_ = lower(*ope.ope_); }
+  void visit(Capture &) override { ok = false; }
+  void visit(TokenBoundary &ope) override {
+    result_ = emit(FlatOpe::Kind::TokenBoundary, lower(*ope.ope_));
+  }
+  void visit(Ignore &ope) override {
+    result_ = emit(FlatOpe::Kind::Ignore, lower(*ope.ope_));
+  }
+  void visit(User &) override { ok = false; }
+  void visit(WeakHolder &ope) override { result_ = lower(*ope.weak_.lock()); }
+  void visit(Holder &ope) override { result_ = rule(*ope.outer_); }
+  void visit(Reference &ope) override;
+  void visit(Whitespace &ope) override {
+    result_ = emit(FlatOpe::Kind::Whitespace, lower(*ope.ope_));
+  }
+  void visit(BackReference &) override { ok = false; }
+  void visit(PrecedenceClimbing &) override { ok = false; }
+  void visit(Recovery &) override { ok = false; }
+  void visit(Cut &) override { ok = false; }
+
+  // The operator that runs a rule
+  uint32_t rule(const Definition &rule);
+
+  bool ok = true;
+
+private:
+  uint32_t emit(FlatOpe::Kind kind, uint32_t a = 0, uint32_t b = 0,
+                uint32_t c = 0) {
+    program_.opes.push_back(FlatOpe{kind, false, a, b, c});
+    return static_cast<uint32_t>(program_.opes.size() - 1);
+  }
+
+  // Lower 'opes' and store their indexes together, returning the first
+  uint32_t children(const std::vector<std::shared_ptr<Ope>> &opes) {
+    std::vector<uint32_t> ids;
+    for (const auto &ope : opes) {
+      ids.push_back(lower(*ope));
+    }
+    auto first = static_cast<uint32_t>(program_.operands.size());
+    program_.operands.insert(program_.operands.end(), ids.begin(), ids.end());
+    return first;
+  }
+
+  FlatProgram &program_;
+  uint32_t result_ = 0;
+  std::unordered_map<const Ope *, uint32_t> opes_;
+  std::unordered_map<const Definition *, uint32_t> rules_;
+};
+
+// Runs a FlatProgram, building typed nodes as Definition::parse_ast() does
+// on the operators: the same nodes, memo table entries and commits. It
+// keeps no error information, which is only wanted when a parse fails.
+class FlatMachine {
+public:
+  FlatMachine(const FlatProgram &program, Context &c)
+      : program_(program), c_(c), nodes_(*c.ast_nodes) {}
+
+  size_t parse(uint32_t id, const char *s, size_t n) {
+    const auto &ope = program_.opes[id];
+    switch (ope.kind) {
+    case FlatOpe::Kind::Sequence: {
+      size_t i = 0;
+      for (auto k = ope.a; k < ope.a + ope.b; k++) {
+        auto len = parse(program_.operands[k], s + i, n - i);
+        if (fail(len)) { return len; }
+        i += len;
+      }
+      return i;
+    }
+    case FlatOpe::Kind::Choice: {
+      // The alternatives that can start with the next byte, or match at the
+      // end of the input
+      const uint64_t *can_match = nullptr;
+      if (ope.c != FlatProgram::NO_INDEX) {
+        auto key = n > 0 ? static_cast<unsigned char>(*s) : 256u;
+        can_match = &program_.tables[ope.c + key * ((ope.b + 63) / 64)];
+      }
+      for (uint32_t alt = 0; alt < ope.b; alt++) {
+        if (can_match && !((can_match[alt / 64] >> (alt % 64)) & 1)) {
+          continue;
+        }
+        auto mark = this->mark();
+        auto len = parse(program_.operands[ope.a + alt], s, n);
+        if (success(len)) {
+          choice_count_ = ope.b;
+          choice_ = alt;
+          return len;
+        }
+        drop(mark);
+      }
+      return static_cast<size_t>(-1);
+    }
+    case FlatOpe::Kind::Repetition: {
+      size_t max = ope.c == FlatProgram::NO_INDEX
+                       ? std::numeric_limits<size_t>::max()
+                       : ope.c;
+      size_t count = 0;
+      size_t i = 0;
+      while (count < ope.b || count < max) {
+        auto mark = this->mark();
+        auto len = parse(ope.a, s + i, n - i);
+        if (fail(len)) {
+          drop(mark);
+          if (count < ope.b) { return len; }
+          break;
+        }
+        i += len;
+        count++;
+      }
+      return i;
+    }
+    case FlatOpe::Kind::AndPredicate: {
+      auto mark = this->mark();
+      auto len = parse(ope.a, s, n);
+      drop(mark);
+      return success(len) ? 0 : len;
+    }
+    case FlatOpe::Kind::NotPredicate: {
+      auto mark = this->mark();
+      auto len = parse(ope.a, s, n);
+      drop(mark);
+      return success(len) ? static_cast<size_t>(-1) : 0;
+    }
+    case FlatOpe::Kind::Dictionary: {
+      const auto &trie = *program_.tries[ope.a];
+      size_t alt;
+      auto i = trie.match(s, n, alt);
+      if (i == 0) { return static_cast<size_t>(-1); }
+      choice_count_ = trie.items_count();
+      choice_ = alt;
+      return skip_whitespace(s, n, i);
+    }
+    case FlatOpe::Kind::Literal: {
+      if (n < ope.b) { return static_cast<size_t>(-1); }
+      auto lit = program_.text.data() + ope.a;
+      if (ope.ignore_case) {
+        for (uint32_t i = 0; i < ope.b; i++) {
+          if (std::tolower(s[i]) != std::tolower(lit[i])) {
+            return static_cast<size_t>(-1);
+          }
+        }
+      } else if (std::memcmp(s, lit, ope.b) != 0) {
+        return static_cast<size_t>(-1);
+      }
+      return skip_whitespace(s, n, ope.b);
+    }
+    case FlatOpe::Kind::Class: {
+      if (n < 1) { return static_cast<size_t>(-1); }
+      auto b = static_cast<unsigned char>(*s);
+      if (b < 0x80) {
+        return ((program_.tables[ope.a + b / 64] >> (b % 64)) & 1)
+                   ? 1
+                   : static_cast<size_t>(-1);
+      }
+      return program_.classes[ope.c]->CharacterClass::parse_core(s, n, vs_,
+                                                                 c_, dt_);
+    }
+    case FlatOpe::Kind::Character: {
+      if (n < 1) { return static_cast<size_t>(-1); }
+      auto b = static_cast<unsigned char>(*s);
+      if (b < 0x80) { return b == ope.a ? 1 : static_cast<size_t>(-1); }
+      char32_t cp = 0;
+      auto len = decode_codepoint(s, n, cp);
+      return cp == ope.a ? len : static_cast<size_t>(-1);
+    }
+    case FlatOpe::Kind::AnyCharacter: {
+      auto len = codepoint_length(s, n);
+      return len < 1 ? static_cast<size_t>(-1) : len;
+    }
+    case FlatOpe::Kind::TokenBoundary: {
+      c_.in_token_boundary_count++;
+      auto len = parse(ope.a, s, n);
+      c_.in_token_boundary_count--;
+      if (success(len)) {
+        tokens_.emplace_back(s, len);
+        if (!c_.in_token_boundary_count &&
+            program_.whitespace != FlatProgram::NO_INDEX) {
+          auto l = whitespace(s + len, n - len);
+          if (fail(l)) { return l; }
+          len += l;
+        }
+      }
+      return len;
+    }
+    case FlatOpe::Kind::Ignore: {
+      auto mark = this->mark();
+      auto len = parse(ope.a, s, n);
+      drop(mark);
+      return len;
+    }
+    case FlatOpe::Kind::Whitespace: {
+      if (c_.in_whitespace) { return 0; }
+      c_.in_whitespace = true;
+      auto len = parse(ope.a, s, n);
+      c_.in_whitespace = false;
+      return len;
+    }
+    case FlatOpe::Kind::Rule: return rule(program_.rules[ope.a], s, n);
+    }
+    return static_cast<size_t>(-1);
+  }
+
+  // The program's %whitespace, or the native skipper that stands in for it
+  size_t whitespace(const char *s, size_t n) {
+    if (c_.whitespace_skipper) {
+      return c_.in_whitespace ? 0 : c_.whitespace_skipper(s, n);
+    }
+    return parse(program_.whitespace, s, n);
+  }
+
+private:
+  // Where the node and token stacks were, to go back to when what was
+  // matched since is dropped
+  struct Mark {
+    size_t nodes;
+    size_t tokens;
+  };
+
+  Mark mark() const { return Mark{nodes_.stack.size(), tokens_.size()}; }
+
+  void drop(const Mark &mark) {
+    nodes_.stack.resize(mark.nodes);
+    tokens_.resize(mark.tokens);
+  }
+
+  size_t skip_whitespace(const char *s, size_t n, size_t i) {
+    if (!c_.in_token_boundary_count &&
+        program_.whitespace != FlatProgram::NO_INDEX) {
+      auto len = whitespace(s + i, n - i);
+      if (fail(len)) { return len; }
+      i += len;
+    }
+    return i;
+  }
+
+  size_t rule(const FlatProgram::Rule &rule, const char *s, size_t n) {
+    size_t len;
+    uint32_t node = 0;
+
+    auto parse_rule = [&](uint32_t &a_node) {
+      auto mark = this->mark();
+      auto choice_count = choice_count_;
+      auto choice = choice_;
+
+      len = parse(rule.ope, s, n);
+      if (success(len) && !rule.ignore) { a_node = reduce(rule, s, len, mark); }
+
+      drop(mark);
+      choice_count_ = choice_count;
+      choice_ = choice;
+    };
+
+    if (rule.memoize) {
+      c_.packrat(s, rule.memo_id, len, node, parse_rule);
+    } else {
+      parse_rule(node);
+    }
+
+    if (rule.commit && success(len)) { c_.commit_packrat(s + len); }
+
+    if (success(len) && !rule.ignore) { nodes_.stack.push_back(node); }
+    return len;
+  }
+
+  // As Holder::reduce_node()
+  uint32_t reduce(const FlatProgram::Rule &rule, const char *s, size_t len,
+                  const Mark &mark) {
+    AstNodes::Node node{};
+    node.rule = rule.definition;
+    node.position = static_cast<uint32_t>(s - c_.s);
+    node.length = static_cast<uint32_t>(len);
+    if (rule.choice) {
+      node.choice_count = static_cast<uint16_t>(choice_count_);
+      node.choice = static_cast<uint16_t>(choice_);
+    }
+    node.children = static_cast<uint32_t>(nodes_.children.size());
+
+    if (rule.token) {
+      auto token = tokens_.size() > mark.tokens ? tokens_[mark.tokens]
+                                                : std::string_view(s, len);
+      node.token = static_cast<uint32_t>(token.data() - c_.s);
+      node.token_length = static_cast<uint32_t>(token.size());
+    } else {
+      auto first =
+          nodes_.stack.begin() + static_cast<std::ptrdiff_t>(mark.nodes);
+      node.child_count = static_cast<uint32_t>(nodes_.stack.end() - first);
+      nodes_.children.insert(nodes_.children.end(), first, nodes_.stack.end());
+    }
+
+    nodes_.nodes.push_back(node);
+    return static_cast<uint32_t>(nodes_.nodes.size() - 1);
+  }
+
+  const FlatProgram &program_;
+  Context &c_;
+  AstNodes &nodes_;
+
+  // The tokens matched in the rules under way, as their SemanticValues
+  // would hold them
+  std::vector<std::string_view> tokens_;
+  // Set by the last choice to match
+  size_t choice_count_ = 0;
+  size_t choice_ = 0;
+
+  // For CharacterClass::parse_core(), which doesn't use them
+  SemanticValues vs_;
+  std::any dt_;
+};
+
 /*
  * Keywords
  */
@@ -2285,6 +3288,19 @@ public:
     return parse_and_get_value(s, n, val, path, log);
   }
 
+  // Build the tree that enable_ast() would, as AstNodes. Rules' actions and
+  // their enter and leave values are not used, so this is only for grammars
+  // whose rules have no actions but the AST ones; it can't be used with
+  // precedence climbing.
+  Result parse_ast(const char *s, size_t n, AstNodes &nodes,
+                   const char *path = nullptr, Log log = nullptr) const {
+    SemanticValues vs;
+    std::any dt;
+    auto r = parse_core(s, n, vs, dt, path, log, &nodes);
+    if (r.ret && !nodes.stack.empty()) { nodes.root = nodes.stack.back(); }
+    return r;
+  }
+
   template <typename T>
   Result parse_and_get_value(const char *s, size_t n, std::any &dt, T &val,
                              const char *path = nullptr,
@@ -2399,11 +3415,42 @@ public:
       leave;
   bool ignoreSemanticValue = false;
   std::shared_ptr<Ope> whitespaceOpe;
+  // Run instead of whitespaceOpe where it can be (see
+  // Context::skip_whitespace())
+  WhitespaceSkipper whitespaceSkipper;
   std::shared_ptr<Ope> wordOpe;
   bool enablePackratParsing = false;
+  // With packrat parsing enabled, whether this rule's results are kept. Rules
+  // that are cheap, or never tried twice at the same place, can be left out
+  // to save time and memory. Set before the first parse.
+  bool memoize = true;
+  size_t memo_id = 0;
+  // Once this rule has matched, the parse never backtracks to before the end
+  // of the match (as with a top-level unit in a repetition), so the packrat
+  // results for everything before it can be freed.
+  bool commit = false;
   bool is_macro = false;
   std::vector<std::string> params;
   bool disable_action = false;
+  // Skip alternatives by their first byte (see
+  // parser::enable_first_char_dispatch()). Skipped alternatives don't say
+  // what they expected, so a parse that fails is run again without it, to
+  // report the same errors, if they'll be read (see explain_failures).
+  bool enableFirstCharDispatch = false;
+  // Run a parse that fails again without dispatch, or on the operators
+  // rather than the FlatProgram, so that Result::error_info says why, even
+  // with no log. Set false if nothing reads error_info except through a
+  // log, and only parses with a log pay for the second run.
+  bool explain_failures = true;
+
+  // Lower the rules this one reaches into a FlatProgram, which parse_ast()
+  // then runs rather than the operators themselves. A parse that fails is
+  // run again on the operators, to report the same errors, if they'll be
+  // read (see explain_failures); one with a tracer always runs on them. Returns false, and changes nothing, if the grammar uses
+  // something the program can't run. Call once the grammar is set up (and
+  // after parser::enable_first_char_dispatch(), whose tables it copies) and
+  // before parsing.
+  bool enable_flat_program();
 
   TracerEnter tracer_enter;
   TracerLeave tracer_leave;
@@ -2430,11 +3477,33 @@ private:
       if (whitespaceOpe) { whitespaceOpe->accept(vis); }
       if (wordOpe) { wordOpe->accept(vis); }
       definition_ids_.swap(vis.ids);
+      memo_count_ = vis.memo_count;
+      has_captures_ = vis.captures;
     });
   }
 
   Result parse_core(const char *s, size_t n, SemanticValues &vs, std::any &dt,
-                    const char *path, Log log) const {
+                    const char *path, Log log,
+                    AstNodes *nodes = nullptr) const {
+    if (nodes) { nodes->clear(); }
+    auto explain = log || explain_failures;
+    if (nodes && flat_program_ && !tracer_enter && !tracer_leave) {
+      auto r = parse_flat(s, n, path, *nodes);
+      if (r.ret) { return r; }
+      nodes->clear();
+      if (!explain) { return r; }
+    } else if (enableFirstCharDispatch) {
+      auto r = parse_core(s, n, vs, dt, path, log, nodes, true);
+      if (r.ret || !explain) { return r; }
+      vs.clear();
+      if (nodes) { nodes->clear(); }
+    }
+    return parse_core(s, n, vs, dt, path, log, nodes, false);
+  }
+
+  Result parse_core(const char *s, size_t n, SemanticValues &vs, std::any &dt,
+                    const char *path, Log log, AstNodes *nodes,
+                    bool dispatch) const {
     initialize_definition_ids();
 
     std::shared_ptr<Ope> ope = holder_;
@@ -2445,9 +3514,12 @@ private:
       if (tracer_end) { tracer_end(trace_data); }
     });
 
-    Context c(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
+    Context c(path, s, n, memo_count_, whitespaceOpe, wordOpe,
               enablePackratParsing, tracer_enter, tracer_leave, trace_data,
-              verbose_trace, log);
+              verbose_trace, log, has_captures_);
+    c.first_char_dispatch = dispatch;
+    c.ast_nodes = nodes;
+    if (whitespaceOpe) { c.whitespace_skipper = whitespaceSkipper; }
 
     size_t i = 0;
 
@@ -2457,7 +3529,7 @@ private:
       auto se =
           scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-      auto len = whitespaceOpe->parse(s, n, vs, c, dt);
+      auto len = c.skip_whitespace(s, n, vs, dt);
       if (fail(len)) { return Result{false, c.recovered, i, c.error_info}; }
 
       i = len;
@@ -2480,12 +3552,42 @@ private:
     return Result{ret, c.recovered, i, c.error_info};
   }
 
+  Result parse_flat(const char *s, size_t n, const char *path,
+                    AstNodes &nodes) const {
+    const auto &program = *flat_program_;
+    Context c(path, s, n, memo_count_, whitespaceOpe, wordOpe,
+              enablePackratParsing, nullptr, nullptr, std::any(), false,
+              nullptr, has_captures_);
+    c.ast_nodes = &nodes;
+    if (whitespaceOpe) { c.whitespace_skipper = whitespaceSkipper; }
+    FlatMachine machine(program, c);
+
+    size_t i = 0;
+
+    if (program.whitespace != FlatProgram::NO_INDEX) {
+      auto len = machine.whitespace(s, n);
+      if (fail(len)) { return Result{false, false, i, c.error_info}; }
+      i = len;
+    }
+
+    auto len = machine.parse(program.start, s + i, n - i);
+    auto ret = success(len);
+    if (ret) {
+      i += len;
+      if (eoi_check && i < n) { ret = false; }
+    }
+    return Result{ret, false, i, c.error_info};
+  }
+
   std::shared_ptr<Holder> holder_;
+  std::shared_ptr<const FlatProgram> flat_program_;
   mutable std::once_flag is_token_init_;
   mutable bool is_token_ = false;
   mutable std::once_flag assign_id_to_definition_init_;
   mutable std::once_flag definition_ids_init_;
   mutable std::unordered_map<void *, size_t> definition_ids_;
+  mutable size_t memo_count_ = 0;
+  mutable bool has_captures_ = true;
 };
 
 /*
@@ -2546,7 +3648,7 @@ inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
     auto se =
         scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-    auto len = c.whitespaceOpe->parse(s + i, n - i, vs, c, dt);
+    auto len = c.skip_whitespace(s + i, n - i, vs, dt);
     if (fail(len)) { return len; }
     i += len;
   }
@@ -2626,6 +3728,14 @@ inline void ErrorInfo::output_log(const Log &log, const char *s, size_t n) {
   }
 }
 
+inline size_t Context::skip_whitespace(const char *a_s, size_t n,
+                                       SemanticValues &vs, std::any &dt) {
+  if (whitespace_skipper && !log) {
+    return in_whitespace ? 0 : whitespace_skipper(a_s, n);
+  }
+  return whitespaceOpe->parse(a_s, n, vs, *this, dt);
+}
+
 inline void Context::set_error_pos(const char *a_s, const char *literal) {
   if (log) {
     if (error_info.error_pos <= a_s) {
@@ -2703,7 +3813,7 @@ inline size_t Dictionary::parse_core(const char *s, size_t n,
     return static_cast<size_t>(-1);
   }
 
-  vs.choice_count_ = trie_.size();
+  vs.choice_count_ = trie_.items_count();
   vs.choice_ = id;
 
   // Word check
@@ -2736,7 +3846,7 @@ inline size_t Dictionary::parse_core(const char *s, size_t n,
     auto se =
         scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-    auto len = c.whitespaceOpe->parse(s + i, n - i, vs, c, dt);
+    auto len = c.skip_whitespace(s + i, n - i, vs, dt);
     if (fail(len)) { return len; }
     i += len;
   }
@@ -2771,7 +3881,7 @@ inline size_t TokenBoundary::parse_core(const char *s, size_t n,
 
     if (!c.in_token_boundary_count) {
       if (c.whitespaceOpe) {
-        auto l = c.whitespaceOpe->parse(s + len, n - len, vs, c, dt);
+        auto l = c.skip_whitespace(s + len, n - len, vs, dt);
         if (fail(l)) { return l; }
         len += l;
       }
@@ -2794,15 +3904,31 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
     return len;
   }
 
+  if (c.ast_nodes) { return parse_rule<uint32_t>(s, n, vs, c, dt); }
+  return parse_rule<std::any>(s, n, vs, c, dt);
+}
+
+template <typename V>
+inline size_t Holder::parse_rule(const char *s, size_t n, SemanticValues &vs,
+                                 Context &c, std::any &dt) const {
+  constexpr auto typed = std::is_same_v<V, uint32_t>;
+
   size_t len;
-  std::any val;
+  V val{};
 
-  c.packrat(s, outer_->id, len, val, [&](std::any &a_val) {
+  auto parse_rule = [&](V &a_val) {
     if (outer_->enter) { outer_->enter(c, s, n, dt); }
     auto &chvs = c.push_semantic_values_scope();
     auto se = scope_exit([&]() {
       c.pop_semantic_values_scope();
-      if (outer_->leave) { outer_->leave(c, s, n, len, a_val, dt); }
+      if (outer_->leave) {
+        if constexpr (typed) {
+          std::any none;
+          outer_->leave(c, s, n, len, none, dt);
+        } else {
+          outer_->leave(c, s, n, len, a_val, dt);
+        }
+      }
     });
 
     c.rule_stack.push_back(outer_);
@@ -2812,7 +3938,7 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
     // Invoke action
     if (success(len)) {
       chvs.sv_ = std::string_view(s, len);
-      chvs.name_ = outer_->name;
+      if (!typed || outer_->predicate) { chvs.name_ = outer_->name; }
 
       auto ope_ptr = ope_.get();
       {
@@ -2836,7 +3962,11 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
       }
 
       if (success(len)) {
-        if (!c.recovered) { a_val = reduce(chvs, dt); }
+        if constexpr (typed) {
+          if (!outer_->ignoreSemanticValue) { a_val = reduce_node(chvs, c); }
+        } else {
+          if (!c.recovered) { a_val = reduce(chvs, dt); }
+        }
       } else {
         if (c.log && !msg.empty() && c.error_info.message_pos < s) {
           c.error_info.message_pos = s;
@@ -2852,12 +3982,24 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
         c.error_info.label = outer_->name;
       }
     }
-  });
+  };
+
+  if (outer_->memoize) {
+    c.packrat(s, outer_->memo_id, len, val, parse_rule);
+  } else {
+    parse_rule(val);
+  }
+
+  if (outer_->commit && success(len)) { c.commit_packrat(s + len); }
 
   if (success(len)) {
     if (!outer_->ignoreSemanticValue) {
-      vs.emplace_back(std::move(val));
-      vs.tags.emplace_back(str2tag(outer_->name));
+      if constexpr (typed) {
+        c.ast_nodes->stack.push_back(val);
+      } else {
+        vs.emplace_back(std::move(val));
+        vs.tags.emplace_back(str2tag(outer_->name));
+      }
     }
   }
 
@@ -2874,6 +4016,34 @@ inline std::any Holder::reduce(SemanticValues &vs, std::any &dt) const {
   }
 }
 
+// The node for a rule that has just matched, as add_ast_action() would build
+// it, taking as its children the nodes its scope matched
+inline uint32_t Holder::reduce_node(SemanticValues &vs, Context &c) const {
+  auto &nodes = *c.ast_nodes;
+
+  AstNodes::Node node{};
+  node.rule = outer_;
+  node.position = static_cast<uint32_t>(vs.sv_.data() - c.s);
+  node.length = static_cast<uint32_t>(vs.sv_.size());
+  node.choice_count = static_cast<uint16_t>(vs.choice_count_);
+  node.choice = static_cast<uint16_t>(vs.choice_);
+  node.children = static_cast<uint32_t>(nodes.children.size());
+
+  auto first = nodes.stack.begin() + static_cast<std::ptrdiff_t>(vs.node_mark_);
+  if (outer_->is_token()) {
+    auto token = vs.token();
+    node.token = static_cast<uint32_t>(token.data() - c.s);
+    node.token_length = static_cast<uint32_t>(token.size());
+  } else {
+    node.child_count = static_cast<uint32_t>(nodes.stack.end() - first);
+    nodes.children.insert(nodes.children.end(), first, nodes.stack.end());
+  }
+  nodes.stack.erase(first, nodes.stack.end());
+
+  nodes.nodes.push_back(node);
+  return static_cast<uint32_t>(nodes.nodes.size() - 1);
+}
+
 inline const std::string &Holder::name() const { return outer_->name; }
 
 inline const std::string &Holder::trace_name() const {
@@ -3059,7 +4229,9 @@ inline size_t Recovery::parse_core(const char *s, size_t n,
     SemanticValues dummy_vs;
     std::any dummy_dt;
 
+    auto mark = c.ast_nodes ? c.ast_nodes->stack.size() : 0;
     len = rule.parse(s, n, dummy_vs, c, dummy_dt);
+    if (c.ast_nodes) { c.ast_nodes->stack.resize(mark); }
   }
 
   if (success(len)) {
@@ -3113,6 +4285,7 @@ inline void AssignIDToDefinition::visit(Holder &ope) {
   auto id = ids.size();
   ids[p] = id;
   ope.outer_->id = id;
+  if (ope.outer_->memoize) { ope.outer_->memo_id = memo_count++; }
   ope.ope_->accept(*this);
 }
 
@@ -3149,6 +4322,101 @@ inline void FindLiteralToken::visit(Reference &ope) {
   }
 }
 
+inline void ComputeFirstSet::rule(const Definition &rule) {
+  if (rule.is_macro) {
+    result = FirstSet::any();
+    return;
+  }
+  // Rules not worked out yet start with nothing, and grow from there
+  auto it = rules_.find(&rule);
+  result = it != rules_.end() ? it->second : FirstSet();
+}
+
+inline void ComputeFirstSet::visit(Holder &ope) { rule(*ope.outer_); }
+
+inline void ComputeFirstSet::visit(Reference &ope) {
+  if (ope.rule_) {
+    rule(*ope.rule_);
+  } else {
+    result = FirstSet::any(); // A macro argument
+  }
+}
+
+inline void LowerToFlat::visit(CharacterClass &ope) {
+  // Whether each ASCII character matches, worked out as parse_core() would
+  uint64_t table[2] = {0, 0};
+  for (char32_t b = 0; b < 0x80; b++) {
+    auto in = false;
+    for (const auto &[from, to] : ope.ranges_) {
+      in = in || (ope.ignore_case_ ? std::tolower(from) <= std::tolower(b) &&
+                                         std::tolower(b) <= std::tolower(to)
+                                   : from <= b && b <= to);
+    }
+    if (in != ope.negated_) { table[b / 64] |= uint64_t(1) << (b % 64); }
+  }
+  auto offset = static_cast<uint32_t>(program_.tables.size());
+  program_.tables.insert(program_.tables.end(), table, table + 2);
+  program_.classes.push_back(&ope);
+  result_ = emit(FlatOpe::Kind::Class, offset, 0,
+                 static_cast<uint32_t>(program_.classes.size() - 1));
+}
+
+inline void LowerToFlat::visit(Reference &ope) {
+  if (!ope.rule_ || ope.rule_->is_macro || !ope.args_.empty()) {
+    ok = false;
+    return;
+  }
+  result_ = rule(*ope.rule_);
+}
+
+inline uint32_t LowerToFlat::rule(const Definition &rule) {
+  if (auto it = rules_.find(&rule); it != rules_.end()) { return it->second; }
+
+  auto core = rule.get_core_operator();
+  if (!core || rule.is_macro || rule.enter || rule.leave || rule.predicate) {
+    ok = false;
+    return 0;
+  }
+
+  // Made before its expression is lowered, which may refer back to it
+  auto id = static_cast<uint32_t>(program_.rules.size());
+  program_.rules.emplace_back();
+  auto ope = emit(FlatOpe::Kind::Rule, id);
+  rules_[&rule] = ope;
+
+  auto ope_ptr = core.get();
+  if (auto tok_ptr = dynamic_cast<const TokenBoundary *>(ope_ptr)) {
+    ope_ptr = tok_ptr->ope_.get();
+  }
+
+  FlatProgram::Rule flat{};
+  flat.definition = &rule;
+  flat.ope = lower(*core);
+  flat.memo_id = static_cast<uint32_t>(rule.memo_id);
+  flat.memoize = rule.memoize;
+  flat.commit = rule.commit;
+  flat.ignore = rule.ignoreSemanticValue;
+  flat.token = rule.is_token();
+  flat.choice = dynamic_cast<const PrioritizedChoice *>(ope_ptr) ||
+                dynamic_cast<const Dictionary *>(ope_ptr);
+  program_.rules[id] = flat;
+  return ope;
+}
+
+inline bool Definition::enable_flat_program() {
+  if (wordOpe) { return false; } // Literals would need the word check
+  initialize_definition_ids();
+
+  auto program = std::make_shared<FlatProgram>();
+  LowerToFlat vis(*program);
+  program->start = vis.rule(*this);
+  if (whitespaceOpe) { program->whitespace = vis.lower(*whitespaceOpe); }
+  if (!vis.ok) { return false; }
+
+  flat_program_ = program;
+  return true;
+}
+
 inline void DetectLeftRecursion::visit(Reference &ope) {
   if (ope.name_ == name_) {
     error_s = ope.s_;
@@ -4714,6 +5982,52 @@ public:
     }
   }
 
+  // Work out which bytes each alternative of every choice can start with,
+  // so that alternatives that can't match at the next byte are skipped
+  // rather than tried. Call once the grammar is loaded and before parsing.
+  void enable_first_char_dispatch() {
+    if (grammar_ == nullptr) { return; }
+
+    // Rules refer to each other, so go round until nothing changes
+    FirstSets rules;
+    for (auto changed = true; changed;) {
+      changed = false;
+      for (auto &[name, rule] : *grammar_) {
+        ComputeFirstSet vis(rules);
+        rule.get_core_operator()->accept(vis);
+        auto &first = rules[&rule];
+        if (!(vis.result == first)) {
+          first = vis.result;
+          changed = true;
+        }
+      }
+    }
+
+    for (auto &[name, rule] : *grammar_) {
+      SetFirstCharDispatch vis(rules);
+      rule.get_core_operator()->accept(vis);
+    }
+    (*grammar_)[start_].enableFirstCharDispatch = true;
+  }
+
+  // Match %whitespace with 'fn' rather than with the grammar's own rule, on
+  // every parse that isn't collecting errors. It must match exactly what the
+  // rule would: the operators still run to report syntax errors.
+  void set_whitespace_skipper(WhitespaceSkipper fn) {
+    if (grammar_ != nullptr) {
+      (*grammar_)[start_].whitespaceSkipper = std::move(fn);
+    }
+  }
+
+  // Run AST parses (see Definition::parse_ast()) on the grammar lowered into
+  // a FlatProgram rather than on its operators. Call once the grammar is
+  // loaded, after enable_first_char_dispatch() if it's used, and before
+  // parsing. Returns false if the grammar can't be lowered.
+  bool enable_flat_program() {
+    if (grammar_ == nullptr) { return false; }
+    return (*grammar_)[start_].enable_flat_program();
+  }
+
   void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave) {
     if (grammar_ != nullptr) {
       auto &rule = (*grammar_)[start_];
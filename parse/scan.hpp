@@ -0,0 +1,76 @@
+//
+//  scan.hpp
+//
+//  VHDL 2008 scanner
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The lexical elements of section 15 of the LRM, roughly: the scanner only
+// has to find where tokens start and end, so a few of these (abstract
+// literals in particular) are recognised more loosely than the grammar does
+enum class Vhdl2008TokenKind : uint8_t {
+  Identifier,         // Basic identifiers, including reserved words
+  ExtendedIdentifier, // \like this\ .
+  AbstractLiteral,    // 42, 1.0E-3, 16#FF#
+  CharacterLiteral,   // 'x'
+  StringLiteral,      // "text"
+  BitStringLiteral,   // X"FF", 12UB"0101"
+  Delimiter,          // Simple and compound delimiters, including the tick
+  Other,              // Anything the grammar will have to reject
+  EndOfInput,         // Empty, after the last whitespace
+};
+
+// The tokens of a source file, in order, as parallel arrays: the parser
+// searches the offsets without needing the rest. The text in front of each
+// token, back to the end of the previous one, is whitespace and comments --
+// exactly what the grammar's %whitespace rule would match there.
+struct Vhdl2008Tokens {
+  std::vector<uint32_t> begins;
+  std::vector<uint32_t> ends;
+  std::vector<Vhdl2008TokenKind> kinds;
+
+  size_t size() const { return kinds.size(); }
+};
+
+// Split 'n' bytes of VHDL into 'tokens', replacing what was there. Returns
+// false, leaving 'tokens' empty, if the input is too big for 32-bit offsets.
+bool scan_vhdl_2008(const char *s, size_t n, Vhdl2008Tokens &tokens);
+
+// The length of the whitespace and comments at the start of 's', exactly
+// as the grammar's %whitespace rule would match them, found with the
+// scanner's byte searches rather than a character at a time
+size_t skip_vhdl_2008_whitespace(const char *s, size_t n);
+
+// Offsets where a design unit looks likely to start: the first token, and
+// any reserved word that can begin a unit's context clause or library unit
+// if it's at the start of a line and follows an "end ... ;". This is only a
+// guess (nothing is parsed), so use it where a wrong answer costs time
+// rather than correctness.
+std::vector<uint32_t> find_vhdl_2008_units(const char *s,
+                                           const Vhdl2008Tokens &tokens);
@@ -0,0 +1,392 @@
+//
+//  scan_vhdl_2008.cpp
+//
+//  VHDL 2008 scanner
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <cstring>
+#include <limits>
+using namespace std;
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VHDL_SCAN_SSE2
+#endif
+
+#include "peglib.h"
+#include "scan.hpp"
+
+namespace {
+
+constexpr size_t NONE = static_cast<size_t>(-1);
+
+inline bool is_letter(unsigned char c) {
+  return static_cast<unsigned char>((c | 0x20) - 'a') < 26;
+}
+
+inline bool is_digit(unsigned char c) {
+  return static_cast<unsigned char>(c - '0') < 10;
+}
+
+inline bool is_word(unsigned char c) {
+  return is_letter(c) || is_digit(c) || c == '_';
+}
+
+inline bool is_blank(unsigned char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// The byte searches below look at 16 bytes at a time where SSE2 is
+// available: 'mask' returns a bit for each byte of a block that stops the
+// search, and 'stop' answers the same question for the odd bytes at the end.
+#ifdef VHDL_SCAN_SSE2
+inline __m128i bytes_in_range(__m128i v, char lo, char count) {
+  // Unsigned (v - lo) < count, done as a signed compare
+  auto biased = _mm_add_epi8(v, _mm_set1_epi8(static_cast<char>(0x80 - lo)));
+  return _mm_cmplt_epi8(biased, _mm_set1_epi8(static_cast<char>(-128 + count)));
+}
+
+inline __m128i bytes_equal(__m128i v, char c) {
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+#endif
+
+template <typename Mask, typename Stop>
+inline size_t find_byte(const char *s, size_t i, size_t n, Mask mask,
+                        Stop stop) {
+#ifdef VHDL_SCAN_SSE2
+  for (; i + 16 <= n; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+    auto bits = static_cast<unsigned>(mask(v));
+    if (bits) {
+#if defined(__GNUC__) || defined(__clang__)
+      return i + static_cast<size_t>(__builtin_ctz(bits));
+#else
+      unsigned k = 0;
+      while (!(bits & (1u << k))) { k++; }
+      return i + k;
+#endif
+    }
+  }
+#else
+  (void)mask;
+#endif
+  while (i < n && !stop(static_cast<unsigned char>(s[i]))) { i++; }
+  return i;
+}
+
+// First byte at or after 'i' that isn't a space, tab or line ending
+size_t skip_blanks(const char *s, size_t i, size_t n) {
+  return find_byte(
+      s, i, n,
+#ifdef VHDL_SCAN_SSE2
+      [](__m128i v) {
+        auto blank = _mm_or_si128(
+            _mm_or_si128(bytes_equal(v, ' '), bytes_equal(v, '\t')),
+            _mm_or_si128(bytes_equal(v, '\n'), bytes_equal(v, '\r')));
+        return _mm_movemask_epi8(blank) ^ 0xFFFF;
+      },
+#else
+      nullptr,
+#endif
+      [](unsigned char c) { return !is_blank(c); });
+}
+
+// First line ending or non-ASCII byte
+size_t find_line_end(const char *s, size_t i, size_t n) {
+  return find_byte(
+      s, i, n,
+#ifdef VHDL_SCAN_SSE2
+      [](__m128i v) {
+        auto eol = _mm_or_si128(bytes_equal(v, '\n'), bytes_equal(v, '\r'));
+        return _mm_movemask_epi8(eol) | _mm_movemask_epi8(v);
+      },
+#else
+      nullptr,
+#endif
+      [](unsigned char c) { return c == '\n' || c == '\r' || c >= 0x80; });
+}
+
+// First '*' or non-ASCII byte
+size_t find_star(const char *s, size_t i, size_t n) {
+  return find_byte(
+      s, i, n,
+#ifdef VHDL_SCAN_SSE2
+      [](__m128i v) {
+        return _mm_movemask_epi8(bytes_equal(v, '*')) | _mm_movemask_epi8(v);
+      },
+#else
+      nullptr,
+#endif
+      [](unsigned char c) { return c == '*' || c >= 0x80; });
+}
+
+// First byte that can't be part of a basic identifier
+size_t skip_word(const char *s, size_t i, size_t n) {
+  return find_byte(
+      s, i, n,
+#ifdef VHDL_SCAN_SSE2
+      [](__m128i v) {
+        auto word = _mm_or_si128(
+            _mm_or_si128(
+                bytes_in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 26),
+                bytes_in_range(v, '0', 10)),
+            bytes_equal(v, '_'));
+        return _mm_movemask_epi8(word) ^ 0xFFFF;
+      },
+#else
+      nullptr,
+#endif
+      [](unsigned char c) { return !is_word(c); });
+}
+
+// Comment_93 <- '--' (!EndOfLine .)* EndOfLine, from just after the '--'.
+// '.' steps over whole UTF-8 sequences the way peglib decodes them, which
+// can carry it over a line ending, and fails on a byte it can't decode.
+size_t line_comment_end(const char *s, size_t i, size_t n) {
+  for (;;) {
+    i = find_line_end(s, i, n);
+    if (i == n) { return NONE; }
+    if (s[i] == '\n') { return i + 1; }
+    if (s[i] == '\r') { return i + 1 < n && s[i + 1] == '\n' ? i + 2 : i + 1; }
+    auto len = peg::codepoint_length(s + i, n - i);
+    if (len == 0) { return NONE; }
+    i += len;
+  }
+}
+
+// Comment_2008 <- "/*" (!"*/" .)* "*/", from just after the "/*"
+size_t block_comment_end(const char *s, size_t i, size_t n) {
+  for (;;) {
+    i = find_star(s, i, n);
+    if (i == n) { return NONE; }
+    if (s[i] == '*') {
+      if (i + 1 < n && s[i + 1] == '/') { return i + 2; }
+      i++;
+      continue;
+    }
+    auto len = peg::codepoint_length(s + i, n - i);
+    if (len == 0) { return NONE; }
+    i += len;
+  }
+}
+
+// ~_ <- ( Comment / Space )*
+size_t skip_whitespace(const char *s, size_t i, size_t n) {
+  for (;;) {
+    i = skip_blanks(s, i, n);
+    if (i + 1 >= n) { return i; }
+
+    size_t end = NONE;
+    if (s[i] == '-' && s[i + 1] == '-') {
+      end = line_comment_end(s, i + 2, n);
+    } else if (s[i] == '/' && s[i + 1] == '*') {
+      end = block_comment_end(s, i + 2, n);
+    }
+    if (end == NONE) { return i; }
+    i = end;
+  }
+}
+
+// A string, bit string value or extended identifier from its opening
+// 'quote': doubled quotes stand for one, and it can't run past the line
+size_t quoted_end(const char *s, size_t i, size_t n, char quote) {
+  for (i++; i < n; i++) {
+    if (s[i] == '\n' || s[i] == '\r') { return i; }
+    if (s[i] == quote) {
+      if (i + 1 < n && s[i + 1] == quote) {
+        i++;
+      } else {
+        return i + 1;
+      }
+    }
+  }
+  return n;
+}
+
+bool is_base_specifier(const char *s, size_t len) {
+  static const char *const bases[] = {"b",  "o",  "x",  "d",  "ub",
+                                      "uo", "ux", "sb", "so", "sx"};
+  for (auto base : bases) {
+    if (strlen(base) != len) { continue; }
+    size_t k = 0;
+    while (k < len && (s[k] | 0x20) == base[k]) { k++; }
+    if (k == len) { return true; }
+  }
+  return false;
+}
+
+// 42, 1_000.5E-3, 16#FF_FF#E+2 or a size-prefixed bit string like 12UB"01"
+size_t number_end(const char *s, size_t i, size_t n,
+                  Vhdl2008TokenKind &kind) {
+  kind = Vhdl2008TokenKind::AbstractLiteral;
+  i = skip_word(s, i, n);
+  if (i < n && s[i] == '"') {
+    kind = Vhdl2008TokenKind::BitStringLiteral;
+    return quoted_end(s, i, n, '"');
+  }
+  if (i + 1 < n && s[i] == '#') {
+    i++;
+    while (i < n && (is_word(static_cast<unsigned char>(s[i])) || s[i] == '.')) {
+      i++;
+    }
+    if (i < n && s[i] == '#') { i++; }
+    if (i < n && (s[i] | 0x20) == 'e') { i = skip_word(s, i, n); }
+  } else if (i + 1 < n && s[i] == '.' &&
+             is_digit(static_cast<unsigned char>(s[i + 1]))) {
+    i = skip_word(s, i + 1, n);
+  }
+  if ((s[i - 1] | 0x20) == 'e' && i + 1 < n && (s[i] == '+' || s[i] == '-') &&
+      is_digit(static_cast<unsigned char>(s[i + 1]))) {
+    i = skip_word(s, i + 1, n);
+  }
+  return i;
+}
+
+size_t delimiter_length(const char *s, size_t i, size_t n) {
+  static const char *const compound[] = {
+      "?/=", "?<=", "?>=", "=>", "**", ":=", "/=", ">=", "<=",
+      "<>",  "??",  "?=",  "?<", "?>", "<<", ">>"};
+  for (auto d : compound) {
+    auto len = strlen(d);
+    if (i + len <= n && memcmp(s + i, d, len) == 0) { return len; }
+  }
+  return strchr("&'()*+,-./:;<=>`|[]?@", s[i]) && s[i] ? 1 : 0;
+}
+
+} // namespace
+
+bool scan_vhdl_2008(const char *s, size_t n, Vhdl2008Tokens &tokens) {
+  tokens.begins.clear();
+  tokens.ends.clear();
+  tokens.kinds.clear();
+  if (n > numeric_limits<uint32_t>::max()) { return false; }
+
+  // Source averages a token every four or five bytes
+  tokens.begins.reserve(n / 4);
+  tokens.ends.reserve(n / 4);
+  tokens.kinds.reserve(n / 4);
+
+  auto push = [&](size_t begin, size_t end, Vhdl2008TokenKind kind) {
+    tokens.begins.push_back(static_cast<uint32_t>(begin));
+    tokens.ends.push_back(static_cast<uint32_t>(end));
+    tokens.kinds.push_back(kind);
+  };
+
+  // A tick straight after a name or a closing bracket starts an attribute
+  // or a qualified expression, not a character literal
+  bool after_name = false;
+
+  auto i = skip_whitespace(s, 0, n);
+  while (i < n) {
+    auto c = static_cast<unsigned char>(s[i]);
+    auto kind = Vhdl2008TokenKind::Delimiter;
+    size_t end;
+
+    if (is_letter(c)) {
+      kind = Vhdl2008TokenKind::Identifier;
+      end = skip_word(s, i + 1, n);
+      if (end < n && s[end] == '"' && is_base_specifier(s + i, end - i)) {
+        kind = Vhdl2008TokenKind::BitStringLiteral;
+        end = quoted_end(s, end, n, '"');
+      }
+    } else if (is_digit(c)) {
+      end = number_end(s, i, n, kind);
+    } else if (c == '"') {
+      kind = Vhdl2008TokenKind::StringLiteral;
+      end = quoted_end(s, i, n, '"');
+    } else if (c == '\\') {
+      kind = Vhdl2008TokenKind::ExtendedIdentifier;
+      end = quoted_end(s, i, n, '\\');
+    } else if (c == '\'' && !after_name && i + 2 < n && s[i + 2] == '\'') {
+      kind = Vhdl2008TokenKind::CharacterLiteral;
+      end = i + 3;
+    } else if (auto len = delimiter_length(s, i, n)) {
+      end = i + len;
+    } else {
+      kind = Vhdl2008TokenKind::Other;
+      end = i + max<size_t>(peg::codepoint_length(s + i, n - i), 1);
+    }
+
+    push(i, end, kind);
+    after_name = kind == Vhdl2008TokenKind::Identifier ||
+                 kind == Vhdl2008TokenKind::ExtendedIdentifier ||
+                 (end == i + 1 && (c == ')' || c == ']'));
+    i = skip_whitespace(s, end, n);
+  }
+  push(n, n, Vhdl2008TokenKind::EndOfInput);
+  return true;
+}
+
+size_t skip_vhdl_2008_whitespace(const char *s, size_t n) {
+  return skip_whitespace(s, 0, n);
+}
+
+vector<uint32_t> find_vhdl_2008_units(const char *s,
+                                      const Vhdl2008Tokens &tokens) {
+  static const char *const starts[] = {"library",      "use",
+                                       "context",      "entity",
+                                       "architecture", "package",
+                                       "configuration"};
+  auto is_word = [&](size_t id, const char *word) {
+    auto len = tokens.ends[id] - tokens.begins[id];
+    if (tokens.kinds[id] != Vhdl2008TokenKind::Identifier ||
+        len != strlen(word)) {
+      return false;
+    }
+    for (size_t k = 0; k < len; k++) {
+      if ((s[tokens.begins[id] + k] | 0x20) != word[k]) { return false; }
+    }
+    return true;
+  };
+
+  vector<uint32_t> units;
+  if (tokens.size() > 1) { units.push_back(tokens.begins[0]); }
+
+  bool statement_start = true;
+  bool statement_is_end = false; // The statement being read begins "end"
+  bool after_end = false;        // The last full statement began "end"
+  for (size_t id = 0; id + 1 < tokens.size(); id++) {
+    auto begin = tokens.begins[id];
+    if (statement_start) {
+      if (after_end && id > 0 && (s[begin - 1] == '\n' || s[begin - 1] == '\r')) {
+        for (auto word : starts) {
+          if (is_word(id, word)) {
+            units.push_back(begin);
+            break;
+          }
+        }
+      }
+      statement_is_end = is_word(id, "end");
+      statement_start = false;
+    }
+    if (tokens.kinds[id] == Vhdl2008TokenKind::Delimiter &&
+        tokens.ends[id] == begin + 1 && s[begin] == ';') {
+      after_end = statement_is_end;
+      statement_start = true;
+    }
+  }
+  return units;
+}
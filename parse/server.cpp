@@ -0,0 +1,1128 @@
+//
+//  server.cpp
+//
+//  Parsing as a service, over JSON-RPC
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+using namespace std;
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#ifndef _WIN32
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "ast_stream.hpp"
+#include "incremental.hpp"
+#include "server.hpp"
+#include "source_file.hpp"
+
+namespace {
+
+// Just as much JSON as JSON-RPC needs. Numbers are doubles, and objects
+// keep their members in the order they were given.
+struct Json {
+  enum Type { Null, Bool, Number, String, Array, Object };
+
+  Type type = Null;
+  bool boolean = false;
+  double number = 0;
+  string text;
+  vector<Json> items;
+  vector<pair<string, Json>> members;
+
+  Json() = default;
+  Json(bool b) : type(Bool), boolean(b) {}
+  template <typename T,
+            typename = enable_if_t<is_arithmetic_v<T> && !is_same_v<T, bool>>>
+  Json(T n) : type(Number), number(static_cast<double>(n)) {}
+  Json(string s) : type(String), text(move(s)) {}
+  Json(string_view s) : type(String), text(s) {}
+  Json(const char *s) : type(String), text(s) {}
+
+  static Json array() {
+    Json json;
+    json.type = Array;
+    return json;
+  }
+
+  static Json object() {
+    Json json;
+    json.type = Object;
+    return json;
+  }
+
+  // The member called 'key', or null if there isn't one
+  const Json *get(string_view key) const {
+    for (auto &member : members) {
+      if (member.first == key) { return &member.second; }
+    }
+    return nullptr;
+  }
+
+  Json &set(string key, Json value) {
+    members.emplace_back(move(key), move(value));
+    return *this;
+  }
+
+  Json &push(Json value) {
+    items.push_back(move(value));
+    return *this;
+  }
+};
+
+class JsonReader {
+public:
+  explicit JsonReader(string_view s) : p_(s.data()), end_(s.data() + s.size()) {}
+
+  // False unless all of the text is one value
+  bool read(Json &json) {
+    if (!value(json, 0)) { return false; }
+    space();
+    return p_ == end_;
+  }
+
+private:
+  static constexpr int max_depth = 256;
+
+  void space() {
+    while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+      p_++;
+    }
+  }
+
+  bool literal(const char *word) {
+    auto n = strlen(word);
+    if (static_cast<size_t>(end_ - p_) < n || memcmp(p_, word, n) != 0) {
+      return false;
+    }
+    p_ += n;
+    return true;
+  }
+
+  bool value(Json &json, int depth) {
+    space();
+    if (p_ == end_ || depth > max_depth) { return false; }
+    switch (*p_) {
+    case '{': return object(json, depth);
+    case '[': return array(json, depth);
+    case '"': json.type = Json::String; return string_value(json.text);
+    case 't': json = Json(true); return literal("true");
+    case 'f': json = Json(false); return literal("false");
+    case 'n': json = Json(); return literal("null");
+    default: return number(json);
+    }
+  }
+
+  bool object(Json &json, int depth) {
+    json = Json::object();
+    p_++;
+    space();
+    if (p_ < end_ && *p_ == '}') {
+      p_++;
+      return true;
+    }
+    while (true) {
+      string key;
+      Json member;
+      space();
+      if (p_ == end_ || *p_ != '"' || !string_value(key)) { return false; }
+      space();
+      if (p_ == end_ || *p_++ != ':' || !value(member, depth + 1)) {
+        return false;
+      }
+      json.set(move(key), move(member));
+      space();
+      if (p_ == end_) { return false; }
+      auto c = *p_++;
+      if (c == '}') { return true; }
+      if (c != ',') { return false; }
+    }
+  }
+
+  bool array(Json &json, int depth) {
+    json = Json::array();
+    p_++;
+    space();
+    if (p_ < end_ && *p_ == ']') {
+      p_++;
+      return true;
+    }
+    while (true) {
+      Json item;
+      if (!value(item, depth + 1)) { return false; }
+      json.push(move(item));
+      space();
+      if (p_ == end_) { return false; }
+      auto c = *p_++;
+      if (c == ']') { return true; }
+      if (c != ',') { return false; }
+    }
+  }
+
+  bool hex4(uint32_t &v) {
+    if (end_ - p_ < 4) { return false; }
+    v = 0;
+    for (int i = 0; i < 4; i++) {
+      auto c = *p_++;
+      v <<= 4;
+      if (c >= '0' && c <= '9') {
+        v |= static_cast<uint32_t>(c - '0');
+      } else if (c >= 'a' && c <= 'f') {
+        v |= static_cast<uint32_t>(c - 'a' + 10);
+      } else if (c >= 'A' && c <= 'F') {
+        v |= static_cast<uint32_t>(c - 'A' + 10);
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void append_utf8(string &s, uint32_t cp) {
+    if (cp < 0x80) {
+      s += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      s += static_cast<char>(0xc0 | (cp >> 6));
+      s += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+      s += static_cast<char>(0xe0 | (cp >> 12));
+      s += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+      s += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+      s += static_cast<char>(0xf0 | (cp >> 18));
+      s += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+      s += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+      s += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+  }
+
+  bool string_value(string &s) {
+    p_++;
+    while (p_ < end_) {
+      // Copy everything up to the next quote or escape in one go
+      auto start = p_;
+      while (p_ < end_ && *p_ != '"' && *p_ != '\\' &&
+             static_cast<unsigned char>(*p_) >= 0x20) {
+        p_++;
+      }
+      s.append(start, p_);
+      if (p_ == end_) { return false; }
+
+      auto c = *p_++;
+      if (c == '"') { return true; }
+      if (c != '\\' || p_ == end_) { return false; }
+      switch (*p_++) {
+      case '"': s += '"'; break;
+      case '\\': s += '\\'; break;
+      case '/': s += '/'; break;
+      case 'b': s += '\b'; break;
+      case 'f': s += '\f'; break;
+      case 'n': s += '\n'; break;
+      case 'r': s += '\r'; break;
+      case 't': s += '\t'; break;
+      case 'u': {
+        uint32_t cp, low;
+        if (!hex4(cp)) { return false; }
+        if (cp >= 0xd800 && cp <= 0xdbff && end_ - p_ >= 6 && p_[0] == '\\' &&
+            p_[1] == 'u') {
+          auto mark = p_;
+          p_ += 2;
+          if (hex4(low) && low >= 0xdc00 && low <= 0xdfff) {
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+          } else {
+            p_ = mark;
+          }
+        }
+        append_utf8(s, cp);
+        break;
+      }
+      default: return false;
+      }
+    }
+    return false;
+  }
+
+  bool number(Json &json) {
+    auto start = p_;
+    while (p_ < end_ && (isdigit(static_cast<unsigned char>(*p_)) || *p_ == '-' ||
+                         *p_ == '+' || *p_ == '.' || *p_ == 'e' || *p_ == 'E')) {
+      p_++;
+    }
+    if (p_ == start) { return false; }
+    string digits(start, p_);
+    char *end;
+    json = Json(strtod(digits.c_str(), &end));
+    return *end == '\0';
+  }
+
+  const char *p_;
+  const char *end_;
+};
+
+void write_json(const Json &json, string &out) {
+  switch (json.type) {
+  case Json::Null: out += "null"; break;
+  case Json::Bool: out += json.boolean ? "true" : "false"; break;
+  case Json::Number: {
+    char digits[32];
+    auto n = json.number;
+    if (!isfinite(n)) {
+      out += "null";
+    } else if (n == floor(n) && fabs(n) < 9007199254740992.0) {
+      snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(n));
+      out += digits;
+    } else {
+      snprintf(digits, sizeof(digits), "%.17g", n);
+      out += digits;
+    }
+    break;
+  }
+  case Json::String: peg::append_json_string(out, json.text); break;
+  case Json::Array: {
+    out += '[';
+    for (size_t i = 0; i < json.items.size(); i++) {
+      if (i > 0) { out += ','; }
+      write_json(json.items[i], out);
+    }
+    out += ']';
+    break;
+  }
+  case Json::Object: {
+    out += '{';
+    for (size_t i = 0; i < json.members.size(); i++) {
+      if (i > 0) { out += ','; }
+      peg::append_json_string(out, json.members[i].first);
+      out += ':';
+      write_json(json.members[i].second, out);
+    }
+    out += '}';
+    break;
+  }
+  }
+}
+
+// What a request did wrong, as a JSON-RPC error
+struct RpcError {
+  int code;
+  string message;
+};
+
+constexpr int PARSE_ERROR = -32700;
+constexpr int INVALID_REQUEST = -32600;
+constexpr int METHOD_NOT_FOUND = -32601;
+constexpr int INVALID_PARAMS = -32602;
+constexpr int SERVER_ERROR = -32000; // A file can't be read, say
+
+const Json &param(const Json &params, const char *name, Json::Type type) {
+  auto value = params.get(name);
+  if (!value || value->type != type) {
+    throw RpcError{INVALID_PARAMS, string("missing or mistyped parameter '") +
+                                       name + "'"};
+  }
+  return *value;
+}
+
+size_t size_param(const Json &params, const char *name) {
+  auto n = param(params, name, Json::Number).number;
+  if (n < 0 || n != floor(n) || n > 4294967295.0) {
+    throw RpcError{INVALID_PARAMS, string("parameter '") + name +
+                                       "' isn't a byte count"};
+  }
+  return static_cast<size_t>(n);
+}
+
+// Where responses to a client go. A client's requests can be answered on
+// several threads, so each response is sent whole.
+class Connection {
+public:
+  virtual ~Connection() = default;
+  virtual void send(const string &line) = 0;
+};
+
+class StreamConnection : public Connection {
+public:
+  explicit StreamConnection(ostream &os) : os_(os) {}
+
+  void send(const string &line) override {
+    lock_guard<mutex> lock(mutex_);
+    os_.write(line.data(), static_cast<streamsize>(line.size()));
+    os_.flush();
+  }
+
+private:
+  ostream &os_;
+  mutex mutex_;
+};
+
+#ifndef _WIN32
+class SocketConnection : public Connection {
+public:
+  explicit SocketConnection(int fd) : fd_(fd) {}
+  ~SocketConnection() override { ::close(fd_); }
+
+  int fd() const { return fd_; }
+
+  void send(const string &line) override {
+    lock_guard<mutex> lock(mutex_);
+    auto p = line.data();
+    auto n = line.size();
+    while (n > 0) {
+      auto sent = ::send(fd_, p, n, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR) { continue; }
+      if (sent <= 0) { return; } // The client has gone
+      p += sent;
+      n -= static_cast<size_t>(sent);
+    }
+  }
+
+private:
+  int fd_;
+  mutex mutex_;
+};
+#endif
+
+} // namespace
+
+class Vhdl2008Server::State {
+public:
+  State(Vhdl2008Options options, unsigned jobs, size_t max_documents);
+  ~State();
+
+  // Answer 'line' on 'connection', now or once its file's earlier requests
+  // have been answered
+  void dispatch(const shared_ptr<Connection> &connection, string line);
+
+  // Wait until every request so far has been answered
+  void drain();
+
+  string call(string_view line);
+
+  bool stopping() const { return stopping_; }
+
+  Stats stats() const;
+
+private:
+  struct Document {
+    explicit Document(const Vhdl2008Options &options) : doc(options) {}
+
+    Vhdl2008Document doc;
+    bool loaded = false;
+    bool pinned = false; // Opened by a client, so not read from disk;
+                         // only changed under mutex_
+    fs::file_time_type time;
+    uintmax_t size = 0;
+    Json errors = Json::array();
+    uint64_t used = 0;
+  };
+
+  // Requests about one file, run in order on whichever thread is free
+  struct Strand {
+    deque<function<void()>> jobs;
+  };
+
+  void work();
+  void submit(const string &key, function<void()> job);
+
+  string respond(const Json &request);
+  Json run(const string &method, const Json &params);
+  Json run_document(const string &method, const Json &params,
+                    const string &path);
+
+  shared_ptr<Document> document(const string &path, bool pin = false);
+  void forget(const string &path);
+  bool update(Document &document, const string &path, string text);
+  bool load(Document &document, const string &path);
+  Json parse_result(Document &document, const string &path, bool parsed,
+                    const Json &params);
+
+  Vhdl2008Options options_;
+  size_t max_documents_;
+
+  mutable mutex mutex_;
+  condition_variable work_ready_;
+  condition_variable idle_;
+  map<string, shared_ptr<Document>> documents_;
+  map<string, Strand> strands_;
+  deque<string> ready_;  // Strands with work that no thread has taken
+  size_t pending_ = 0;   // Requests queued or running
+  uint64_t clock_ = 0;   // For finding the least recently used document
+  bool quitting_ = false;
+  vector<thread> workers_;
+
+  atomic<bool> stopping_{false};
+  atomic<size_t> requests_{0};
+  atomic<size_t> errors_{0};
+  atomic<size_t> full_parses_{0};
+  atomic<size_t> reparses_{0};
+  atomic<size_t> unchanged_{0};
+};
+
+Vhdl2008Server::State::State(Vhdl2008Options options, unsigned jobs,
+                             size_t max_documents)
+    : options_(options), max_documents_(max(size_t(1), max_documents)) {
+  // Documents are parsed in one piece, and the server does its own output
+  options_.threads = 1;
+  options_.cache = nullptr;
+  options_.stream = false;
+
+  // Get any one-off set-up out of the way before the first request
+  auto &parser = Vhdl2008Parser::instance();
+  if (options_.engine == Vhdl2008Engine::Interpreter) {
+    peg::CompactAst tree;
+    parser.parse("", 0, tree, nullptr, nullptr, options_);
+  }
+
+  for (unsigned i = 0; i < max(1u, jobs); i++) {
+    workers_.emplace_back([this] { work(); });
+  }
+}
+
+Vhdl2008Server::State::~State() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    quitting_ = true;
+  }
+  work_ready_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+void Vhdl2008Server::State::work() {
+  unique_lock<mutex> lock(mutex_);
+  while (true) {
+    work_ready_.wait(lock, [this] { return quitting_ || !ready_.empty(); });
+    if (ready_.empty()) { return; }
+
+    // Run the strand's next job, leaving it at the front of the queue so
+    // that nothing else starts on the strand in the meantime
+    auto key = move(ready_.front());
+    ready_.pop_front();
+    auto &job = strands_[key].jobs.front();
+    lock.unlock();
+    job();
+    lock.lock();
+
+    auto &strand = strands_[key];
+    strand.jobs.pop_front();
+    if (strand.jobs.empty()) {
+      strands_.erase(key);
+    } else {
+      ready_.push_back(key);
+      work_ready_.notify_one();
+    }
+    if (--pending_ == 0) { idle_.notify_all(); }
+  }
+}
+
+void Vhdl2008Server::State::submit(const string &key, function<void()> job) {
+  lock_guard<mutex> lock(mutex_);
+  pending_++;
+  auto &strand = strands_[key];
+  strand.jobs.push_back(move(job));
+  if (strand.jobs.size() == 1) {
+    ready_.push_back(key);
+    work_ready_.notify_one();
+  }
+}
+
+void Vhdl2008Server::State::drain() {
+  unique_lock<mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return pending_ == 0; });
+}
+
+static Json response(const Json &id) {
+  return Json::object().set("jsonrpc", "2.0").set("id", id);
+}
+
+static string error_response(const Json &id, const RpcError &error) {
+  auto json = response(id).set(
+      "error",
+      Json::object().set("code", error.code).set("message", error.message));
+  string line;
+  write_json(json, line);
+  line += '\n';
+  return line;
+}
+
+// The file a request is about, if it's about one
+static const Json *request_path(const Json &request) {
+  auto params = request.get("params");
+  auto path = params && params->type == Json::Object ? params->get("path")
+                                                     : nullptr;
+  return path && path->type == Json::String ? path : nullptr;
+}
+
+void Vhdl2008Server::State::dispatch(const shared_ptr<Connection> &connection,
+                                     string line) {
+  auto request = make_shared<Json>();
+  if (!JsonReader(line).read(*request)) {
+    requests_++;
+    errors_++;
+    connection->send(error_response(Json(), {PARSE_ERROR, "not valid JSON"}));
+    return;
+  }
+
+  auto answer = [this, connection, request] {
+    auto reply = respond(*request);
+    if (!reply.empty()) { connection->send(reply); }
+  };
+  if (auto path = request_path(*request)) {
+    submit(path->text, move(answer));
+  } else {
+    answer();
+  }
+}
+
+string Vhdl2008Server::State::call(string_view line) {
+  Json request;
+  if (!JsonReader(line).read(request)) {
+    requests_++;
+    errors_++;
+    return error_response(Json(), {PARSE_ERROR, "not valid JSON"});
+  }
+
+  // Go through the file's strand all the same, so that a call is ordered
+  // with any requests about the same file that are being served
+  auto path = request_path(request);
+  if (!path) { return respond(request); }
+  promise<string> reply;
+  submit(path->text, [&] { reply.set_value(respond(request)); });
+  return reply.get_future().get();
+}
+
+string Vhdl2008Server::State::respond(const Json &request) {
+  requests_++;
+  Json id;
+  auto id_value = request.get("id");
+  if (id_value) { id = *id_value; }
+
+  // Notifications aren't answered, even with an error, but anything that
+  // isn't a request at all is
+  auto answer = true;
+  try {
+    auto version = request.get("jsonrpc");
+    auto method = request.get("method");
+    auto params = request.get("params");
+    if (request.type != Json::Object || !version ||
+        version->type != Json::String || version->text != "2.0" || !method ||
+        method->type != Json::String ||
+        (params && params->type != Json::Object)) {
+      throw RpcError{INVALID_REQUEST,
+                     request.type == Json::Array
+                         ? "batches aren't supported"
+                         : "not a JSON-RPC 2.0 request with named parameters"};
+    }
+    answer = id_value != nullptr;
+
+    auto result = run(method->text, params ? *params : Json::object());
+    if (!answer) { return {}; }
+    string line;
+    write_json(response(id).set("result", move(result)), line);
+    line += '\n';
+    return line;
+  } catch (const RpcError &error) {
+    errors_++;
+    return answer ? error_response(id, error) : string();
+  } catch (const exception &e) {
+    errors_++;
+    return answer ? error_response(id, {SERVER_ERROR, e.what()}) : string();
+  }
+}
+
+Json Vhdl2008Server::State::run(const string &method, const Json &params) {
+  if (method == "stats") {
+    auto s = stats();
+    return Json::object()
+        .set("requests", s.requests)
+        .set("errors", s.errors)
+        .set("documents", s.documents)
+        .set("full_parses", s.full_parses)
+        .set("reparses", s.reparses)
+        .set("unchanged", s.unchanged);
+  }
+  if (method == "shutdown") {
+    stopping_ = true;
+    return Json();
+  }
+  if (method == "parse" || method == "open" || method == "change" ||
+      method == "close" || method == "outline" || method == "node_at") {
+    return run_document(method, params,
+                        param(params, "path", Json::String).text);
+  }
+  throw RpcError{METHOD_NOT_FOUND, "no method '" + method + "'"};
+}
+
+shared_ptr<Vhdl2008Server::State::Document>
+Vhdl2008Server::State::document(const string &path, bool pin) {
+  lock_guard<mutex> lock(mutex_);
+  auto &document = documents_[path];
+  if (!document) { document = make_shared<Document>(options_); }
+  document->used = ++clock_;
+  document->pinned = document->pinned || pin;
+
+  // Forget the least recently used file read from disk if there are too
+  // many, but not one that a request is still waiting on
+  size_t unpinned = 0;
+  for (auto &entry : documents_) {
+    unpinned += entry.second->pinned ? 0 : 1;
+  }
+  if (unpinned > max_documents_) {
+    auto oldest = documents_.end();
+    for (auto it = documents_.begin(); it != documents_.end(); ++it) {
+      if (!it->second->pinned && strands_.count(it->first) == 0 &&
+          (oldest == documents_.end() ||
+           it->second->used < oldest->second->used)) {
+        oldest = it;
+      }
+    }
+    if (oldest != documents_.end()) { documents_.erase(oldest); }
+  }
+  return document;
+}
+
+void Vhdl2008Server::State::forget(const string &path) {
+  lock_guard<mutex> lock(mutex_);
+  documents_.erase(path);
+}
+
+// A log that adds each syntax error to 'errors'
+static peg::Log error_log(Json &errors) {
+  return [&errors](size_t line, size_t col, const string &msg, const string &) {
+    errors.push(Json::object()
+                    .set("line", line)
+                    .set("col", col)
+                    .set("message", msg));
+  };
+}
+
+// Bring 'document' up to 'text', parsing only what changed; false if the
+// text is the same as before
+bool Vhdl2008Server::State::update(Document &document, const string &path,
+                                   string text) {
+  auto errors = Json::array();
+  auto log = error_log(errors);
+
+  if (!document.loaded) {
+    document.doc.open(move(text), path, log);
+    document.loaded = true;
+    full_parses_++;
+  } else {
+    auto &old = document.doc.text();
+    if (old == text) {
+      unchanged_++;
+      return false;
+    }
+
+    // Pass the edit on as the one run of bytes that differs
+    auto shorter = min(old.size(), text.size());
+    size_t prefix = 0;
+    while (prefix < shorter && old[prefix] == text[prefix]) {
+      prefix++;
+    }
+    size_t suffix = 0;
+    while (suffix < shorter - prefix &&
+           old[old.size() - 1 - suffix] == text[text.size() - 1 - suffix]) {
+      suffix++;
+    }
+    document.doc.edit(prefix, old.size() - prefix - suffix,
+                      string_view(text).substr(prefix, text.size() - prefix -
+                                                           suffix),
+                      log);
+    (document.doc.last_reparse().full ? full_parses_ : reparses_)++;
+  }
+  document.errors = move(errors);
+  return true;
+}
+
+// Read the file at 'path' into 'document', unless it hasn't changed since
+// the last time, or the client gave us its text; false if nothing needed
+// parsing
+bool Vhdl2008Server::State::load(Document &document, const string &path) {
+  if (document.pinned) {
+    unchanged_++;
+    return false;
+  }
+
+  error_code ec;
+  auto time = fs::last_write_time(path, ec);
+  auto size = ec ? 0 : fs::file_size(path, ec);
+  if (!ec && document.loaded && time == document.time &&
+      size == document.size) {
+    unchanged_++;
+    return false;
+  }
+
+  SourceFile file;
+  if (ec || !fs::is_regular_file(path, ec) || !file.open(path)) {
+    forget(path);
+    throw RpcError{SERVER_ERROR, "can't read " + path};
+  }
+  document.time = time;
+  document.size = size;
+  return update(document, path, string(file.data(), file.size()));
+}
+
+static Json reparse_json(const Vhdl2008Document::Reparse &reparse) {
+  return Json::object()
+      .set("full", reparse.full)
+      .set("bytes", reparse.parsed_bytes)
+      .set("units", reparse.parsed_units)
+      .set("kept", reparse.kept_units);
+}
+
+// The design units of 'tree', by node
+static vector<uint32_t> design_units(const peg::CompactAst &tree) {
+  vector<uint32_t> units;
+  if (tree.empty()) { return units; }
+  for (auto id = tree.first_child(0); id != peg::CompactAst::NO_NODE;
+       id = tree.next_sibling(id)) {
+    if (tree.name(tree[id]) != "design_file") { continue; }
+    for (auto unit = tree.first_child(id); unit != peg::CompactAst::NO_NODE;
+         unit = tree.next_sibling(unit)) {
+      units.push_back(unit);
+    }
+  }
+  return units;
+}
+
+Json Vhdl2008Server::State::parse_result(Document &document,
+                                         const string &path, bool parsed,
+                                         const Json &params) {
+  auto &doc = document.doc;
+  auto &tree = doc.tree();
+  auto result = Json::object()
+                    .set("path", path)
+                    .set("ok", document.errors.items.empty())
+                    .set("current", doc.current())
+                    .set("units", design_units(tree).size())
+                    .set("errors", document.errors);
+  if (parsed) { result.set("reparse", reparse_json(doc.last_reparse())); }
+
+  if (auto format = params.get("format")) {
+    if (format->type != Json::String ||
+        (format->text != "text" && format->text != "compact" &&
+         format->text != "jsonl")) {
+      throw RpcError{INVALID_PARAMS,
+                     "'format' must be \"text\", \"compact\" or \"jsonl\""};
+    }
+    ostringstream os;
+    if (!tree.empty()) {
+      peg::OutputBuffer out(os);
+      if (format->text == "jsonl") {
+        peg::JsonLinesSink sink(out);
+        peg::replay(tree, sink);
+      } else {
+        peg::write_text(tree, out, format->text == "text");
+      }
+    }
+    result.set("tree", os.str());
+  }
+  return result;
+}
+
+// The kind and name of each design unit, with where it starts
+static Json outline(const peg::CompactAst &tree) {
+  auto units = Json::array();
+  for (auto unit : design_units(tree)) {
+    // design_unit > library_unit > primary_unit or secondary_unit > the
+    // declaration or body itself
+    auto id = unit;
+    for (auto rule : {"library_unit", "", ""}) {
+      auto child = tree.first_child(id);
+      while (*rule && child != peg::CompactAst::NO_NODE &&
+             tree.name(tree[child]) != rule) {
+        child = tree.next_sibling(child);
+      }
+      if (child == peg::CompactAst::NO_NODE) { break; }
+      id = child;
+    }
+
+    // Its name is the first token of its first part that isn't a keyword
+    string_view name;
+    auto part = tree.first_child(id);
+    while (part != peg::CompactAst::NO_NODE && tree.is_token(tree[part])) {
+      part = tree.next_sibling(part);
+    }
+    for (; part != peg::CompactAst::NO_NODE; part = tree.first_child(part)) {
+      if (tree.is_token(tree[part])) {
+        name = tree.token(tree[part]);
+        break;
+      }
+    }
+
+    auto &node = tree[id];
+    auto line = tree.line_info(node);
+    units.push(Json::object()
+                   .set("kind", tree.name(node))
+                   .set("name", name)
+                   .set("line", line.first)
+                   .set("col", line.second)
+                   .set("offset", node.position)
+                   .set("length", node.length));
+  }
+  return units;
+}
+
+// The rules that match the byte at 'offset', outermost first
+static Json node_at(const peg::CompactAst &tree, size_t offset) {
+  auto rules = Json::array();
+  auto contains = [&](uint32_t id) {
+    auto &node = tree[id];
+    return node.position <= offset && offset < node.position + node.length;
+  };
+  auto id = tree.empty() || !contains(0) ? peg::CompactAst::NO_NODE : 0;
+  while (id != peg::CompactAst::NO_NODE) {
+    auto &node = tree[id];
+    auto rule = Json::object()
+                    .set("rule", tree.name(node))
+                    .set("offset", node.position)
+                    .set("length", node.length);
+    if (node.choice_count > 0) { rule.set("choice", node.choice); }
+    if (tree.is_token(node)) { rule.set("token", tree.token(node)); }
+    rules.push(move(rule));
+
+    auto child = tree.first_child(id);
+    while (child != peg::CompactAst::NO_NODE && !contains(child)) {
+      child = tree.next_sibling(child);
+    }
+    id = child;
+  }
+  return rules;
+}
+
+Json Vhdl2008Server::State::run_document(const string &method,
+                                         const Json &params,
+                                         const string &path) {
+  if (method == "close") {
+    forget(path);
+    return Json();
+  }
+
+  // Pinning happens under the lock, as other threads read 'pinned' when
+  // they look for a document to forget
+  auto entry = document(path, method == "open");
+  auto &doc = entry->doc;
+  auto parsed = false;
+  if (method == "open") {
+    parsed = update(*entry, path, param(params, "text", Json::String).text);
+  } else if (method == "change") {
+    if (!entry->pinned) {
+      forget(path);
+      throw RpcError{INVALID_PARAMS, path + " hasn't been opened"};
+    }
+    auto offset = size_param(params, "offset");
+    auto removed = size_param(params, "removed");
+    auto &text = param(params, "text", Json::String).text;
+    if (offset > doc.text().size() || removed > doc.text().size() - offset) {
+      throw RpcError{INVALID_PARAMS, "the edit is outside the text"};
+    }
+    auto errors = Json::array();
+    doc.edit(offset, removed, text, error_log(errors));
+    (doc.last_reparse().full ? full_parses_ : reparses_)++;
+    entry->errors = move(errors);
+    parsed = true;
+  } else {
+    parsed = load(*entry, path);
+  }
+
+  if (method == "outline") {
+    return Json::object()
+        .set("path", path)
+        .set("current", doc.current())
+        .set("units", outline(doc.tree()));
+  }
+  if (method == "node_at") {
+    return Json::object()
+        .set("path", path)
+        .set("current", doc.current())
+        .set("rules", node_at(doc.tree(), size_param(params, "offset")));
+  }
+  return parse_result(*entry, path, parsed, params);
+}
+
+Vhdl2008Server::Stats Vhdl2008Server::State::stats() const {
+  Stats s;
+  s.requests = requests_;
+  s.errors = errors_;
+  s.full_parses = full_parses_;
+  s.reparses = reparses_;
+  s.unchanged = unchanged_;
+  lock_guard<mutex> lock(mutex_);
+  s.documents = documents_.size();
+  return s;
+}
+
+Vhdl2008Server::Vhdl2008Server(Vhdl2008Options options, unsigned jobs,
+                               size_t max_documents)
+    : state_(make_unique<State>(options, jobs, max_documents)) {}
+
+Vhdl2008Server::~Vhdl2008Server() = default;
+
+string Vhdl2008Server::call(string_view request) {
+  return state_->call(request);
+}
+
+Vhdl2008Server::Stats Vhdl2008Server::stats() const { return state_->stats(); }
+
+int Vhdl2008Server::serve(istream &in, ostream &out) {
+  auto connection = make_shared<StreamConnection>(out);
+  string line;
+  while (!state_->stopping() && getline(in, line)) {
+    if (line.find_first_not_of(" \t\r") == string::npos) { continue; }
+    state_->dispatch(connection, move(line));
+  }
+  state_->drain();
+  return 0;
+}
+
+#ifdef _WIN32
+
+int Vhdl2008Server::serve_socket(const string &path, ostream &log) {
+  log << "Error: Unix domain sockets aren't supported on this platform\n";
+  return 1;
+}
+
+#else
+
+int Vhdl2008Server::serve_socket(const string &path, ostream &log) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    log << "Error: " << path << " is too long for a socket name\n";
+    return 1;
+  }
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  // Take over the socket of a server that's gone, but nothing else
+  struct stat info;
+  if (lstat(path.c_str(), &info) == 0) {
+    if (!S_ISSOCK(info.st_mode)) {
+      log << "Error: " << path << " exists, but is not a socket\n";
+      return 1;
+    }
+    unlink(path.c_str());
+  }
+
+  auto listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0 ||
+      bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+      listen(listener, 64) != 0) {
+    log << "Error: can't listen on " << path << ": " << strerror(errno) << "\n";
+    if (listener >= 0) { ::close(listener); }
+    return 1;
+  }
+
+  // Each client gets a thread that reads its requests and hands them on
+  mutex clients_mutex;
+  condition_variable clients_gone;
+  vector<weak_ptr<SocketConnection>> clients;
+  size_t reading = 0;
+
+  auto read_requests = [&](shared_ptr<SocketConnection> connection) {
+    string buffer;
+    char block[65536];
+    while (!state_->stopping()) {
+      auto n = ::read(connection->fd(), block, sizeof(block));
+      if (n < 0 && errno == EINTR) { continue; }
+      if (n <= 0) { break; }
+
+      buffer.append(block, static_cast<size_t>(n));
+      size_t start = 0;
+      for (auto end = buffer.find('\n'); end != string::npos;
+           end = buffer.find('\n', start)) {
+        if (buffer.find_first_not_of(" \t\r", start) < end) {
+          state_->dispatch(connection, buffer.substr(start, end - start));
+        }
+        start = end + 1;
+      }
+      buffer.erase(0, start);
+    }
+
+    lock_guard<mutex> lock(clients_mutex);
+    if (--reading == 0) { clients_gone.notify_all(); }
+  };
+
+  while (!state_->stopping()) {
+    // Wake up now and then to see if a client has asked us to stop
+    pollfd waiting{listener, POLLIN, 0};
+    if (poll(&waiting, 1, 100) <= 0) { continue; }
+    auto fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) { continue; }
+
+    auto connection = make_shared<SocketConnection>(fd);
+    lock_guard<mutex> lock(clients_mutex);
+    clients.erase(remove_if(clients.begin(), clients.end(),
+                            [](auto &client) { return client.expired(); }),
+                  clients.end());
+    clients.push_back(connection);
+    reading++;
+    thread(read_requests, move(connection)).detach();
+  }
+
+  // Stop reading from the clients that are still connected, and let them
+  // have the answers to what they've already asked
+  {
+    unique_lock<mutex> lock(clients_mutex);
+    for (auto &client : clients) {
+      if (auto connection = client.lock()) {
+        ::shutdown(connection->fd(), SHUT_RD);
+      }
+    }
+    clients_gone.wait(lock, [&] { return reading == 0; });
+  }
+  state_->drain();
+
+  ::close(listener);
+  unlink(path.c_str());
+  return 0;
+}
+
+#endif
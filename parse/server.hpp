@@ -0,0 +1,110 @@
+//
+//  server.hpp
+//
+//  Parsing as a service, over JSON-RPC
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "parse.hpp"
+
+// A parser that stays running, so that tools which parse often pay for
+// starting up once rather than for every file. It keeps a Vhdl2008Document
+// for each file it's asked about, so asking again about a file that hasn't
+// changed costs nothing, and one that has is only parsed again where it
+// changed (see incremental.hpp).
+//
+// Requests and responses are JSON-RPC 2.0, one object per line. Every
+// method takes its parameters by name, and all but "stats" and "shutdown"
+// name a file with "path":
+//
+//   parse    {path[, format]}                 the file as it is on disk, or
+//                                             as the client last sent it
+//   open     {path, text[, format]}           take the text from the client
+//                                             rather than the disk...
+//   change   {path, offset, removed, text[, format]}
+//                                             ...and then edits to it
+//   close    {path}                           forget the file
+//   outline  {path}                           its design units
+//   node_at  {path, offset}                   the rules around a byte
+//   stats    {}                               counts since starting
+//   shutdown {}                               finish what's queued and stop
+//
+// parse, open and change answer with
+//
+//   {"path":..., "ok":true, "current":true, "units":2,
+//    "errors":[{"line":3, "col":7, "message":"..."}],
+//    "reparse":{"full":false, "bytes":120, "units":1, "kept":1}}
+//
+// where "current" is false if the text has errors and the tree is still
+// that of the last text that parsed, and "reparse" is missing if nothing
+// needed parsing. With "format" set to "text", "compact" or "jsonl" the
+// tree comes too, as "tree", printed as vhdl_parser prints it.
+//
+// Requests about different files run at the same time on a pool of
+// threads; those about the same file run in the order they came in.
+class Vhdl2008Server {
+public:
+  struct Stats {
+    size_t requests = 0;
+    size_t errors = 0;      // Answered with a JSON-RPC error
+    size_t documents = 0;   // Held now
+    size_t full_parses = 0;
+    size_t reparses = 0;    // Of only the units that changed
+    size_t unchanged = 0;   // Answered from the tree already held
+  };
+
+  // Run requests on 'jobs' threads, keeping up to 'max_documents' files
+  // that were read from disk; those opened by a client are kept until
+  // they're closed
+  explicit Vhdl2008Server(Vhdl2008Options options = {}, unsigned jobs = 1,
+                          size_t max_documents = 64);
+  Vhdl2008Server(const Vhdl2008Server &) = delete;
+  Vhdl2008Server &operator=(const Vhdl2008Server &) = delete;
+  ~Vhdl2008Server();
+
+  // Answer one request, on this thread; empty for a notification
+  std::string call(std::string_view request);
+
+  // Answer requests from 'in' on 'out' until 'in' ends or a client asks
+  // the server to shut down
+  int serve(std::istream &in, std::ostream &out);
+
+  // The same, for any number of clients connecting to a Unix domain
+  // socket at 'path', which is replaced if it's already there and removed
+  // at the end. Problems go to 'log'.
+  int serve_socket(const std::string &path, std::ostream &log);
+
+  Stats stats() const;
+
+private:
+  class State;
+  std::unique_ptr<State> state_;
+};
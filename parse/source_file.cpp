@@ -0,0 +1,149 @@
+//
+//  source_file.cpp
+//
+//  The text of a source file, mapped into memory where possible
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <fstream>
+#include <iostream>
+using namespace std;
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "source_file.hpp"
+
+bool SourceFile::open(const fs::path &path) {
+  close();
+  if (path != "-" && map(path)) { return true; }
+  return read(path);
+}
+
+#ifdef _WIN32
+bool SourceFile::map(const fs::path &path) {
+  auto file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) { return false; }
+
+  LARGE_INTEGER size;
+  if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size) ||
+      size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+
+  // The view keeps the mapping, and the mapping the file, open
+  auto mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping) { return false; }
+  map_ = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!map_) { return false; }
+
+  data_ = static_cast<const char *>(map_);
+  size_ = static_cast<size_t>(size.QuadPart);
+  return true;
+}
+
+void SourceFile::close() {
+  if (map_) { UnmapViewOfFile(map_); }
+  map_ = nullptr;
+  buffer_.clear();
+  data_ = nullptr;
+  size_ = 0;
+}
+#else
+bool SourceFile::map(const fs::path &path) {
+  auto fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) { return false; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // The mapping keeps the file open
+  auto size = static_cast<size_t>(st.st_size);
+  auto map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) { return false; }
+
+  map_ = map;
+  data_ = static_cast<const char *>(map_);
+  size_ = size;
+  return true;
+}
+
+void SourceFile::close() {
+  if (map_) { munmap(map_, size_); }
+  map_ = nullptr;
+  buffer_.clear();
+  data_ = nullptr;
+  size_ = 0;
+}
+#endif
+
+static void read_all(istream &is, vector<char> &buffer) {
+  constexpr size_t chunk = 64 * 1024;
+  size_t size = 0;
+  for (;;) {
+    buffer.resize(size + chunk);
+    auto got = static_cast<size_t>(is.rdbuf()->sgetn(
+        buffer.data() + size, static_cast<streamsize>(chunk)));
+    size += got;
+    if (got < chunk) { break; }
+  }
+  buffer.resize(size);
+}
+
+bool SourceFile::read(const fs::path &path) {
+  if (path == "-") {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    read_all(cin, buffer_);
+  } else {
+    ifstream ifs(path, ios::in | ios::binary);
+    if (ifs.fail()) { return false; }
+    read_all(ifs, buffer_);
+  }
+
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  return true;
+}
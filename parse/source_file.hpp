@@ -0,0 +1,64 @@
+//
+//  source_file.hpp
+//
+//  The text of a source file, mapped into memory where possible
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+// A regular file is mapped read-only, so its pages are shared with the OS
+// file cache rather than copied; anything that can't be mapped (a pipe,
+// stdin, an empty file) is read into a buffer instead. Parse trees point
+// into the text, so keep this alive for as long as they are (see
+// peg::CompactAst::own_source()). The file mustn't shrink while it's mapped.
+class SourceFile {
+public:
+  SourceFile() = default;
+  SourceFile(const SourceFile &) = delete;
+  SourceFile &operator=(const SourceFile &) = delete;
+  ~SourceFile() { close(); }
+
+  // Load 'path', or stdin if it is "-"; false if it can't be read
+  bool open(const std::filesystem::path &path);
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // True if the text is mapped rather than read into a buffer
+  bool mapped() const { return map_ != nullptr; }
+
+private:
+  bool map(const std::filesystem::path &path);
+  bool read(const std::filesystem::path &path);
+  void close();
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  void *map_ = nullptr;
+  std::vector<char> buffer_;
+};
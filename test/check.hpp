@@ -0,0 +1,102 @@
+//
+//  check.hpp
+//
+//  A few helpers shared by the tests
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// A failed CHECK() is reported and counted, and the test carries on; main()
+// ends with 'return check_result();'
+inline int &check_failures() {
+  static int failures = 0;
+  return failures;
+}
+
+inline bool check(bool ok, const char *what, const char *file, int line) {
+  if (!ok) {
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    check_failures()++;
+  }
+  return ok;
+}
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+inline int check_result() {
+  if (check_failures() > 0) {
+    std::fprintf(stderr, "%d checks failed\n", check_failures());
+    return 1;
+  }
+  return 0;
+}
+
+// True if two trees (a CompactAst or an AstFile each) have the same nodes
+// with the same rule names, whatever numbers their rules were given
+template <typename A, typename B> bool same_tree(const A &a, const B &b) {
+  if (a.size() != b.size()) { return false; }
+  for (uint32_t id = 0; id < a.size(); id++) {
+    auto &x = a[id];
+    auto &y = b[id];
+    if (a.name(x) != b.name(y) || a.is_token(x) != b.is_token(y) ||
+        x.parent != y.parent || x.end != y.end || x.position != y.position ||
+        x.length != y.length || x.choice_count != y.choice_count ||
+        x.choice != y.choice ||
+        (a.is_token(x) &&
+         (x.token != y.token || x.token_length != y.token_length))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A small file of three design units, which every parser accepts
+constexpr const char *three_units = R"(library ieee;
+use ieee.std_logic_1164.all;
+
+entity counter is
+  port (clk : in std_logic; q : out natural);
+end entity counter;
+
+-- The counter itself
+architecture rtl of counter is
+  signal count : natural := 0;
+begin
+  process (clk)
+  begin
+    if rising_edge(clk) then
+      count <= count + 1;
+    end if;
+  end process;
+  q <= count;
+end architecture rtl;
+
+package constants is
+  constant width : natural := 8;
+end package constants;
+)";
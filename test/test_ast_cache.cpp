@@ -0,0 +1,144 @@
+//
+//  test_ast_cache.cpp
+//
+//  Tests of the on-disk tree cache
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <fstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "ast_cache.hpp"
+#include "check.hpp"
+#include "parse.hpp"
+
+// The trees in the cache directory
+static vector<fs::path> entries(const fs::path &dir) {
+  vector<fs::path> found;
+  for (auto &entry : fs::directory_iterator(dir)) {
+    if (entry.path().extension() == ".ast") { found.push_back(entry.path()); }
+  }
+  return found;
+}
+
+static string read_file(const fs::path &path) {
+  ifstream ifs(path, ios::binary);
+  return string(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+}
+
+static void write_file(const fs::path &path, const string &bytes) {
+  ofstream ofs(path, ios::binary | ios::trunc);
+  ofs.write(bytes.data(), static_cast<streamsize>(bytes.size()));
+}
+
+// Damage the only tree in 'dir' with 'damage', and check that it's refused
+// and deleted, and that the text is then simply missing
+template <typename Damage>
+static void check_corrupt(AstCache &cache, const fs::path &dir,
+                          const string &text, const peg::CompactAst &tree,
+                          Damage damage) {
+  CHECK(cache.store(text.data(), text.size(), tree));
+  auto files = entries(dir);
+  if (!CHECK(files.size() == 1)) { return; }
+  auto bytes = read_file(files[0]);
+  damage(bytes);
+  write_file(files[0], bytes);
+
+  peg::CompactAst loaded;
+  CHECK(cache.load(text.data(), text.size(), "t.vhd", loaded) ==
+        AstCache::Lookup::Corrupt);
+  CHECK(!fs::exists(files[0]));
+  CHECK(cache.load(text.data(), text.size(), "t.vhd", loaded) ==
+        AstCache::Lookup::Miss);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: test_ast_cache DIR\n");
+    return 2;
+  }
+  fs::path dir = argv[1];
+  fs::remove_all(dir);
+
+  string text = three_units;
+  peg::CompactAst tree;
+  CHECK(Vhdl2008Parser::instance().parse(text.data(), text.size(), tree,
+                                         "t.vhd"));
+
+  AstCache cache(dir, 1 << 20, "version 1");
+  CHECK(cache.ok());
+
+  // A tree comes back as it went in, for the same text only
+  peg::CompactAst loaded;
+  CHECK(cache.load(text.data(), text.size(), "t.vhd", loaded) ==
+        AstCache::Lookup::Miss);
+  CHECK(cache.store(text.data(), text.size(), tree));
+  CHECK(cache.load(text.data(), text.size(), "t.vhd", loaded) ==
+        AstCache::Lookup::Hit);
+  CHECK(same_tree(tree, loaded));
+  CHECK(loaded.path() == "t.vhd");
+  CHECK(loaded.source().data() == text.data());
+
+  auto other = text;
+  other[other.find("counter")] = 'k';
+  CHECK(cache.load(other.data(), other.size(), "t.vhd", loaded) ==
+        AstCache::Lookup::Miss);
+
+  // ...and parsed the same way
+  {
+    AstCache other_version(dir, 1 << 20, "version 2");
+    CHECK(other_version.load(text.data(), text.size(), "t.vhd", loaded) ==
+          AstCache::Lookup::Miss);
+  }
+
+  // Damaged entries are deleted, whichever part is damaged
+  for (auto &file : entries(dir)) { fs::remove(file); }
+  check_corrupt(cache, dir, text, tree,
+                [](string &bytes) { bytes[bytes.size() / 2] ^= 0x40; });
+  check_corrupt(cache, dir, text, tree,
+                [](string &bytes) { bytes.resize(bytes.size() - 8); });
+  check_corrupt(cache, dir, text, tree, [](string &bytes) { bytes[0] = 'X'; });
+  check_corrupt(cache, dir, text, tree,
+                [](string &bytes) { bytes.resize(10); });
+  check_corrupt(cache, dir, text, tree, [](string &bytes) { bytes.clear(); });
+
+  auto stats = cache.stats();
+  CHECK(stats.hits == 1);
+  CHECK(stats.corrupt == 5);
+  CHECK(stats.stored == 6);
+
+  // Trimming deletes the least recently used trees first
+  AstCache small(dir, 1, "version 1");
+  CHECK(small.store(text.data(), text.size(), tree));
+  small.trim();
+  CHECK(entries(dir).empty());
+  CHECK(small.stats().evicted == 1);
+
+  fs::remove_all(dir);
+  return check_result();
+}
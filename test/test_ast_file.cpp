@@ -0,0 +1,205 @@
+//
+//  test_ast_file.cpp
+//
+//  Tests of AST files, and of how damaged ones are refused
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "ast_file.hpp"
+#include "check.hpp"
+#include "parse.hpp"
+
+using peg::AstFile;
+using peg::AstFileHeader;
+using peg::AstFileRule;
+using peg::CompactAst;
+
+// The bytes of an AST file, kept 8-byte aligned as AstFile::view() needs
+struct Bytes {
+  explicit Bytes(const string &s) : size(s.size()), words((s.size() + 7) / 8) {
+    memcpy(words.data(), s.data(), s.size());
+  }
+  char *data() { return reinterpret_cast<char *>(words.data()); }
+
+  AstFileHeader header() {
+    AstFileHeader h;
+    memcpy(&h, data(), sizeof(h));
+    return h;
+  }
+  void set_header(const AstFileHeader &h) { memcpy(data(), &h, sizeof(h)); }
+
+  template <typename T> T *at(uint64_t offset) {
+    return reinterpret_cast<T *>(data() + offset);
+  }
+
+  size_t size;
+  vector<uint64_t> words;
+};
+
+// Check that 'file' with one change made by 'damage' is refused
+static bool refused(const string &file, const function<void(Bytes &)> &damage) {
+  Bytes bytes(file);
+  damage(bytes);
+  AstFile view;
+  return !view.view(bytes.data(), bytes.size);
+}
+
+int main() {
+  string text = three_units;
+  CompactAst tree;
+  CHECK(Vhdl2008Parser::instance().parse(text.data(), text.size(), tree,
+                                         "t.vhd"));
+  CHECK(tree.size() > 10);
+
+  // A file with the source reads back as the tree it was written from
+  string file;
+  peg::write_ast_file(tree, file);
+  {
+    Bytes bytes(file);
+    AstFile view;
+    CHECK(view.view(bytes.data(), bytes.size));
+    CHECK(same_tree(tree, view));
+    CHECK(view.path() == "t.vhd");
+    CHECK(view.has_source() && view.source() == text);
+    CHECK(view.version() == make_pair(peg::AST_FILE_MAJOR,
+                                      peg::AST_FILE_MINOR));
+    for (uint32_t id = 0; id < tree.size(); id++) {
+      CHECK(view.line_info(view[id]) == tree.line_info(tree[id]));
+      if (tree.is_token(tree[id])) {
+        CHECK(view.token(view[id]) == tree.token(tree[id]));
+      }
+    }
+
+    CompactAst copy;
+    CHECK(peg::to_compact(view, text.data(), text.size(), nullptr, copy));
+    CHECK(same_tree(tree, copy));
+    CHECK(copy.path() == "t.vhd");
+    CHECK(!peg::to_compact(view, text.data(), text.size() - 1, nullptr, copy));
+  }
+
+  // ...and one without it has the tree but no text or lines
+  string bare;
+  peg::write_ast_file(tree, bare, false);
+  CHECK(bare.size() < file.size());
+  {
+    Bytes bytes(bare);
+    AstFile view;
+    CHECK(view.view(bytes.data(), bytes.size));
+    CHECK(same_tree(tree, view));
+    CHECK(!view.has_source());
+    CHECK(view.line_info(view[0]) == make_pair(size_t(0), size_t(0)));
+  }
+
+  // A newer minor version only adds things, so it's still read
+  CHECK(!refused(file, [](Bytes &b) {
+    auto h = b.header();
+    h.minor++;
+    b.set_header(h);
+  }));
+
+  // Every shorter file is refused, and so is one that isn't aligned
+  for (size_t size = 0; size < file.size(); size++) {
+    AstFile view;
+    Bytes bytes(file);
+    if (!CHECK(!view.view(bytes.data(), size))) { break; }
+  }
+  {
+    vector<uint64_t> words(file.size() / 8 + 2);
+    auto p = reinterpret_cast<char *>(words.data()) + 4;
+    memcpy(p, file.data(), file.size());
+    AstFile view;
+    CHECK(!view.view(p, file.size()));
+  }
+
+  // The header, and the bounds of every section, node and string
+  using Damage = function<void(AstFileHeader &)>;
+  vector<Damage> header_damage = {
+      [](AstFileHeader &h) { h.magic[0] = 'X'; },
+      [](AstFileHeader &h) { h.byte_order = 0x04030201; },
+      [](AstFileHeader &h) { h.major++; },
+      [](AstFileHeader &h) { h.header_size = sizeof(h) - 8; },
+      [](AstFileHeader &h) { h.file_size += 8; },
+      [](AstFileHeader &h) { h.rules.offset += 4; },
+      [](AstFileHeader &h) { h.rules.offset = 0; },
+      [](AstFileHeader &h) { h.rules.size += sizeof(AstFileRule) / 2; },
+      [](AstFileHeader &h) { h.strings.size = h.file_size; },
+      [](AstFileHeader &h) { h.nodes.offset = h.file_size + 8; },
+      [](AstFileHeader &h) { h.nodes.size = ~uint64_t(0) - 7; },
+      [](AstFileHeader &h) { h.lines.size += 2; },
+      [](AstFileHeader &h) { h.source.size--; },
+      [](AstFileHeader &h) { h.source_size++; },
+      [](AstFileHeader &h) { h.source_size = uint64_t(1) << 33; },
+      [](AstFileHeader &h) { h.path = static_cast<uint32_t>(h.strings.size + 1); },
+      [](AstFileHeader &h) { h.path_length += 1; },
+  };
+  for (auto &damage : header_damage) {
+    CHECK(refused(file, [&](Bytes &b) {
+      auto h = b.header();
+      damage(h);
+      b.set_header(h);
+    }));
+  }
+
+  auto header = Bytes(file).header();
+  auto node_count = header.nodes.size / sizeof(CompactAst::Node);
+  auto rule_count = header.rules.size / sizeof(AstFileRule);
+  auto node = [&](Bytes &b, size_t id) -> CompactAst::Node & {
+    return b.at<CompactAst::Node>(header.nodes.offset)[id];
+  };
+  auto last = node_count - 1;
+  vector<function<void(Bytes &)>> damage = {
+      [&](Bytes &b) { node(b, 1).rule = static_cast<uint32_t>(rule_count); },
+      [&](Bytes &b) { node(b, 0).parent = 0; },
+      [&](Bytes &b) { node(b, 2).parent = 2; },
+      [&](Bytes &b) { node(b, 1).end = 1; },
+      [&](Bytes &b) { node(b, 0).end = static_cast<uint32_t>(node_count + 1); },
+      [&](Bytes &b) {
+        node(b, last).position = static_cast<uint32_t>(text.size() + 1);
+      },
+      [&](Bytes &b) { node(b, 0).length = static_cast<uint32_t>(text.size() + 1); },
+      [&](Bytes &b) {
+        node(b, last).token = static_cast<uint32_t>(text.size());
+        node(b, last).token_length = 1;
+      },
+      [&](Bytes &b) {
+        b.at<AstFileRule>(header.rules.offset)[0].name =
+            static_cast<uint32_t>(header.strings.size + 1);
+      },
+      [&](Bytes &b) {
+        b.at<AstFileRule>(header.rules.offset)[0].name_length =
+            static_cast<uint32_t>(header.strings.size + 1);
+      },
+      [&](Bytes &b) {
+        b.at<uint32_t>(header.lines.offset)[header.lines.size / 4 - 1]--;
+      },
+  };
+  for (auto &d : damage) { CHECK(refused(file, d)); }
+
+  return check_result();
+}
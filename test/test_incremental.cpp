@@ -0,0 +1,205 @@
+//
+//  test_incremental.cpp
+//
+//  Tests of reparsing only the design units that an edit touches
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "check.hpp"
+#include "incremental.hpp"
+
+struct Edit {
+  size_t offset;
+  size_t removed;
+  string inserted;
+};
+
+// Syntax errors as the log gets them
+struct Errors {
+  vector<string> lines;
+  peg::Log log() {
+    return [this](size_t line, size_t col, const string &msg, const string &) {
+      lines.push_back(to_string(line) + ":" + to_string(col) + ": " + msg);
+    };
+  }
+};
+
+// Apply 'edit' to 'doc', and check that the result is what parsing the
+// new text from scratch gives: the same answer and errors and, if it
+// parsed, the same tree
+static bool check_edit(Vhdl2008Document &doc, const Edit &edit,
+                       const Vhdl2008Options &options) {
+  Errors edited;
+  auto ret = doc.edit(edit.offset, edit.removed, edit.inserted, edited.log());
+
+  Vhdl2008Document fresh(options);
+  Errors opened;
+  auto fresh_ret = fresh.open(doc.text(), doc.path(), opened.log());
+
+  auto ok = CHECK(ret == fresh_ret) && CHECK(doc.current() == ret) &&
+            CHECK(edited.lines == opened.lines);
+  if (ret) {
+    ok = CHECK(same_tree(doc.tree(), fresh.tree())) &&
+         CHECK(doc.tree().source() == doc.text()) && ok;
+  }
+  if (!ok) {
+    fprintf(stderr, "after replacing %zu bytes at %zu with \"%s\"\n",
+            edit.removed, edit.offset, edit.inserted.c_str());
+  }
+  return ok;
+}
+
+// Where 'what' starts in the document, after 'after' if that's given
+static size_t at(const Vhdl2008Document &doc, const string &what,
+                 const string &after = {}) {
+  auto from = after.empty() ? 0 : doc.text().find(after);
+  auto pos = doc.text().find(what, from);
+  if (!CHECK(pos != string::npos)) { return 0; }
+  return pos;
+}
+
+static void scripted(const Vhdl2008Options &options) {
+  Vhdl2008Document doc(options);
+  CHECK(doc.open(three_units, "t.vhd"));
+  CHECK(doc.last_reparse().full);
+  CHECK(doc.last_reparse().parsed_units == 3);
+
+  // Inside the architecture: only that unit is parsed again, and the one
+  // after it moves along by a byte
+  check_edit(doc, {at(doc, "count + 1"), 5, "count + 12"}, options);
+  CHECK(!doc.last_reparse().full);
+  CHECK(doc.last_reparse().parsed_units == 1);
+  CHECK(doc.last_reparse().kept_units == 2);
+
+  // Shorter, so the units after it move back
+  check_edit(doc, {at(doc, "signal count"), 28, "signal count : natural;"},
+             options);
+  CHECK(!doc.last_reparse().full);
+
+  // In the comment between units, and in the whitespace at either end
+  check_edit(doc, {at(doc, "-- The counter"), 0, "-- Counts up\n"}, options);
+  check_edit(doc, {0, 0, "\n\n-- Header\n"}, options);
+  check_edit(doc, {doc.text().size(), 0, "\n-- Trailer\n"}, options);
+  check_edit(doc, {0, at(doc, "library"), ""}, options);
+
+  // At the very end of a unit, where its match looks past its last byte
+  check_edit(doc, {at(doc, ";", "end entity") + 1, 0, " "}, options);
+  check_edit(doc, {at(doc, ";", "end package") + 1, 0, "\n"}, options);
+
+  // ...and at the start of the next, which makes the whitespace at the end
+  // of the one before longer
+  check_edit(doc, {at(doc, "architecture rtl"), 0, "-- The body\n"}, options);
+  check_edit(doc, {at(doc, "package constants"), 0, "/* c */ "}, options);
+
+  // A new unit, of a kind the tree had no rules for yet
+  check_edit(doc,
+             {at(doc, "package constants"), 0,
+              "package body helpers is\nend package body helpers;\n\n"},
+             options);
+  CHECK(doc.current());
+
+  // A syntax error in the middle unit is reported against the whole text,
+  // and the tree stays as it was...
+  auto before = doc.tree().size();
+  check_edit(doc, {at(doc, "q <= count;"), 11, "q <= ;"}, options);
+  CHECK(!doc.current());
+  CHECK(doc.tree().size() == before);
+
+  // ...through more edits elsewhere, until it's put right
+  check_edit(doc, {at(doc, "width"), 5, "bits"}, options);
+  CHECK(!doc.current());
+  check_edit(doc, {at(doc, "q <= ;"), 6, "q <= count;"}, options);
+  CHECK(doc.current());
+
+  // Merging two units and splitting them again
+  check_edit(doc, {at(doc, "end entity counter;"), 19, ""}, options);
+  check_edit(doc, {at(doc, "\n\n-- Counts up"), 0, "\nend entity counter;"},
+             options);
+  CHECK(doc.current());
+
+  // Deleting a unit, and everything
+  auto begin = at(doc, "package body");
+  check_edit(doc, {begin, at(doc, "package constants") - begin, ""}, options);
+  check_edit(doc, {0, doc.text().size(), ""}, options);
+  check_edit(doc, {0, 0, three_units}, options);
+  CHECK(doc.current());
+
+  bool threw = false;
+  try {
+    doc.edit(doc.text().size(), 1, "");
+  } catch (const out_of_range &) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+// Small random edits made of VHDL fragments, many of them breaking the
+// text for a while
+static void random_edits(const Vhdl2008Options &options, size_t count) {
+  static const char *const pieces[] = {
+      "",       " ",          "\n",          ";",       "x",
+      "count",  "(",          ")",           "<=",      "-- note\n",
+      "end ",   "begin\n",    "signal s : bit;\n",       "'0'",
+      "entity e is\nend entity e;\n",        "/* c */", "1 + 2"};
+
+  uint64_t state = 0x9e3779b97f4a7c15;
+  auto next = [&state](size_t n) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return static_cast<size_t>(state % n);
+  };
+
+  Vhdl2008Document doc(options);
+  CHECK(doc.open(three_units, "t.vhd"));
+  for (size_t i = 0; i < count; i++) {
+    auto size = doc.text().size();
+    auto offset = next(size + 1);
+    auto removed = min(next(8), size - offset);
+    string inserted = pieces[next(sizeof(pieces) / sizeof(pieces[0]))];
+    if (!check_edit(doc, {offset, removed, inserted}, options)) { break; }
+
+    // Go back to a text that parses now and then, so most edits are to
+    // a tree that's current
+    if (next(8) == 0) {
+      check_edit(doc, {0, doc.text().size(), three_units}, options);
+    }
+  }
+}
+
+int main() {
+  Vhdl2008Options options;
+  scripted(options);
+  random_edits(options, 400);
+
+  options.engine = Vhdl2008Engine::Interpreter;
+  scripted(options);
+  random_edits(options, 50);
+
+  return check_result();
+}
@@ -0,0 +1,227 @@
+//
+//  test_server.cpp
+//
+//  Tests of the JSON-RPC server, through Vhdl2008Server::call()
+//
+//  MIT License
+//
+//  Copyright (C) 2022-2023 Iain Waugh. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "ast_stream.hpp"
+#include "check.hpp"
+#include "parse.hpp"
+#include "server.hpp"
+
+// A request for 'method' with the JSON object 'params'
+static string request(int id, const string &method, const string &params) {
+  return "{\"jsonrpc\":\"2.0\",\"id\":" + to_string(id) + ",\"method\":\"" +
+         method + "\",\"params\":" + params + "}";
+}
+
+// A JSON string holding 's'
+static string json(const string &s) {
+  string out;
+  peg::append_json_string(out, s);
+  return out;
+}
+
+static bool has(const string &reply, const string &part) {
+  return reply.find(part) != string::npos;
+}
+
+static void write_file(const fs::path &path, const string &text) {
+  ofstream ofs(path, ios::binary | ios::trunc);
+  ofs << text;
+}
+
+// The tree of 'text' as vhdl_parser prints it
+static string printed(const string &text) {
+  peg::CompactAst tree;
+  Vhdl2008Parser::instance().parse(text.data(), text.size(), tree, "t.vhd");
+  ostringstream os;
+  {
+    peg::OutputBuffer out(os);
+    peg::write_text(tree, out, false);
+  }
+  return os.str();
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: test_server DIR\n");
+    return 2;
+  }
+  fs::path dir = argv[1];
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+
+  Vhdl2008Server server;
+  string text = three_units;
+
+  // Requests that can't be run
+  auto reply = server.call("{\"jsonrpc\":");
+  CHECK(reply == "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"code\":-32700,"
+                 "\"message\":\"not valid JSON\"}}\n");
+  CHECK(has(server.call("[]"), "\"code\":-32600"));
+  CHECK(has(server.call("{\"jsonrpc\":\"1.0\",\"id\":1,\"method\":\"stats\"}"),
+            "\"code\":-32600"));
+  CHECK(has(server.call(request(1, "nope", "{}")),
+            "\"id\":1,\"error\":{\"code\":-32601"));
+  CHECK(has(server.call(request(2, "open", "{\"path\":\"a.vhd\"}")),
+            "\"id\":2,\"error\":{\"code\":-32602"));
+  CHECK(has(server.call(request(3, "parse", "{\"path\":7}")), "-32602"));
+  CHECK(has(server.call(request(4, "parse", "{\"path\":" +
+                                                json((dir / "none.vhd")
+                                                           .string()) +
+                                                "}")),
+            "\"id\":4,\"error\":{\"code\":-32000"));
+  CHECK(server.call("{\"jsonrpc\":\"2.0\",\"method\":\"nope\"}").empty());
+
+  // A file opened by the client comes back with its tree, printed as
+  // vhdl_parser prints it
+  auto a = "{\"path\":\"a.vhd\"";
+  reply = server.call(request(5, "open", a + string(",\"text\":") +
+                                             json(text) +
+                                             ",\"format\":\"compact\"}"));
+  CHECK(has(reply, "\"id\":5,\"result\":{\"path\":\"a.vhd\",\"ok\":true,"
+                   "\"current\":true,\"units\":3,\"errors\":[],"
+                   "\"reparse\":{\"full\":true,"));
+  CHECK(has(reply, ",\"tree\":" + json(printed(text)) + "}}\n"));
+  CHECK(has(server.call(request(6, "open", a + string(",\"text\":") +
+                                             json(text) + ",\"format\":3}")),
+            "-32602"));
+
+  // Its design units, and the rules around a byte
+  reply = server.call(request(7, "outline", a + string("}")));
+  CHECK(has(reply, "{\"kind\":\"entity_declaration\",\"name\":\"counter\","
+                   "\"line\":4,\"col\":1,"));
+  CHECK(has(reply, "{\"kind\":\"architecture_body\",\"name\":\"rtl\","));
+  CHECK(has(reply, "{\"kind\":\"package_declaration\",\"name\":\"constants\","));
+  auto offset = text.find("width");
+  reply = server.call(request(8, "node_at", a + string(",\"offset\":") +
+                                                to_string(offset) + "}"));
+  CHECK(has(reply, "{\"rule\":\"vhdl2008\",\"offset\":0,"));
+  CHECK(has(reply, "\"offset\":" + to_string(offset) +
+                       ",\"length\":6,\"token\":\"width\"}]}}\n"));
+
+  // Edits are parsed again where they fall, and the tree is the one a
+  // client that opened the final text would get
+  auto change = [&](int id, const string &path, size_t at, size_t removed,
+                    const string &inserted) {
+    text.replace(at, removed, inserted);
+    return server.call(request(id, "change",
+                               "{\"path\":\"" + path + "\",\"offset\":" +
+                                   to_string(at) + ",\"removed\":" +
+                                   to_string(removed) + ",\"text\":" +
+                                   json(inserted) +
+                                   ",\"format\":\"compact\"}"));
+  };
+  reply = change(9, "a.vhd", text.find("8;"), 1, "16");
+  CHECK(has(reply, "\"ok\":true,\"current\":true,\"units\":3,\"errors\":[],"
+                   "\"reparse\":{\"full\":false,"));
+  CHECK(has(reply, "\"kept\":2}"));
+  reply = change(10, "a.vhd", text.find("end package"), 0, "\"é\t");
+  CHECK(has(reply, "\"ok\":false,\"current\":false,\"units\":3,\"errors\":[{"
+                   "\"line\":23,\"col\":1,"));
+  reply = change(11, "a.vhd", text.find("\"é\t"), 4, "");
+  CHECK(has(reply, "\"ok\":true,\"current\":true,"));
+  auto tree = reply.substr(reply.find(",\"tree\":"));
+  reply = server.call(request(12, "open", "{\"path\":\"b.vhd\",\"text\":" +
+                                              json(text) +
+                                              ",\"format\":\"compact\"}"));
+  CHECK(has(reply, tree));
+  reply = server.call(request(13, "parse",
+                              "{\"path\":\"b.vhd\",\"format\":\"jsonl\"}"));
+  CHECK(!has(reply, "\"reparse\"") &&
+        has(reply, ",\"tree\":\"{\\\"file\\\":\\\"b.vhd\\\","));
+  CHECK(has(server.call(request(14, "change",
+                                a + string(",\"offset\":") +
+                                    to_string(text.size() + 1) +
+                                    ",\"removed\":0,\"text\":\"\"}")),
+            "\"id\":14,\"error\":{\"code\":-32602"));
+
+  // Only files that have been opened can be changed, until they're closed
+  CHECK(server.call(request(15, "close", a + string("}"))) ==
+        "{\"jsonrpc\":\"2.0\",\"id\":15,\"result\":null}\n");
+  CHECK(has(change(16, "a.vhd", 0, 0, " "), "-32602"));
+
+  // A file on disk is read again only once it changes
+  auto path = (dir / "c.vhd").string();
+  auto c = "{\"path\":" + json(path) + "}";
+  write_file(path, three_units);
+  CHECK(has(server.call(request(17, "parse", c)), "\"full\":true"));
+  reply = server.call(request(18, "parse", c));
+  CHECK(has(reply, "\"ok\":true,") && !has(reply, "\"reparse\""));
+  write_file(path, string(three_units) + "\n-- More\n");
+  CHECK(has(server.call(request(19, "parse", c)), "\"reparse\":{"));
+
+  auto stats = server.stats();
+  CHECK(stats.documents == 2);
+  CHECK(stats.unchanged == 5); // Requests 6, 7, 8, 13 and 18
+  CHECK(stats.errors == 11);
+  CHECK(has(server.call(request(20, "stats", "{}")),
+            "\"documents\":2,\"full_parses\":" +
+                to_string(stats.full_parses) + ","));
+
+  // Files read from disk are forgotten, least recently used first, but
+  // those opened by a client are kept, whichever threads ask
+  {
+    Vhdl2008Server busy({}, 4, 2);
+    vector<thread> clients;
+    for (int client = 0; client < 4; client++) {
+      clients.emplace_back([&, client] {
+        auto own = "{\"path\":\"open" + to_string(client) + ".vhd\"";
+        CHECK(has(busy.call(request(client, "open",
+                                    own + ",\"text\":" + json(three_units) +
+                                        "}")),
+                  "\"ok\":true"));
+        for (int i = 0; i < 4; i++) {
+          auto file = (dir / ("disk" + to_string(client * 4 + i) + ".vhd"))
+                          .string();
+          write_file(file, three_units);
+          CHECK(has(busy.call(request(i, "parse",
+                                      "{\"path\":" + json(file) + "}")),
+                    "\"ok\":true"));
+        }
+        CHECK(has(busy.call(request(client, "outline", own + "}")),
+                  "\"name\":\"constants\""));
+      });
+    }
+    for (auto &client : clients) { client.join(); }
+    // More than two files from disk can be left, as one isn't forgotten
+    // while a request about it is waiting
+    CHECK(busy.stats().documents >= 4 + 2);
+    CHECK(busy.stats().full_parses == 4 + 16);
+  }
+
+  fs::remove_all(dir);
+  return check_result();
+}
@@ -33,13 +33,134 @@ namespace fs = std::filesystem;
 #include <boost/program_options.hpp>    // For CLI parsing: link with "-lboost_program_options"
 namespace po = boost::program_options;
 
+#include <algorithm>
+#include <cctype>
+#include <fstream>
 #include <iostream>
 #include <iterator>
+#include <thread>
+#include <memory>
+#include <vector>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include <ast_cache.hpp>
 #include <parse.hpp>
+#include <server.hpp>
+
+// True for the extensions looked for in directories
+static bool is_vhdl_file(const fs::path &path)
+{
+    auto ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return ext == ".vhd" || ext == ".vhdl";
+}
+
+// Add the files that 'name' stands for to 'files': a file (or '-' for
+// stdin) as it is, every VHDL file under a directory, or everything listed
+// in a response file given as '@file', one name per line. Directory
+// listings are sorted, so the order doesn't depend on the file system.
+static bool add_input(const std::string &name, std::vector<fs::path> &files, int depth = 0)
+{
+    if (name.size() > 1 && name[0] == '@')
+    {
+        std::ifstream list(name.substr(1));
+        if (list.fail() || depth > 16)
+        {
+            std::cout << "Error: can't read response file " << name.substr(1) << "\n";
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(list, line))
+        {
+            auto first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#')
+            {
+                continue;
+            }
+            auto last = line.find_last_not_of(" \t\r");
+            if (!add_input(line.substr(first, last - first + 1), files, depth + 1))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    fs::path path(name);
+    if (name == "-")
+    {
+        files.push_back(path);
+        return true;
+    }
+
+    if (!exists(path))
+    {
+        std::cout << "Error: " << path << " does not exist; please specify a file.\n";
+        return false;
+    }
+
+    if (fs::is_directory(path))
+    {
+        // A subdirectory that can't be read is reported and skipped, rather
+        // than ending the search
+        std::vector<fs::path> found;
+        std::error_code ec;
+        fs::recursive_directory_iterator it(path, ec), end;
+        for (; !ec && it != end; it.increment(ec))
+        {
+            std::error_code entry_ec;
+            if (it->is_directory(entry_ec))
+            {
+                fs::directory_iterator probe(it->path(), entry_ec);
+                if (entry_ec)
+                {
+                    std::cerr << "Warning: can't read " << it->path() << " (" << entry_ec.message()
+                              << "); skipping it.\n";
+                    it.disable_recursion_pending();
+                }
+            }
+            else if (it->is_regular_file(entry_ec) && is_vhdl_file(it->path()))
+            {
+                found.push_back(it->path());
+            }
+        }
+        if (ec)
+        {
+            std::cout << "Error: can't read " << path << " (" << ec.message() << ").\n";
+            return false;
+        }
+        std::sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+        return true;
+    }
+
+    // Pipes are read rather than mapped, but work just as well
+    if (!fs::is_regular_file(path) && !fs::is_fifo(path))
+    {
+        std::cout << "Error: " << path << " exists, but is not a file; please specify a file.\n";
+        return false;
+    }
+    files.push_back(path);
+    return true;
+}
 
 int main(int argc, char* argv[])
 {
-    std::string hdl_file_name = "";
+    std::vector<std::string> hdl_file_names;
+    unsigned jobs = 1;
+    bool show_timing = false;
+    std::string memo_file_name = "";
+    bool profile = false;
+    std::string profile_file_name = "";
+    std::string cache_dir_name = "";
+    unsigned cache_size = 1024;
+    bool serve = false;
+    std::string socket_name = "";
+    Vhdl2008Options options;
 //    std::string ast_file_name = "";
 
     // Set up the command-line options and parse them
@@ -47,7 +168,34 @@ int main(int argc, char* argv[])
         po::options_description cliOpts("Program options");
         cliOpts.add_options()
         ("help,h", "produce help message")
-        ("input-file,i", po::value< std::string >(), "input file")
+        ("input-file,i", po::value< std::vector<std::string> >(),
+         "input files or directories (searched for .vhd and .vhdl files), "
+         "'@file' to read their names from a file, or '-' for stdin")
+        ("jobs,j", po::value< unsigned >()->default_value(std::max(1u, std::thread::hardware_concurrency())),
+         "number of files to parse at once")
+        ("format,f", po::value< std::string >()->default_value("text"),
+         "how to print the AST: 'text' (indented), 'compact' (the same without the indentation), "
+         "'jsonl' (an event per line), 'events' (the same events in binary) "
+         "or 'binary' (an AST file, see parse/ast_file.hpp; one input only)")
+        ("stream", "print each design unit of the text formats as soon as it has been parsed (the event formats always do)")
+        ("timing,t", "report grammar compile, read, parse and output times on stderr")
+        ("engine,e", po::value< std::string >()->default_value("generated"),
+         "parser to use: 'generated' (compiled from the grammar at build time) or 'interpreter'")
+        ("split", "also parse each big file on --jobs threads, split at its design units")
+        ("cache", po::value< std::string >(),
+         "keep parsed trees in this directory and reuse them for files that haven't changed")
+        ("cache-size", po::value< unsigned >()->default_value(1024),
+         "size limit of the --cache directory in MB; the least recently used trees are deleted first")
+        ("no-scan", "don't tokenize the input before parsing it with the generated parser")
+        ("profile", "instead of printing the AST, parse with the interpreter and print a table of each grammar "
+         "rule's calls, successes, packrat cache hits, bytes matched and time, the most expensive first")
+        ("profile-json", po::value< std::string >(), "write the same profile to this file as JSON")
+        ("memo-profile", po::value< std::string >(),
+         "instead of printing the AST, write the list of rules worth memoising "
+         "(see grammar/vhdl2008.memo) to this file")
+        ("serve", "keep running, answering JSON-RPC requests to parse and query files, one per line "
+         "on stdin, on --jobs threads (see parse/server.hpp)")
+        ("socket", po::value< std::string >(), "with --serve, take requests from clients of this Unix domain socket instead")
 //        ("output-file,o", po::value< std::string >(), "AST output file")
         ;
 
@@ -70,11 +218,77 @@ int main(int argc, char* argv[])
             return 0;
         }
 
+        show_timing = varMap.count("timing") > 0;
+
+        if (varMap.count("memo-profile") > 0)
+        {
+            memo_file_name = varMap["memo-profile"].as< std::string >();
+        }
+
+        profile = varMap.count("profile") > 0;
+        if (varMap.count("profile-json") > 0)
+        {
+            profile_file_name = varMap["profile-json"].as< std::string >();
+        }
+
+        auto engine_name = varMap["engine"].as< std::string >();
+        if (engine_name == "interpreter")
+        {
+            options.engine = Vhdl2008Engine::Interpreter;
+        }
+        else if (engine_name != "generated")
+        {
+            std::cerr << "Error: unknown engine '" << engine_name << "'\n";
+            return 1;
+        }
+
+        auto format_name = varMap["format"].as< std::string >();
+        if (format_name == "binary")
+        {
+            options.format = Vhdl2008Format::Binary;
+        }
+        else if (format_name == "compact")
+        {
+            options.format = Vhdl2008Format::Compact;
+        }
+        else if (format_name == "jsonl")
+        {
+            options.format = Vhdl2008Format::JsonLines;
+        }
+        else if (format_name == "events")
+        {
+            options.format = Vhdl2008Format::Events;
+        }
+        else if (format_name != "text")
+        {
+            std::cerr << "Error: unknown format '" << format_name << "'\n";
+            return 1;
+        }
+
+        options.stream = varMap.count("stream") > 0;
+        options.scan = varMap.count("no-scan") == 0;
+        jobs = std::max(1u, varMap["jobs"].as< unsigned >());
+        if (varMap.count("cache") > 0)
+        {
+            cache_dir_name = varMap["cache"].as< std::string >();
+        }
+        cache_size = varMap["cache-size"].as< unsigned >();
+        if (varMap.count("split") > 0)
+        {
+            options.threads = jobs;
+        }
+
+        serve = varMap.count("serve") > 0;
+        if (varMap.count("socket") > 0)
+        {
+            socket_name = varMap["socket"].as< std::string >();
+        }
+
         if (varMap.count("input-file") > 0)
         {
-            hdl_file_name = varMap["input-file"].as< std::string >();
+            hdl_file_names = varMap["input-file"].as< std::vector<std::string> >();
         }
-        else
+        else if (!serve)
         {
             // Print the help messages
             std::cout << cliOpts << "\n";
@@ -97,26 +311,110 @@ int main(int argc, char* argv[])
 
     // Now do something with the command line information
 
-    fs::path hdl_file_path(hdl_file_name);
-//    fs::path ast_file_path(ast_file_name);
+    if (serve)
+    {
+        // The grammar and the trees stay loaded between requests
+        Vhdl2008Server server(options, jobs);
+        if (!socket_name.empty())
+        {
+            return server.serve_socket(socket_name, std::cerr);
+        }
+        return server.serve(std::cin, std::cout);
+    }
+
+    std::vector<fs::path> hdl_file_paths;
+    for (auto &name : hdl_file_names)
+    {
+        if (!add_input(name, hdl_file_paths))
+        {
+            return 1;
+        }
+    }
 
-    if (exists(hdl_file_path))
+    if (!memo_file_name.empty())
     {
-        if (fs::is_regular_file(hdl_file_path))
+        // One profile over all the files
+        Vhdl2008MemoProfile profile;
+        for (auto &hdl_file_path : hdl_file_paths)
         {
-            // Yes!
-            // Pass it on to the parsing subroutine
-            parse_vhdl_2008(hdl_file_path);
+            if (profile_vhdl_2008_memo(hdl_file_path, profile) != 0)
+            {
+                return 1;
+            }
         }
-        else
+
+        std::ofstream memo_file(memo_file_name);
+        write_memo_list(profile, memo_file);
+        if (memo_file.fail())
         {
-            std::cout << "Error: " << hdl_file_path << " exists, but is not a file; please specify a file.\n";
+            std::cerr << "Error: can't write " << memo_file_name << "\n";
             return 1;
         }
-    } else {
-        std::cout << "Error: " << hdl_file_path << " does not exist; please specify a file.\n";
+        return 0;
+    }
+
+    if (profile || !profile_file_name.empty())
+    {
+        // One profile over all the files
+        Vhdl2008Profile rule_profile;
+        for (auto &hdl_file_path : hdl_file_paths)
+        {
+            if (profile_vhdl_2008(hdl_file_path, rule_profile) != 0)
+            {
+                return 1;
+            }
+        }
+
+        if (profile)
+        {
+            write_profile_table(rule_profile, std::cout);
+        }
+        if (!profile_file_name.empty())
+        {
+            std::ofstream profile_file(profile_file_name);
+            write_profile_json(rule_profile, profile_file);
+            if (profile_file.fail())
+            {
+                std::cerr << "Error: can't write " << profile_file_name << "\n";
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (options.format == Vhdl2008Format::Binary && hdl_file_paths.size() != 1)
+    {
+        std::cerr << "Error: binary output takes exactly one input file\n";
         return 1;
     }
+#ifdef _WIN32
+    if (options.format == Vhdl2008Format::Binary || options.format == Vhdl2008Format::Events)
+    {
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
+
+    std::unique_ptr<AstCache> cache;
+    if (!cache_dir_name.empty())
+    {
+        cache = std::make_unique<AstCache>(cache_dir_name, uint64_t(cache_size) << 20,
+                                           Vhdl2008Parser::grammar());
+        if (!cache->ok())
+        {
+            std::cerr << "Error: can't create the cache directory " << cache_dir_name << "\n";
+            return 1;
+        }
+        options.cache = cache.get();
+    }
+
+    // Pass them on to the parsing subroutine
+    parse_vhdl_2008(hdl_file_paths, jobs, show_timing ? &std::cerr : nullptr, options);
+
+    if (cache)
+    {
+        cache->trim();
+        cache->report(std::cerr);
+    }
 
     return 0;
 }